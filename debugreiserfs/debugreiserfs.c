@@ -5,6 +5,7 @@
 
 #include "debugreiserfs.h"
 #include <com_err.h>
+#include <getopt.h>
 
 reiserfs_filsys_t fs;
 
@@ -20,10 +21,12 @@ Options:\n\
   -j filename\n\t\tprint journal located on the device 'filename'\n\
   \t\tstores the journal in the specified file 'filename.\n\
   -p\t\tsend filesystem metadata to stdout\n\
+  -z\t\tcompress metadata sent by -p with gzip\n\
   -u\t\tread stdin and unpack the metadata\n\
   -S\t\thandle all blocks, not only used\n\
   -1 block\tblock to print\n\
   -q\t\tno speed info\n\
+  --cache-size size\n\t\tmemory for the block cache, K, M or G\n\
   -V\t\tprint version and exit\n\n", argv[0]);\
   exit (16);\
 }
@@ -246,6 +249,11 @@ static char *program_name;
 static char *parse_options(struct debugreiserfs_data *data,
 			   int argc, char *argv[])
 {
+	static struct option options[] = {
+		{"cache-size", required_argument, NULL, CACHE_SIZE_OPTION},
+		{}
+	};
+	long long int cache_size;
 	int c;
 	char *tmp;
 
@@ -260,8 +268,8 @@ static char *parse_options(struct debugreiserfs_data *data,
 		program_name = argv[0];
 
 	while ((c =
-		getopt(argc, argv, "a:b:C:F:SU1:pkn:Nfr:dDomj:JqtZl:LVB:uv"))
-	       != EOF) {
+		getopt_long(argc, argv, "a:b:C:F:SU1:pkn:Nfr:dDomj:JqtZzl:LVB:uv",
+			    options, NULL)) != EOF) {
 		switch (c) {
 		case 'a':	/* -r will read this, -n and -N will write to it */
 			asprintf(&data->map_file, "%s", optarg);
@@ -389,6 +397,10 @@ static char *parse_options(struct debugreiserfs_data *data,
 		case 'Z':
 			data->mode = DO_ZERO;
 			break;
+		case 'z':
+			/* -p compresses what it sends */
+			data->options |= PACK_COMPRESS;
+			break;
 
 		case 'l':	/* --logfile */
 			data->log_file_name = optarg;
@@ -409,6 +421,14 @@ static char *parse_options(struct debugreiserfs_data *data,
 		case 'v':
 			data->options |= BE_VERBOSE;
 			break;
+		case CACHE_SIZE_OPTION:
+			cache_size = misc_str_to_bytes(optarg);
+			if (cache_size <= 0)
+				reiserfs_exit(1,
+					      "Wrong cache size is specified: %s",
+					      optarg);
+			set_buffer_cache_size(cache_size);
+			break;
 		}
 	}
 
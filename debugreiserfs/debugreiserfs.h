@@ -11,6 +11,7 @@
 #include "io.h"
 #include "misc.h"
 #include "reiserfs_lib.h"
+#include "pack.h"
 
 #include "../version.h"
 
@@ -48,6 +49,7 @@ extern reiserfs_filsys_t fs;
 #define PRINT_OBJECTID_MAP	0x80
 #define BE_QUIET 		0x100
 #define BE_VERBOSE 		0x200
+#define PACK_COMPRESS		0x400
 
 /* these moved to reiserfs_fs.h */
 //#define PRINT_TREE_DETAILS
@@ -55,131 +57,6 @@ extern reiserfs_filsys_t fs;
 //#define PRINT_ITEM_DETAILS
 //#define PRINT_DIRECT_ITEMS
 
-// the leaf is stored in compact form:
-// start magic number
-// block number __u32
-// item number __u16
-// struct packed_item
-// ..
-// end magic number
-
-/* we store hash code in high byte of 16 bits */
-#define LEAF_START_MAGIC 0xa6
-#define LEAF_END_MAGIC 0x5a
-
-#define FULL_BLOCK_START_MAGIC 0xb6
-#define FULL_BLOCK_END_MAGIC 0x6b
-#define UNFORMATTED_BITMAP_START_MAGIC 0xc7
-#define UNFORMATTED_BITMAP_END_MAGIC 0x7c
-#define END_MAGIC 0x8d
-#define INTERNAL_START_MAGIC
-#define INTERNAL_START_MAGIC
-#define SEPARATED_JOURNAL_START_MAGIC 0xf8
-#define SEPARATED_JOURNAL_END_MAGIC   0x8f
-
-#define ITEM_START_MAGIC 0x476576
-#define ITEM_END_MAGIC 0x2906504
-
-#define MAP_MAGIC 0xe9
-#define MAP_END_MAGIC 0x9e
-
-/* 12 bits of mask are used to define */
-#define NEW_FORMAT 			0x01	/* 1. 0 here means - old format, 1 - new format */
-#define DIR_ID     			0x02	/* 2. dir_id is stored */
-#define OBJECT_ID  			0x04	/* 3. objectid is stored */
-#define OFFSET_BITS_32 			0x08	/* 4. offset is stored as 32 bit */
-#define OFFSET_BITS_64 			0x10	/* 5. offset is stored as 64 bit */
-#define IH_ENTRY_COUNT 			0x20	/* 6. ih_free_space/ih_entry_count is stored */
-#define IH_FREE_SPACE  			0x20
-#define IH_FORMAT 			0x40	/* 7. ih_format is stored */
-#define WITH_SD_FIRST_DIRECT_BYTE 	0x80	/* 8. for old stat data first_direct_byte is stored */
-#define NLINK_BITS_32 			0x0100	/* 9. nlinks stored in 32 bits */
-#define SIZE_BITS_64  			0x0200	/* 10. size has to be stored in 64 bit */
-#define WHOLE_INDIRECT 			0x0400	/* 11. indirect item is stored with compression */
-#define SAFE_LINK			0x0800	/* 11. indirect item is stored with compression */
-
-#define TYPE_MASK 0x3		/* two lowest bits are used to store item type */
-//#define MASK_MASK 0xffffc /* what is packed: dirid, objectid, etc */
-#define ITEM_LEN_MASK 0xfff00000	/* contents of ih_item_len of item_head */
-
-struct packed_item {
-	__u32 type_2_mask_18_len_12;
-};
-
-static inline void set_pi_type(struct packed_item *pi, __u32 val)
-{
-	set_bit_field_XX(32, pi, val, 0, 2);
-}
-
-static inline __u32 get_pi_type(const struct packed_item *pi)
-{
-	get_bit_field_XX(32, pi, 0, 2);
-}
-
-static inline void set_pi_mask(struct packed_item *pi, __u32 val)
-{
-	set_bit_field_XX(32, pi, val, 2, 18);
-}
-
-static inline __u32 get_pi_mask(const struct packed_item *pi)
-{
-	get_bit_field_XX(32, pi, 2, 18);
-}
-
-static inline void set_pi_item_len(struct packed_item *pi, __u32 val)
-{
-	set_bit_field_XX(32, pi, val, 20, 12);
-}
-
-static inline __u32 get_pi_item_len(const struct packed_item *pi)
-{
-	get_bit_field_XX(32, pi, 20, 12);
-}
-
-#define HAS_DIR_ID      0x01
-#define HAS_GEN_COUNTER 0x02
-#define HAS_STATE       0x04
-#define YURA            0x08
-#define TEA             0x10
-#define R5              0x20
-
-struct packed_dir_entry {
-	__u8 mask;
-	__u16 entrylen;
-};
-
-/* packed_dir_entry.mask is *always* endian safe, since it's 8 bit */
-#define get_pe_entrylen(pe)     (le16_to_cpu((pe)->entrylen))
-#define set_pe_entrylen(pe,v)   ((pe)->entrylen = cpu_to_le16(v))
-
-#define fread8(pv) fread (pv, sizeof (__u8), 1, stdin)
-
-#define fread_le16(pv)\
-{\
-    __le16 tmp; \
-    fread16(&tmp); \
-    *pv = le16_to_cpu(tmp); \
-}
-
-#define fread_le32(pv)\
-{\
-    __le32 tmp; \
-    fread32(&tmp); \
-    *pv = le32_to_cpu(tmp); \
-}
-
-#define fread_le64(pv)\
-{\
-    __le64 tmp; \
-    fread64(&tmp); \
-    *pv = le64_to_cpu(tmp); \
-}
-
-#define fread8(pv) fread (pv, sizeof (__u8), 1, stdin)
-#define fread16(pv) fread (pv, sizeof (__u16), 1, stdin)
-#define fread32(pv) fread (pv, sizeof (__u32), 1, stdin)
-#define fread64(pv) fread (pv, sizeof (__u64), 1, stdin)
-
 #define fwrite_le16(pv)\
 {\
     __le16 tmp = cpu_to_le16(*(pv));\
@@ -198,26 +75,11 @@ struct packed_dir_entry {
     fwrite64(&tmp);\
 }
 
-#define fwrite8(pv) {\
-if (fwrite (pv, sizeof (__u8), 1, stdout) != 1)\
-    reiserfs_panic ("fwrite8 failed: %m");\
-sent_bytes ++;\
-}
-#define fwrite16(pv) {\
-if (fwrite (pv, sizeof (__u16), 1, stdout) != 1)\
-    reiserfs_panic ("fwrite16 failed: %m");\
-sent_bytes += 2;\
-}
-#define fwrite32(pv) {\
-if (fwrite (pv, sizeof (__u32), 1, stdout) != 1)\
-    reiserfs_panic ("fwrite32 failed: %m");\
-sent_bytes += 4;\
-}
-#define fwrite64(pv) {\
-if (fwrite (pv, sizeof (__u64), 1, stdout) != 1)\
-    reiserfs_panic ("fwrite64 failed: %m");\
-sent_bytes += 8;\
-}
+/* the packed stream is put together in memory, see pack.c */
+#define fwrite8(pv) pack_write(pv, sizeof(__u8))
+#define fwrite16(pv) pack_write(pv, sizeof(__u16))
+#define fwrite32(pv) pack_write(pv, sizeof(__u32))
+#define fwrite64(pv) pack_write(pv, sizeof(__u64))
 
 struct debugreiserfs_data {
 	int mode;		/* DO_DUMP | DO_PACK | DO_CORRUPT_ONE... */
@@ -258,6 +120,10 @@ struct debugreiserfs_data {
 #define recovery_file(fs) (data(fs)->recovery_file)
 
 #define be_quiet(fs)  (data(fs)->options & BE_QUIET)
+#define pack_compress(fs)  (data(fs)->options & PACK_COMPRESS)
+
+/* pack.c */
+void pack_write(const void *data, size_t size);
 
 /* stat.c */
 void do_stat(reiserfs_filsys_t fs);
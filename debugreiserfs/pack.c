@@ -4,6 +4,12 @@
  */
 
 #include "debugreiserfs.h"
+#ifdef HAVE_PTHREAD
+#  include <pthread.h>
+#endif
+#ifdef HAVE_LIBZ
+#  include <zlib.h>
+#endif
 
 /* counters for each kind of blocks */
 unsigned int packed, packed_leaves, full_blocks, having_ih_array,	/* blocks with broken block head */
@@ -16,14 +22,266 @@ reiserfs_bitmap_t *what_to_pack;
 unsigned long sent_bytes;	/* how many bytes sent to stdout */
 unsigned long had_to_be_sent;	/* how many bytes were to be sent */
 
+/* The packed stream is put together in a memory buffer. A full buffer is
+   handed over to the writer thread, which compresses it (when -z is given)
+   and writes it to stdout while the next buffer gets filled. Compressed
+   buffers are separate gzip members, together they are a valid gzip file */
+#define PACK_BUFFER_SIZE (1024 * 1024)
+
+struct pack_stream {
+	char *buf;		/* being filled */
+	size_t len;
+	char *full;		/* being written */
+	size_t full_len;
+	unsigned long long offset;	/* bytes in the stream so far */
+	int compress;
+#ifdef HAVE_LIBZ
+	z_stream z;
+	char *zbuf;
+	unsigned long zbuf_size;
+#endif
+#ifdef HAVE_PTHREAD
+	int threaded;
+	int done;
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+};
+
+static struct pack_stream pack_out;
+
+static void pack_write_buffer(char *data, size_t len)
+{
+	ssize_t bytes;
+
+#ifdef HAVE_LIBZ
+	if (pack_out.compress) {
+		deflateReset(&pack_out.z);
+		pack_out.z.next_in = (Bytef *) data;
+		pack_out.z.avail_in = len;
+		pack_out.z.next_out = (Bytef *) pack_out.zbuf;
+		pack_out.z.avail_out = pack_out.zbuf_size;
+		if (deflate(&pack_out.z, Z_FINISH) != Z_STREAM_END)
+			reiserfs_panic("pack_write_buffer: deflate failed");
+		data = pack_out.zbuf;
+		len = pack_out.zbuf_size - pack_out.z.avail_out;
+	}
+#endif
+
+	while (len) {
+		bytes = write(STDOUT_FILENO, data, len);
+		if (bytes < 0 && errno == EINTR)
+			continue;
+		if (bytes <= 0)
+			reiserfs_panic("pack_write_buffer: write failed: %m");
+		data += bytes;
+		len -= bytes;
+	}
+}
+
+#ifdef HAVE_PTHREAD
+static void *pack_writer(void *arg)
+{
+	pthread_mutex_lock(&pack_out.lock);
+	while (1) {
+		while (!pack_out.full_len && !pack_out.done)
+			pthread_cond_wait(&pack_out.cond, &pack_out.lock);
+		if (!pack_out.full_len)
+			break;
+
+		pthread_mutex_unlock(&pack_out.lock);
+		pack_write_buffer(pack_out.full, pack_out.full_len);
+		pthread_mutex_lock(&pack_out.lock);
+
+		pack_out.full_len = 0;
+		pthread_cond_broadcast(&pack_out.cond);
+	}
+	pthread_mutex_unlock(&pack_out.lock);
+	return NULL;
+}
+#endif
+
+static void pack_flush(void)
+{
+	char *tmp;
+
+	if (!pack_out.len)
+		return;
+
+#ifdef HAVE_PTHREAD
+	if (pack_out.threaded) {
+		pthread_mutex_lock(&pack_out.lock);
+		while (pack_out.full_len)
+			pthread_cond_wait(&pack_out.cond, &pack_out.lock);
+		tmp = pack_out.full;
+		pack_out.full = pack_out.buf;
+		pack_out.full_len = pack_out.len;
+		pack_out.buf = tmp;
+		pack_out.len = 0;
+		pthread_cond_broadcast(&pack_out.cond);
+		pthread_mutex_unlock(&pack_out.lock);
+		return;
+	}
+#endif
+	pack_write_buffer(pack_out.buf, pack_out.len);
+	pack_out.len = 0;
+}
+
+void pack_write(const void *data, size_t size)
+{
+	if (pack_out.len + size > PACK_BUFFER_SIZE)
+		pack_flush();
+	memcpy(pack_out.buf + pack_out.len, data, size);
+	pack_out.len += size;
+	pack_out.offset += size;
+	sent_bytes += size;
+}
+
+/* Where in the stream blocks got packed. It is written after END_MAGIC, so
+   a block can be read from the pack without unpacking (see pack.h) */
+struct pack_index_entry {
+	unsigned long block;
+	unsigned long len;
+	unsigned long long offset;
+};
+
+static struct pack_index_entry *pack_index;
+static unsigned long pack_index_nr, pack_index_size;
+
+/* blocks of a journal on a separate device are not indexed */
+static int pack_separated_journal;
+
+static void pack_index_add(unsigned long block, unsigned long long offset)
+{
+	struct pack_index_entry *pie;
+
+	if (pack_index_nr == pack_index_size) {
+		pack_index_size = pack_index_size ? pack_index_size * 2 : 1024;
+		pack_index = expandmem(pack_index,
+				       pack_index_nr * sizeof(*pie),
+				       (pack_index_size - pack_index_nr) *
+				       sizeof(*pie));
+	}
+
+	pie = pack_index + pack_index_nr++;
+	pie->block = block;
+	pie->len = pack_out.offset - offset;
+	pie->offset = offset;
+}
+
+static int comp_index_entries(const void *p1, const void *p2)
+{
+	const struct pack_index_entry *pie1 = p1, *pie2 = p2;
+
+	if (pie1->block != pie2->block)
+		return pie1->block < pie2->block ? -1 : 1;
+	if (pie1->offset != pie2->offset)
+		return pie1->offset < pie2->offset ? -1 : 1;
+	return 0;
+}
+
+/* sort the index by block numbers, when a block got packed more than once
+   the last copy is what unpack leaves on the device */
+static void pack_write_index(unsigned long block_count, __u16 blocksize)
+{
+	struct packed_trailer trailer;
+	struct packed_index_entry pie;
+	unsigned long i, nr = 0;
+
+	qsort(pack_index, pack_index_nr, sizeof(*pack_index),
+	      comp_index_entries);
+
+	memset(&trailer, 0, sizeof(trailer));
+	trailer.pt_index_offset = cpu_to_le64(pack_out.offset);
+
+	for (i = 0; i < pack_index_nr; i++) {
+		if (i + 1 < pack_index_nr &&
+		    pack_index[i + 1].block == pack_index[i].block)
+			continue;
+		pie.pie_block = cpu_to_le32(pack_index[i].block);
+		pie.pie_len = cpu_to_le32(pack_index[i].len);
+		pie.pie_offset = cpu_to_le64(pack_index[i].offset);
+		pack_write(&pie, sizeof(pie));
+		nr++;
+	}
+
+	trailer.pt_index_nr = cpu_to_le32(nr);
+	trailer.pt_block_count = cpu_to_le32(block_count);
+	trailer.pt_blocksize = cpu_to_le16(blocksize);
+	trailer.pt_version = cpu_to_le16(PACKED_VERSION);
+	memcpy(trailer.pt_magic, PACKED_TRAILER_MAGIC,
+	       sizeof(trailer.pt_magic));
+	pack_write(&trailer, sizeof(trailer));
+
+	freemem(pack_index);
+	pack_index = NULL;
+	pack_index_nr = pack_index_size = 0;
+}
+
+static void pack_start(reiserfs_filsys_t fs)
+{
+	fflush(stdout);
+	pack_out.buf = getmem(PACK_BUFFER_SIZE);
+	pack_out.full = getmem(PACK_BUFFER_SIZE);
+
+	if (pack_compress(fs)) {
+#ifdef HAVE_LIBZ
+		/* windowBits + 16 makes deflate write gzip header and trailer */
+		if (deflateInit2(&pack_out.z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+				 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			die("pack_start: deflateInit2 failed");
+		pack_out.zbuf_size = deflateBound(&pack_out.z, PACK_BUFFER_SIZE);
+		pack_out.zbuf = getmem(pack_out.zbuf_size);
+		pack_out.compress = 1;
+#else
+		die("debugreiserfs is built without zlib, -z is not supported");
+#endif
+	}
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&pack_out.lock, NULL);
+	pthread_cond_init(&pack_out.cond, NULL);
+	pack_out.threaded =
+	    !pthread_create(&pack_out.writer, NULL, pack_writer, NULL);
+#endif
+}
+
+static void pack_finish(void)
+{
+	pack_flush();
+
+#ifdef HAVE_PTHREAD
+	if (pack_out.threaded) {
+		pthread_mutex_lock(&pack_out.lock);
+		pack_out.done = 1;
+		pthread_cond_broadcast(&pack_out.cond);
+		pthread_mutex_unlock(&pack_out.lock);
+		pthread_join(pack_out.writer, NULL);
+		pack_out.threaded = 0;
+	}
+	pthread_mutex_destroy(&pack_out.lock);
+	pthread_cond_destroy(&pack_out.cond);
+#endif
+
+#ifdef HAVE_LIBZ
+	if (pack_out.compress) {
+		deflateEnd(&pack_out.z);
+		freemem(pack_out.zbuf);
+		pack_out.compress = 0;
+	}
+#endif
+	freemem(pack_out.buf);
+	freemem(pack_out.full);
+}
+
 static void pack_ih(struct packed_item *pi, struct item_head *ih)
 {
 	__u32 v32;
 	__u16 v16;
 
 	/* send packed item head first */
-	fwrite(pi, sizeof(*pi), 1, stdout);
-	sent_bytes += sizeof(*pi);
+	pack_write(pi, sizeof(*pi));
 
 	/* sen key components which are to be sent */
 	if (get_pi_mask(pi) & DIR_ID) {
@@ -121,8 +379,7 @@ static void pack_indirect(struct packed_item *pi, struct buffer_head *bh,
 		return;
 
 	if (get_pi_mask(pi) & WHOLE_INDIRECT) {
-		fwrite(ind_item, get_ih_item_len(ih), 1, stdout);
-		sent_bytes += get_ih_item_len(ih);
+		pack_write(ind_item, get_ih_item_len(ih));
 		return;
 	}
 
@@ -189,8 +446,7 @@ static void pack_direntry(reiserfs_filsys_t fs, struct packed_item *pi,
 
 		fwrite8(&pe.mask);
 		fwrite_le16(&pe.entrylen);
-		fwrite(name_in_entry(deh, i), pe.entrylen, 1, stdout);
-		sent_bytes += pe.entrylen;
+		pack_write(name_in_entry(deh, i), pe.entrylen);
 		fwrite32(&(deh->deh2_objectid));
 
 		if (pe.mask & HAS_DIR_ID)
@@ -296,9 +552,8 @@ static void pack_full_block(reiserfs_filsys_t fs, struct buffer_head *bh)
 	block = bh->b_blocknr;
 	fwrite_le32(&block);
 
-	fwrite(bh->b_data, fs->fs_blocksize, 1, stdout);
+	pack_write(bh->b_data, fs->fs_blocksize);
 
-	sent_bytes += fs->fs_blocksize;
 	had_to_be_sent += fs->fs_blocksize;
 
 	full_blocks++;
@@ -484,6 +739,7 @@ static void pack_internal(reiserfs_filsys_t fs, struct buffer_head *bh)
 static void send_block(reiserfs_filsys_t fs, struct buffer_head *bh,
 		       int send_unknown)
 {
+	unsigned long long offset = pack_out.offset;
 	int type;
 
 	packed++;
@@ -511,6 +767,9 @@ static void send_block(reiserfs_filsys_t fs, struct buffer_head *bh,
 		break;
 	}
 
+	if (pack_out.offset != offset && !pack_separated_journal)
+		pack_index_add(bh->b_blocknr, offset);
+
 	/* do not send one block twice */
 	reiserfs_bitmap_clear_bit(what_to_pack, bh->b_blocknr);
 }
@@ -578,6 +837,7 @@ static void pack_frozen_data(reiserfs_filsys_t fs)
 			magic16 = SEPARATED_JOURNAL_START_MAGIC;
 			fwrite_le16(&magic16);
 			sent_journal_start_magic = 1;
+			pack_separated_journal = 1;
 		}
 	}
 	block = get_jp_journal_1st_block(sb_jp(fs->fs_ondisk_sb));
@@ -599,6 +859,7 @@ static void pack_frozen_data(reiserfs_filsys_t fs)
 	if (sent_journal_start_magic) {
 		magic16 = SEPARATED_JOURNAL_END_MAGIC;
 		fwrite_le16(&magic16);
+		pack_separated_journal = 0;
 	}
 	reiserfs_warning(stderr, "ok\n");
 	fflush(stderr);
@@ -610,12 +871,16 @@ static void pack_frozen_data(reiserfs_filsys_t fs)
 /* pack all "not data blocks" and correct leaf */
 void pack_partition(reiserfs_filsys_t fs)
 {
+	struct block_scan *scan;
 	struct buffer_head *bh;
 	__u32 magic32;
 	__u16 blocksize;
 	__u16 magic16;
 	unsigned long done = 0, total;
-	unsigned int i;
+	unsigned long i;
+	int type;
+
+	pack_start(fs);
 
 	magic32 = REISERFS_SUPER_MAGIC;
 	fwrite_le32(&magic32);
@@ -633,13 +898,22 @@ void pack_partition(reiserfs_filsys_t fs)
 	/* what's left */
 	total = reiserfs_bitmap_ones(what_to_pack);
 
-	for (i = 0; i < get_sb_block_count(fs->fs_ondisk_sb); i++) {
-		if (!reiserfs_bitmap_test_bit(what_to_pack, i))
-			continue;
+	/* blocks are read and recognized by worker threads, blocks of not
+	   determined format are not sent, so only the rest get to the buffer
+	   cache */
+	scan = block_scan_init(fs->fs_dev, blocksize, reiserfs_bitmap_next_set,
+			       what_to_pack, who_is_this, 0);
 
+	reiserfs_bitmap_for_each_set(what_to_pack, i) {
 		print_how_far(stderr, &done, total, 1, be_quiet(fs));
 
-		bh = bread(fs->fs_dev, i, blocksize);
+		type = block_scan_class(scan, i);
+		if (type == THE_UNKNOWN) {
+			reiserfs_bitmap_clear_bit(what_to_pack, i);
+			continue;
+		}
+
+		bh = block_scan_bread(scan, i);
 		if (!bh) {
 			reiserfs_warning(stderr, "could not read block %lu\n",
 					 i);
@@ -650,9 +924,12 @@ void pack_partition(reiserfs_filsys_t fs)
 			   0 /*do not send block of not determined format */ );
 		brelse(bh);
 	}
+	block_scan_done(scan);
 
 	magic16 = END_MAGIC;
 	fwrite_le16(&magic16);
+	pack_write_index(get_sb_block_count(fs->fs_ondisk_sb), blocksize);
+	pack_finish();
 
 	fprintf(stderr, "\nPacked %u blocks:\n"
 		"\tcompessed %u\n"
@@ -671,10 +948,13 @@ void pack_partition(reiserfs_filsys_t fs)
 
 void pack_one_block(reiserfs_filsys_t fs, unsigned long block)
 {
+	unsigned long long offset;
 	__u32 magic32;
 	__u16 magic16;
 	struct buffer_head *bh;
 
+	pack_start(fs);
+
 	// reiserfs magic
 	magic32 = REISERFS_SUPER_MAGIC;
 	fwrite_le32(&magic32);
@@ -684,19 +964,26 @@ void pack_one_block(reiserfs_filsys_t fs, unsigned long block)
 
 	bh = bread(fs->fs_dev, block, fs->fs_blocksize);
 
-	if (!bh)
+	if (!bh) {
+		pack_finish();
 		return;
+	}
 
+	offset = pack_out.offset;
 	if (who_is_this(bh->b_data, bh->b_size) == THE_LEAF)
 		pack_leaf(fs, bh);
 	else
 		pack_full_block(fs, bh);
+	pack_index_add(block, offset);
 
 	brelse(bh);
 
 	// end magic
 	magic16 = END_MAGIC;
 	fwrite_le16(&magic16);
+	pack_write_index(get_sb_block_count(fs->fs_ondisk_sb),
+			 fs->fs_blocksize);
+	pack_finish();
 
 	fprintf(stderr, "Done\n");
 }
@@ -6,15 +6,21 @@
 #include "debugreiserfs.h"
 #include <regex.h>
 #include <obstack.h>
-#include <search.h>
+#include <limits.h>
 
 #define obstack_chunk_alloc malloc
 #define obstack_chunk_free free
 
 /* -n pattern scans the area (on-disk bitmap, or all the device or extern
    bitmap) and looks for every name matching the pattern. All those names get
-   stored in 'name_store' and are indexed by name (name_index) and by a key
-   they point to (key_index) */
+   stored in 'name_store' and are hashed by the name together with the keys
+   it has (name_table) and by a key they point to (key_table). Items are
+   looked up in key_table in the same pass over the area: a leaf having items
+   of files which are not found yet is remembered in 'deferred' and is read
+   again once all names are known, if it is needed then. With a narrow
+   pattern nearly every object of the area gets there, so 'deferred' may
+   take a part of the buffer cache size only. When it gets bigger, every
+   leaf is read again instead */
 
 struct obstack name_store;
 struct obstack item_store;
@@ -22,8 +28,6 @@ struct obstack item_store;
 int saved_names;
 int saved_items;
 int skipped_names;
-void *key_index;
-void *name_index;
 
 regex_t pattern;
 
@@ -39,125 +43,175 @@ struct saved_name {
 	unsigned long block;	/* where we saw the name for the first time */
 	unsigned short count;	/* how many times the name appeared */
 
-	void *items;
-	struct saved_name *name_next;	/* list of identical names */
+	struct saved_item *items;
+	unsigned int items_nr;
+
+	struct saved_name *name_hash_next;	/* in name_table */
+	struct saved_name *key_hash_next;	/* in key_table */
+	unsigned int nr;	/* names are numbered in order they are found */
 
 	unsigned short name_len;
 	char name[1];
 };
 
-/* attach item to every name in the list */
-static void store_item(struct saved_name *name, const struct buffer_head *bh,
-		       const struct item_head *ih, int pos)
+/* chained hash table of saved names, size is a power of 2 */
+struct name_table {
+	struct saved_name **heads;
+	unsigned long size;
+	unsigned long count;
+};
+
+static struct name_table name_table, key_table;
+
+/* all names in order they were found */
+static struct saved_name **names;
+
+#define NAME_TABLE_MIN_SIZE 1024
+
+static unsigned long hash_short_key(__u32 dirid, __u32 objectid)
 {
-	struct saved_item *new;
-	void *vp;
-	struct saved_item *item_in;
+	unsigned long hash;
 
-	new = obstack_alloc(&item_store, sizeof(struct saved_item));
-	new->si_ih = *ih;
-	new->si_block = bh->b_blocknr;
-	new->si_item_num = ih - item_head(bh, 0);
-	new->si_next = 0;
-	new->si_entry_pos = pos;
+	hash = dirid * 0x9e3779b1UL;
+	hash ^= objectid + 0x7f4a7c15UL + (hash << 6) + (hash >> 2);
+	return hash ^ (hash >> 15);
+}
 
-	vp = tfind(new, &name->items, comp_keys);
-	if (vp) {
-		item_in = *(void **)vp;
-		/* add item to the end of list of items having this key */
-		while (1) {
-			if (!item_in->si_next) {
-				item_in->si_next = new;
-				break;
+static unsigned long hash_name(const struct saved_name *name)
+{
+	unsigned long hash = 2166136261UL;
+	int i;
+
+	for (i = 0; i < name->name_len; i++)
+		hash = (hash ^ (unsigned char)name->name[i]) * 16777619UL;
+	hash ^= hash_short_key(name->dirid, name->objectid);
+	return hash ^ hash_short_key(name->parent_dirid,
+				     name->parent_objectid) * 31;
+}
+
+static struct saved_name **name_hash_next(struct saved_name *name,
+					  struct name_table *table)
+{
+	return table == &name_table ? &name->name_hash_next :
+	    &name->key_hash_next;
+}
+
+static unsigned long name_hash(const struct saved_name *name,
+			       const struct name_table *table)
+{
+	return table == &name_table ? hash_name(name) :
+	    hash_short_key(name->dirid, name->objectid);
+}
+
+static void name_table_insert(struct name_table *table,
+			      struct saved_name *name)
+{
+	struct saved_name **heads, *cur, *next;
+	unsigned long i, size, slot;
+
+	if (table->count >= table->size) {
+		/* grow the table twice */
+		size = table->size ? table->size * 2 : NAME_TABLE_MIN_SIZE;
+		heads = getmem(size * sizeof(*heads));
+		for (i = 0; i < table->size; i++) {
+			for (cur = table->heads[i]; cur; cur = next) {
+				next = *name_hash_next(cur, table);
+				slot = name_hash(cur, table) & (size - 1);
+				*name_hash_next(cur, table) = heads[slot];
+				heads[slot] = cur;
 			}
-			item_in = item_in->si_next;
 		}
-	} else
-		tsearch(new, &name->items, comp_keys);
+		if (table->heads)
+			freemem(table->heads);
+		table->heads = heads;
+		table->size = size;
+	}
 
-	saved_items++;
+	slot = name_hash(name, table) & (table->size - 1);
+	*name_hash_next(name, table) = table->heads[slot];
+	table->heads[slot] = name;
+	table->count++;
 }
 
-static int comp_names(const void *p1, const void *p2)
+/* first name pointing to the object */
+static struct saved_name *find_key(__u32 dirid, __u32 objectid)
 {
-	struct saved_name *name1, *name2;
+	struct saved_name *cur;
 
-	name1 = (struct saved_name *)p1;
-	name2 = (struct saved_name *)p2;
+	if (!key_table.size)
+		return NULL;
 
-	return strcmp(name1->name, name2->name);
+	cur = key_table.heads[hash_short_key(dirid, objectid) &
+			      (key_table.size - 1)];
+	for (; cur; cur = cur->key_hash_next)
+		if (cur->dirid == dirid && cur->objectid == objectid)
+			return cur;
+	return NULL;
 }
 
-static int comp_pointed(const void *p1, const void *p2)
+/* attach item to the name */
+static void store_item(struct saved_name *name, const struct buffer_head *bh,
+		       const struct item_head *ih, int pos)
 {
-	struct saved_name *name1, *name2;
+	struct saved_item *new;
+
+	new = obstack_alloc(&item_store, sizeof(struct saved_item));
+	new->si_ih = *ih;
+	new->si_block = bh->b_blocknr;
+	new->si_item_num = ih - item_head(bh, 0);
+	new->si_entry_pos = pos;
 
-	name1 = (struct saved_name *)p1;
-	name2 = (struct saved_name *)p2;
+	/* items get sorted when they are saved */
+	new->si_next = name->items;
+	name->items = new;
+	name->items_nr++;
 
-	return comp_short_keys(&name1->dirid, &name2->dirid);
+	saved_items++;
 }
 
 /* we consider name found only if it points to the same object and from the
    same directory */
-static int name_found(struct saved_name *name, struct saved_name **name_in)
+static struct saved_name *name_found(struct saved_name *name)
 {
-	void *vp;
 	struct saved_name *cur;
 
-	vp = tfind(name, &name_index, comp_names);
-	if (!vp) {
-		*name_in = 0;
-		return 0;
-	}
-
-	*name_in = *(void **)vp;
+	if (!name_table.size)
+		return NULL;
 
-	/* check every name in the list */
-	cur = *name_in;
-	while (cur) {
-		if (!not_of_one_file(&name->dirid, &cur->dirid) &&
-		    !not_of_one_file(&name->parent_dirid, &cur->parent_dirid)) {
+	cur = name_table.heads[hash_name(name) & (name_table.size - 1)];
+	for (; cur; cur = cur->name_hash_next) {
+		if (cur->name_len == name->name_len &&
+		    !not_of_one_file(&name->dirid, &cur->dirid) &&
+		    !not_of_one_file(&name->parent_dirid, &cur->parent_dirid) &&
+		    !memcmp(cur->name, name->name, name->name_len)) {
 			cur->count++;
-			*name_in = cur;
-			return 1;
+			return cur;
 		}
-		cur = cur->name_next;
 	}
-
-	return 0;
+	return NULL;
 }
 
 /* add key name is pointing to to the index of keys. If there was already name
    pointing to this key - add pointer to that name */
 static void add_key(struct saved_name *name)
 {
-	void *vp;
+	struct saved_name *first;
 
-	vp = tfind(name, &key_index, comp_pointed);
-	if (vp) {
-		/* */
-		name->first_name = *(void **)vp;
-	} else {
-		tsearch(name, &key_index, comp_pointed);
-	}
+	first = find_key(name->dirid, name->objectid);
+	if (first)
+		name->first_name = first;
+	else
+		name_table_insert(&key_table, name);
 }
 
-static void add_name(struct saved_name *name, struct saved_name *name_in)
+static void add_name(struct saved_name *name)
 {
-	if (name_in) {
-		/* add name to the end of list of identical names */
-		while (1) {
-			if (!name_in->name_next) {
-				name_in->name_next = name;
-				break;
-			}
-			name_in = name_in->name_next;
-		}
-	} else {
-		/* add name into name index */
-		tsearch(name, &name_index, comp_names);
-	}
+	if (!(saved_names % NAME_TABLE_MIN_SIZE))
+		names = expandmem(names, saved_names * sizeof(*names),
+				  NAME_TABLE_MIN_SIZE * sizeof(*names));
+	name->nr = saved_names;
+	names[saved_names++] = name;
+	name_table_insert(&name_table, name);
 }
 
 /* take each name matching to a given pattern, */
@@ -168,7 +222,7 @@ static void scan_for_name(struct buffer_head *bh)
 	struct reiserfs_de_head *deh;
 	int namelen;
 	char *name;
-	struct saved_name *new, *name_in;
+	struct saved_name *new;
 	char ch;
 	int retval;
 	int min_entry_size = 1;
@@ -222,25 +276,24 @@ static void scan_for_name(struct buffer_head *bh)
 
 			new->count = 1;
 			new->items = 0;
+			new->items_nr = 0;
 
 			/* name */
 			new->name_len = namelen;
 			memcpy(new->name, name, namelen);
 			new->name[namelen] = 0;
-			new->name_next = 0;
 
 			/*
 			   reiserfs_warning (stdout, "\n(%K):%s-->(%K) - ", &new->parent_dirid,
 			   new->name, &new->dirid);
 			 */
-			if (name_found(new, &name_in)) {
+			if (name_found(new)) {
 				/* there was already exactly this name */
 				obstack_free(&name_store, new);
 				continue;
 			}
 
-			saved_names++;
-			add_name(new, name_in);
+			add_name(new);
 			add_key(new);
 		}		/* for each entry */
 	}			/* for each item */
@@ -272,23 +325,22 @@ static struct saved_name *scan_for_key(const struct reiserfs_key *key)
 	new->block = 0;
 	new->count = 1;
 	new->items = 0;
+	new->items_nr = 0;
 
 	/* name */
 	new->name_len = strlen(name);
 	memcpy(new->name, name, new->name_len);
 	new->name[new->name_len] = 0;
-	new->name_next = 0;
 
 	free(name);
 
-	if (name_found(new, &name_in)) {
+	if ((name_in = name_found(new)) != NULL) {
 		/* there was already exactly this name */
 		obstack_free(&name_store, new);
 		return name_in;
 	}
 
-	saved_names++;
-	add_name(new, name_in);
+	add_name(new);
 
 	return new;
 }
@@ -332,14 +384,73 @@ static int comp_token_key(const struct buffer_head *bh,
 	return 0;
 }
 
+/* objects of a leaf which had no names when the leaf was scanned */
+struct deferred_key {
+	__u32 dirid;
+	__u32 objectid;
+	__u32 block;
+};
+
+static struct deferred_key *deferred;
+static unsigned long deferred_nr;
+static int deferred_overflow;	/* all leaves are to be read again */
+
+#define DEFERRED_CHUNK 4096
+#define DEFERRED_MEMORY_FRACTION 4
+
+static unsigned long deferred_limit(void)
+{
+	unsigned long limit;
+
+	limit = get_buffer_cache_size() / DEFERRED_MEMORY_FRACTION;
+	return limit < INT_MAX ? limit : INT_MAX;
+}
+
+static void defer_key(const struct reiserfs_key *key, unsigned long block)
+{
+	struct deferred_key *last = deferred + deferred_nr - 1;
+
+	if (deferred_overflow)
+		return;
+
+	/* items of one object are next to each other in a leaf */
+	if (deferred_nr && last->block == block &&
+	    last->dirid == get_key_dirid(key) &&
+	    last->objectid == get_key_objectid(key))
+		return;
+
+	if (!(deferred_nr % DEFERRED_CHUNK)) {
+		if ((deferred_nr + DEFERRED_CHUNK) * sizeof(*deferred) >
+		    deferred_limit()) {
+			if (deferred)
+				freemem(deferred);
+			deferred = NULL;
+			deferred_nr = 0;
+			deferred_overflow = 1;
+			return;
+		}
+		deferred = expandmem(deferred, deferred_nr * sizeof(*deferred),
+				     DEFERRED_CHUNK * sizeof(*deferred));
+	}
+
+	deferred[deferred_nr].dirid = get_key_dirid(key);
+	deferred[deferred_nr].objectid = get_key_objectid(key);
+	deferred[deferred_nr].block = block;
+	deferred_nr++;
+}
+
 /* take every item, look for its key in the key index, if it is found - store
-   item in the sorted list of items of a file */
-static void scan_items(const struct buffer_head *bh, const struct reiserfs_key *key)
+   item in the list of items of a file. When @deferred_from is set, only
+   items of objects deferred for the leaf are looked at */
+static void scan_items(const struct buffer_head *bh,
+		       const struct reiserfs_key *key,
+		       struct deferred_key *deferred_from,
+		       struct deferred_key *deferred_to)
 {
 	int i, i_num, pos;
 	struct item_head *ih;
 	struct saved_name *name_in_store;
-	void *res;
+	struct deferred_key *dk;
 
 	ih = item_head(bh, 0);
 	i_num = leaf_item_number_estimate(bh);
@@ -350,13 +461,26 @@ static void scan_items(const struct buffer_head *bh, const struct reiserfs_key *
 
 			name_in_store = scan_for_key(&ih->ih_key);
 		} else {
-			if (!
-			    (res =
-			     tfind(&ih->ih_key, &key_index, comp_pointed)))
+			name_in_store = find_key(get_key_dirid(&ih->ih_key),
+						 get_key_objectid(&ih->ih_key));
+			if (deferred_from) {
+				for (dk = deferred_from; dk < deferred_to; dk++)
+					if (dk->dirid ==
+					    get_key_dirid(&ih->ih_key) &&
+					    dk->objectid ==
+					    get_key_objectid(&ih->ih_key))
+						break;
+				if (dk == deferred_to)
+					continue;
+			}
+			if (!name_in_store) {
+				/* a name pointing to it can be found later */
+				if (!deferred_from)
+					defer_key(&ih->ih_key, bh->b_blocknr);
 				continue;
+			}
 
 			/* name pointing to this key found */
-			name_in_store = *(struct saved_name **)res;
 			pos = -1;
 		}
 
@@ -364,6 +488,92 @@ static void scan_items(const struct buffer_head *bh, const struct reiserfs_key *
 	}
 }
 
+/* read every leaf of the area again and take items of files whose names
+   were found after the leaf had been scanned. Leaves are scanned in order of
+   block numbers and the first name of a file keeps the block it was found
+   in, so items stored already are not stored twice */
+static void rescan_leaves(reiserfs_filsys_t fs)
+{
+	struct readahead *ra;
+	struct buffer_head *bh;
+	struct item_head *ih;
+	struct saved_name *name;
+	unsigned long i;
+	int j, i_num, type;
+
+	ra = readahead_init(fs->fs_dev, fs->fs_blocksize,
+			    reiserfs_bitmap_next_set, input_bitmap(fs), 0);
+	reiserfs_bitmap_for_each_set(input_bitmap(fs), i) {
+		bh = readahead_bread(ra, i);
+		if (!bh)
+			/* it has been reported already */
+			continue;
+		type = who_is_this(bh->b_data, bh->b_size);
+		if (type != THE_LEAF && type != HAS_IH_ARRAY) {
+			brelse(bh);
+			continue;
+		}
+
+		ih = item_head(bh, 0);
+		i_num = leaf_item_number_estimate(bh);
+		for (j = 0; j < i_num; j++, ih++) {
+			name = find_key(get_key_dirid(&ih->ih_key),
+					get_key_objectid(&ih->ih_key));
+			if (name && name->block > bh->b_blocknr)
+				store_item(name, bh, ih, -1);
+		}
+		brelse(bh);
+	}
+	readahead_done(ra);
+	deferred_overflow = 0;
+}
+
+/* read leaves again which have items of files found after the leaves were
+   scanned */
+static void resolve_deferred_items(reiserfs_filsys_t fs)
+{
+	reiserfs_bitmap_t *to_read;
+	struct readahead *ra;
+	struct buffer_head *bh;
+	unsigned long i, j, first;
+
+	if (deferred_overflow) {
+		rescan_leaves(fs);
+		return;
+	}
+
+	to_read = reiserfs_create_bitmap(get_sb_block_count(fs->fs_ondisk_sb));
+	for (i = 0; i < deferred_nr; i++)
+		if (find_key(deferred[i].dirid, deferred[i].objectid))
+			reiserfs_bitmap_set_bit(to_read, deferred[i].block);
+
+	ra = readahead_init(fs->fs_dev, fs->fs_blocksize,
+			    reiserfs_bitmap_next_set, to_read, 0);
+	first = 0;
+	reiserfs_bitmap_for_each_set(to_read, i) {
+		/* deferred keys are in order the leaves were scanned */
+		while (deferred[first].block != i)
+			first++;
+		for (j = first; j < deferred_nr && deferred[j].block == i; j++) ;
+
+		bh = readahead_bread(ra, i);
+		if (!bh) {
+			printf("could not read block %lu\n", i);
+			continue;
+		}
+		scan_items(bh, NULL, deferred + first, deferred + j);
+		brelse(bh);
+		first = j;
+	}
+	readahead_done(ra);
+	reiserfs_delete_bitmap(to_read);
+
+	if (deferred)
+		freemem(deferred);
+	deferred = NULL;
+	deferred_nr = 0;
+}
+
 /* FIXME: does not work for long files */
 struct version {
 	int flag;		/* direct or indirect */
@@ -765,16 +975,34 @@ void print_map(reiserfs_filsys_t fs)
 static FILE *fp = 0;
 FILE *log_to;
 
-static void save_items(const void *nodep, VISIT value, int level)
+/* items of a file are saved in order of their keys, items with equal keys
+   in order they were found */
+static int comp_saved_items(const void *p1, const void *p2)
 {
-	struct saved_item *item;
+	const struct saved_item *item1 = *(const struct saved_item **)p1;
+	const struct saved_item *item2 = *(const struct saved_item **)p2;
+	int ret;
+
+	ret = comp_keys(&item1->si_ih.ih_key, &item2->si_ih.ih_key);
+	if (ret)
+		return ret;
+	if (item1->si_block != item2->si_block)
+		return item1->si_block < item2->si_block ? -1 : 1;
+	return item1->si_item_num - item2->si_item_num;
+}
 
-	if (value != leaf && value != postorder)
-		return;
+static void save_items(struct saved_name *name)
+{
+	struct saved_item **items, *item;
+	unsigned int i;
 
-	item = *(struct saved_item **)nodep;
+	items = getmem(name->items_nr * sizeof(*items));
+	for (i = 0, item = name->items; item; item = item->si_next)
+		items[i++] = item;
+	qsort(items, name->items_nr, sizeof(*items), comp_saved_items);
 
-	while (item) {
+	for (i = 0; i < name->items_nr; i++) {
+		item = items[i];
 		if (fp) {
 			fwrite(item,
 			       sizeof(struct saved_item) -
@@ -798,49 +1026,58 @@ static void save_items(const void *nodep, VISIT value, int level)
 
 			}
 		}
-
-		item = item->si_next;
 	}
+	freemem(items);
+}
+
+/* names are taken in order of their spelling, identical names in order
+   they were found */
+static int comp_saved_names(const void *p1, const void *p2)
+{
+	const struct saved_name *name1 = *(const struct saved_name **)p1;
+	const struct saved_name *name2 = *(const struct saved_name **)p2;
+	int ret;
+
+	ret = strcmp(name1->name, name2->name);
+	if (ret)
+		return ret;
+	return name1->nr < name2->nr ? -1 : 1;
 }
 
-static void make_map(const void *nodep, VISIT value, int level)
+static void make_map(void)
 {
 	struct saved_name *name;
 	char *file_name = 0;
-	static int nr = 0;
+	int nr = 0;
+	int i;
 
-	name = *(struct saved_name **)nodep;
+	qsort(names, saved_names, sizeof(*names), comp_saved_names);
 
-	if (value == leaf || value == postorder) {
-		while (name) {
-			if (map_file(fs)) {
-				asprintf(&file_name, "%s.%d", map_file(fs),
-					 ++nr);
-				reiserfs_warning(log_to,
-						 "%d - (%d): [%K]:\"%s\": stored in the %s\n",
-						 nr, name->count,
-						 &name->parent_dirid,
-						 name->name, file_name);
-
-				if (fp == 0) {
-					fp = fopen(file_name, "w+");
-					if (!fp) {
-						reiserfs_exit(1,
-							      "could open %s: %m",
-							      file_name);
-					}
+	for (i = 0; i < saved_names; i++) {
+		name = names[i];
+		if (map_file(fs)) {
+			asprintf(&file_name, "%s.%d", map_file(fs), ++nr);
+			reiserfs_warning(log_to,
+					 "%d - (%d): [%K]:\"%s\": stored in the %s\n",
+					 nr, name->count, &name->parent_dirid,
+					 name->name, file_name);
+
+			if (fp == 0) {
+				fp = fopen(file_name, "w+");
+				if (!fp) {
+					reiserfs_exit(1, "could open %s: %m",
+						      file_name);
 				}
 			}
+		}
 
-			if (name->items)
-				twalk(name->items, save_items);
+		if (name->items)
+			save_items(name);
 
-			name = name->name_next;
-			if (fp) {
-				fclose(fp);
-				fp = NULL;
-				free(file_name);
-			}
+		if (fp) {
+			fclose(fp);
+			fp = NULL;
+			free(file_name);
 		}
 	}
 }
@@ -1002,12 +1239,13 @@ static void scan_for_key(struct buffer_head *bh, struct reiserfs_key *key)
 void do_scan(reiserfs_filsys_t fs)
 {
 	unsigned long i;
+	struct block_scan *scan;
 	struct buffer_head *bh;
 	int type;
 	char *answer = 0;
 	size_t n = 0;
 	struct reiserfs_key key = { 0, 0, };
-	unsigned long done, total;
+	unsigned long done, total, leaves = 0;
 
 	if (debug_mode(fs) == DO_LOOK_FOR_NAME) {
 		/* look for a file in using tree algorithms */
@@ -1017,11 +1255,9 @@ void do_scan(reiserfs_filsys_t fs)
 
 	/* scan area of disk and store all names matching the pattern */
 
-	/* initialize storage and two indexes */
+	/* initialize storage */
 	obstack_init(&name_store);
 	obstack_init(&item_store);
-	key_index = 0;
-	name_index = 0;
 
 	total = reiserfs_bitmap_ones(input_bitmap(fs));
 
@@ -1045,50 +1281,19 @@ void do_scan(reiserfs_filsys_t fs)
 		getline(&answer, &n, stdin);
 		set_key_objectid(&key, atoi(answer));
 		reiserfs_warning(stderr, "looking for (%K)\n", &key);
+		printf("%lu bits set in bitmap\n", total);
 	}
 
-	if (debug_mode(fs) == DO_SCAN_FOR_NAME) {
-		done = 0;
-		for (i = 0; i < get_sb_block_count(fs->fs_ondisk_sb); i++) {
-			if (!reiserfs_bitmap_test_bit(input_bitmap(fs), i))
-				continue;
-			bh = bread(fs->fs_dev, i, fs->fs_blocksize);
-			if (!bh) {
-				printf("could not read block %lu\n", i);
-				continue;
-			}
-			type = who_is_this(bh->b_data, bh->b_size);
-			if (type == THE_LEAF || type == HAS_IH_ARRAY)
-				scan_for_name(bh);
-			else
-				reiserfs_bitmap_clear_bit(input_bitmap(fs), i);
-			brelse(bh);
-			print_how_far(stderr, &done, total, 1, be_quiet(fs));
-		}
-	}
-
-	fprintf(stderr, "\n");
-	if (debug_mode(fs) == DO_SCAN_FOR_NAME)
-		fprintf(stderr,
-			"There were found %d names matching the pattern \"%s\", %d names skipped\n",
-			saved_names, name_pattern(fs), skipped_names);
-	fflush(stderr);
-
-	/* step 2: */
+	/* names and items are collected in one pass. Blocks are read and
+	   recognized by worker threads, only leaves get to the buffer cache */
 	done = 0;
-	total = reiserfs_bitmap_ones(input_bitmap(fs));
-	printf("%lu bits set in bitmap\n", total);
-	for (i = 0; i < get_sb_block_count(fs->fs_ondisk_sb); i++) {
-		int type;
+	scan = block_scan_init(fs->fs_dev, fs->fs_blocksize,
+			       reiserfs_bitmap_next_set, input_bitmap(fs),
+			       who_is_this, 0);
+	reiserfs_bitmap_for_each_set(input_bitmap(fs), i) {
+		print_how_far(stderr, &done, total, 1, be_quiet(fs));
 
-		if (!reiserfs_bitmap_test_bit(input_bitmap(fs), i))
-			continue;
-		bh = bread(fs->fs_dev, i, fs->fs_blocksize);
-		if (!bh) {
-			printf("could not read block %lu\n", i);
-			continue;
-		}
-		type = who_is_this(bh->b_data, bh->b_size);
+		type = block_scan_class(scan, i);
 		switch (type) {
 		case THE_JDESC:
 			if (!get_key_dirid(&key))
@@ -1106,25 +1311,46 @@ void do_scan(reiserfs_filsys_t fs)
 			break;
 		case THE_LEAF:
 		case HAS_IH_ARRAY:
-			scan_items(bh,
-				   (debug_mode(fs) ==
-				    DO_SCAN_FOR_NAME ? NULL : &key));
-			break;
+			bh = block_scan_bread(scan, i);
+			if (!bh) {
+				printf("could not read block %lu\n", i);
+				break;
+			}
+			leaves++;
+			if (debug_mode(fs) == DO_SCAN_FOR_NAME) {
+				scan_for_name(bh);
+				scan_items(bh, NULL, NULL, NULL);
+			} else
+				scan_items(bh, &key, NULL, NULL);
+			brelse(bh);
+			continue;
+		case BLOCK_SCAN_ERROR:
+			printf("could not read block %lu\n", i);
+			continue;
 		default:
 			break;
 		}
 
-		brelse(bh);
-		print_how_far(stderr, &done, total, 1, be_quiet(fs));
+		/* only leaves are left in the area */
+		if (debug_mode(fs) == DO_SCAN_FOR_NAME)
+			reiserfs_bitmap_clear_bit(input_bitmap(fs), i);
 	}
-	fprintf(stderr, "\nThere were %d items saved\n", saved_items);
+	block_scan_done(scan);
 
-	/* ok, print what we found */
-	/*twalk (name_index, print_file); */
+	fprintf(stderr, "\n");
+	if (debug_mode(fs) == DO_SCAN_FOR_NAME) {
+		fprintf(stderr,
+			"There were found %d names matching the pattern \"%s\", %d names skipped\n",
+			saved_names, name_pattern(fs), skipped_names);
+		printf("%lu bits set in bitmap\n", leaves);
+		fflush(stderr);
 
-	/* create map for every file in */
-	twalk(name_index, make_map);
+		/* items of files whose names were found later than the items */
+		resolve_deferred_items(fs);
+	}
 
-	/* print names of files we have map of in a file 'file.list' */
-	/*twalk (name_index, print_name); */
+	fprintf(stderr, "There were %d items saved\n", saved_items);
+
+	/* create map for every file in */
+	make_map();
 }
@@ -4,110 +4,322 @@
  */
 
 #include "debugreiserfs.h"
-#include <search.h>
-#include <obstack.h>
 
-#define obstack_chunk_alloc malloc
-#define obstack_chunk_free free
+/* read blocks marked in debug_bitmap and collect statistic of it. The
+   summary goes to stderr, histograms are printed to stdout one value per
+   line:
+	stat <name> <value>
+	hist <name> <lower bound of the bucket> <value>
+*/
+
+/* number of buckets of histograms over powers of 2: bucket 0 counts
+   zeros, bucket n counts values from 2^(n-1) to 2^n - 1 */
+#define LOG2_BUCKETS 65
 
-/* try to find blocks which contain only items which are */
+/* leaf fill factor is counted in 10% steps, 100% gets its own bucket */
+#define FILL_BUCKETS 11
 
-/* read blocks marked in debug_bitmap and collect statistic of it:
- number of stat data */
 struct {
 	unsigned long all;
-	unsigned long items[5];
-	unsigned long unique_keys;	/* keys of stat datas */
-	unsigned long unique_entry_keys;	/* keys which appear in directory entries */
-	unsigned long names;	/* dir entries but "." and ".." */
-	unsigned long dir_blocks;	/* block containing only one directory item */
+	unsigned long items[TYPE_MAXTYPE + 1];
 	unsigned long unique_items;
+	unsigned long unique[TYPE_MAXTYPE + 1];
 	unsigned long leaves;
 	unsigned long blocks_to_skip;
+
+	unsigned long files;	/* regular files */
+	unsigned long dirs;
+	unsigned long pointers;	/* non-zero pointers of indirect items */
+	unsigned long extents;	/* runs of consecutive pointers */
+
+	unsigned long *items_per_leaf;
+	unsigned int max_items;
+	unsigned long leaf_fill[FILL_BUCKETS];
+	unsigned long file_size[LOG2_BUCKETS];
+	unsigned long dir_entries[LOG2_BUCKETS];
+	unsigned long file_extents[LOG2_BUCKETS];
 } fs_stat;
 
-/* store unique item heads */
-struct obstack items;
+/* open addressing hash table with linear probing. Each entry starts with
+   its hash value, which is never 0: 0 marks an empty slot */
+struct stat_table {
+	char *slots;
+	unsigned long size;	/* power of 2 */
+	unsigned long count;
+	size_t entry_size;
+	int (*equal) (const void *, const void *);
+};
+
+#define STAT_TABLE_MIN_SIZE 4096
+
+#define stat_entry_hash(entry) (*(const __u64 *)(entry))
+#define stat_table_slot(t, i) ((t)->slots + (i) * (t)->entry_size)
+
+/* item heads are unique when they differ by key, item length or entry
+   count, this is what comp_items_1 used to compare */
+struct stat_item {
+	__u64 hash;
+	__u64 offset;
+	__u32 dirid;
+	__u32 objectid;
+	__u32 type;
+	__u16 len;
+	__u16 entry_count;
+};
+
+/* things collected per object from its unique items */
+struct stat_object {
+	__u64 hash;
+	__u32 dirid;
+	__u32 objectid;
+	unsigned long entries;
+	unsigned long extents;
+	__u32 last_pointer;	/* to join extents of neighboring items */
+};
+
+static struct stat_table items;
+static struct stat_table objects;
+
+static __u64 stat_hash(__u64 a, __u64 b)
+{
+	__u64 x;
+
+	x = a * 0x9e3779b97f4a7c15ULL ^ b;
+	x ^= x >> 29;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 32;
+
+	return x ? x : 1;
+}
+
+static char *stat_table_alloc(unsigned long size, size_t entry_size)
+{
+	char *slots;
 
-/* tree sorting item heades by comp_items_1 */
-void *items_tree;
+	slots = calloc(size, entry_size);
+	if (!slots)
+		reiserfs_panic("Not enough memory for %lu entries", size);
+	return slots;
+}
 
-static int comp_items_1(const void *p1, const void *p2)
+static void stat_table_init(struct stat_table *t, size_t entry_size,
+			    int (*equal) (const void *, const void *))
 {
-	int retval;
-	struct item_head *ih1, *ih2;
-
-	/*
-	   if (*(int *)p1 != *(int *)p2)
-	   retval = 1;
-	   else
-	   retval = 0;
-	 */
-	retval = comp_keys(p1, p2);
-	/*retval = comp_short_keys (p1, p2); */
-	if (retval)
-		return retval;
-
-	ih1 = (struct item_head *)p1;
-	ih2 = (struct item_head *)p2;
-
-	if (get_ih_item_len(ih1) < get_ih_item_len(ih2))
-		return -1;
-	if (get_ih_item_len(ih1) > get_ih_item_len(ih2))
-		return 1;
-	if (get_ih_entry_count(ih1) < get_ih_entry_count(ih2))
-		return -1;
-	if (get_ih_entry_count(ih1) > get_ih_entry_count(ih2))
-		return 1;
-
-	return 0;
+	t->size = STAT_TABLE_MIN_SIZE;
+	t->count = 0;
+	t->entry_size = entry_size;
+	t->equal = equal;
+	t->slots = stat_table_alloc(t->size, entry_size);
 }
 
-/*
-static void print_node (const void *nodep, VISIT value, int level)
+static void stat_table_free(struct stat_table *t)
 {
-    int i;
-
-    if (value == leaf) {
-	for (i = 0; i < level; i ++)
-	    reiserfs_warning (stdout, "\t");
-	reiserfs_warning (stdout, "%H\n", *(struct item_head **)nodep);
-	return;
-    }
-    if (value == postorder) {
-	for (i = 0; i < level; i ++)
-	    reiserfs_warning (stdout, "\t");
-	reiserfs_warning (stdout, "%H\n", *(struct item_head **)nodep);
-    }
+	free(t->slots);
+	t->slots = NULL;
+	t->size = t->count = 0;
 }
-*/
 
-static int is_unique_item(struct obstack *ostack, void **tree, void *ih)
+/* find the entry equal to @entry or the empty slot it is to be put to */
+static char *stat_table_lookup(struct stat_table *t, const void *entry)
 {
-	void *res;
-	void *key1;
-
-	key1 = obstack_copy(ostack, ih, IH_SIZE);
-	res = tsearch(key1, tree, comp_items_1);
-	if (!res)
-		reiserfs_panic("Too many keys found");
-
-/*    twalk (*tree, print_node);*/
-/*    reiserfs_warning (stderr, "\n\n");*/
-	if (*(void **)res != key1) {
-		/* key is in tree already, remove it from obstack */
-		/*reiserfs_warning (stdout, "%H is skipped\n", ih);fflush (stdout); */
-		obstack_free(ostack, key1);
-		return 0;
+	unsigned long i, mask;
+	__u64 hash;
+	char *slot;
+
+	hash = stat_entry_hash(entry);
+	mask = t->size - 1;
+	for (i = hash & mask;; i = (i + 1) & mask) {
+		slot = stat_table_slot(t, i);
+		if (!stat_entry_hash(slot))
+			return slot;
+		if (stat_entry_hash(slot) == hash && t->equal(slot, entry))
+			return slot;
 	}
+}
+
+static void stat_table_grow(struct stat_table *t)
+{
+	char *old, *slot;
+	unsigned long i, old_size;
+
+	old = t->slots;
+	old_size = t->size;
+
+	t->size *= 2;
+	t->slots = stat_table_alloc(t->size, t->entry_size);
+	for (i = 0; i < old_size; i++) {
+		slot = old + i * t->entry_size;
+		if (stat_entry_hash(slot))
+			memcpy(stat_table_lookup(t, slot), slot,
+			       t->entry_size);
+	}
+	free(old);
+}
+
+/* returns the entry in the table, @added is set when it was not there */
+static void *stat_table_insert(struct stat_table *t, const void *entry,
+			       int *added)
+{
+	char *slot;
+
+	/* keep the load below 3/4 */
+	if ((t->count + 1) * 4 > t->size * 3)
+		stat_table_grow(t);
+
+	slot = stat_table_lookup(t, entry);
+	*added = !stat_entry_hash(slot);
+	if (*added) {
+		memcpy(slot, entry, t->entry_size);
+		t->count++;
+	}
+	return slot;
+}
+
+static int stat_item_equal(const void *p1, const void *p2)
+{
+	return !memcmp(p1, p2, sizeof(struct stat_item));
+}
+
+static int stat_object_equal(const void *p1, const void *p2)
+{
+	const struct stat_object *o1 = p1, *o2 = p2;
+
+	return o1->dirid == o2->dirid && o1->objectid == o2->objectid;
+}
+
+static int is_unique_item(struct item_head *ih)
+{
+	struct stat_item item;
+	int added;
+
+	/* entries are compared by memcmp, padding must be zeroed */
+	memset(&item, 0, sizeof(item));
+	item.dirid = get_key_dirid(&ih->ih_key);
+	item.objectid = get_key_objectid(&ih->ih_key);
+	item.offset = get_offset(&ih->ih_key);
+	item.type = get_type(&ih->ih_key);
+	item.len = get_ih_item_len(ih);
+	item.entry_count = get_ih_entry_count(ih);
+	item.hash = stat_hash(((__u64)item.dirid << 32 | item.objectid) ^
+			      ((__u64)item.len << 16 | item.entry_count),
+			      item.offset * 16 + item.type);
+
+	stat_table_insert(&items, &item, &added);
+	return added;
+}
+
+static struct stat_object *get_object(struct item_head *ih)
+{
+	struct stat_object object;
+	int added;
+
+	memset(&object, 0, sizeof(object));
+	object.dirid = get_key_dirid(&ih->ih_key);
+	object.objectid = get_key_objectid(&ih->ih_key);
+	object.hash = stat_hash((__u64)object.dirid << 32 | object.objectid,
+				0);
 
-	/*reiserfs_warning (stdout, "%k is added\n", ih);fflush (stdout); */
-	return 1;
+	return stat_table_insert(&objects, &object, &added);
+}
+
+static int log2_bucket(__u64 value)
+{
+	int bucket;
+
+	for (bucket = 0; value; bucket++)
+		value >>= 1;
+	return bucket;
+}
+
+static void stat_the_sd(struct item_head *ih, void *sd)
+{
+	__u16 mode;
+	__u64 size;
+
+	if (get_ih_item_len(ih) != SD_SIZE && get_ih_item_len(ih) != SD_V1_SIZE)
+		return;
+
+	get_sd_mode(ih, sd, &mode);
+	if (S_ISDIR(mode))
+		fs_stat.dirs++;
+	if (!S_ISREG(mode))
+		return;
+
+	get_sd_size(ih, sd, &size);
+	fs_stat.files++;
+	fs_stat.file_size[log2_bucket(size)]++;
+}
+
+/* count runs of consecutive block numbers among pointers of the item */
+static void stat_the_indirect(struct item_head *ih, void *item)
+{
+	struct stat_object *object;
+	__le32 *ptrs = item;
+	__u32 ptr, prev;
+	unsigned int i;
+
+	object = get_object(ih);
+	prev = object->last_pointer;
+	for (i = 0; i < I_UNFM_NUM(ih); i++) {
+		ptr = d32_get(ptrs, i);
+		if (!ptr) {
+			prev = 0;
+			continue;
+		}
+		fs_stat.pointers++;
+		if (!prev || ptr != prev + 1) {
+			object->extents++;
+			fs_stat.extents++;
+		}
+		prev = ptr;
+	}
+	object->last_pointer = prev;
+}
+
+/* a unique item has been found: gather what is there */
+static void stat_the_item(struct buffer_head *bh, struct item_head *ih)
+{
+	int type;
+
+	type = get_type(&ih->ih_key);
+	fs_stat.unique[type < TYPE_MAXTYPE ? type : TYPE_MAXTYPE]++;
+
+	if (get_ih_location(ih) + get_ih_item_len(ih) > bh->b_size)
+		return;
+
+	switch (type) {
+	case TYPE_STAT_DATA:
+		stat_the_sd(ih, ih_item_body(bh, ih));
+		break;
+	case TYPE_DIRENTRY:
+		get_object(ih)->entries += get_ih_entry_count(ih);
+		break;
+	case TYPE_INDIRECT:
+		stat_the_indirect(ih, ih_item_body(bh, ih));
+		break;
+	}
+}
+
+static void stat_the_leaf_space(struct buffer_head *bh, int i_num)
+{
+	int space, used;
+
+	if (i_num > fs_stat.max_items)
+		i_num = fs_stat.max_items;
+	fs_stat.items_per_leaf[i_num]++;
+
+	space = bh->b_size - BLKH_SIZE;
+	used = space - leaf_free_space_estimate(bh->b_data, bh->b_size);
+	if (used < 0)
+		used = 0;
+	if (used > space)
+		used = space;
+	fs_stat.leaf_fill[used * 10 / space]++;
 }
 
 static void stat1_the_leaf(reiserfs_filsys_t fs, struct buffer_head *bh)
 {
-	int i, i_num;
+	int i, i_num, type;
 	struct item_head *ih;
 	int is_there_unique_item;
 
@@ -118,12 +330,14 @@ static void stat1_the_leaf(reiserfs_filsys_t fs, struct buffer_head *bh)
 		/* count all items */
 		fs_stat.all++;
 
-		if (is_unique_item(&items, &items_tree, ih)) {
+		if (is_unique_item(ih)) {
 			/* this is item we have not seen yet */
 			fs_stat.unique_items++;
 			is_there_unique_item++;
+			stat_the_item(bh, ih);
 		}
 	}
+	stat_the_leaf_space(bh, i_num);
 
 	if (!is_there_unique_item) {
 		/* the node contains only items we have seen already. so we will skip
@@ -134,66 +348,124 @@ static void stat1_the_leaf(reiserfs_filsys_t fs, struct buffer_head *bh)
 		ih = item_head(bh, 0);
 		/* node contains at least one unique item. We will put it in, count items of each type */
 		for (i = 0; i < i_num; i++, ih++) {
-			fs_stat.items[get_type(&ih->ih_key)]++;
+			type = get_type(&ih->ih_key);
+			fs_stat.items[type < TYPE_MAXTYPE ? type : TYPE_MAXTYPE]++;
 		}
 	}
 }
 
-/*
-static void stat2_the_leaf (struct buffer_head * bh)
+/* directory entries and extents are known when all items are seen */
+static void stat_the_objects(void)
 {
-    int i;
-    struct item_head * ih;
+	struct stat_object *object;
+	unsigned long i;
 
-    ih = B_N_PITEM_HEAD (bh, 0);
-    for (i = 0; i < node_item_number (bh); i ++, ih ++) {
-	
-    }
+	for (i = 0; i < objects.size; i++) {
+		object = (struct stat_object *)stat_table_slot(&objects, i);
+		if (!object->hash)
+			continue;
+		if (object->entries)
+			fs_stat.dir_entries[log2_bucket(object->entries)]++;
+		if (object->extents)
+			fs_stat.file_extents[log2_bucket(object->extents)]++;
+	}
+}
+
+static void print_log2_histogram(FILE *fp, char *name, unsigned long *hist)
+{
+	int i;
+
+	for (i = 0; i < LOG2_BUCKETS; i++)
+		if (hist[i])
+			fprintf(fp, "hist %s %llu %lu\n", name,
+				i ? 1ULL << (i - 1) : 0ULL, hist[i]);
+}
+
+static void print_stat(FILE *fp)
+{
+	unsigned int i;
+
+	fprintf(fp, "stat leaves %lu\n", fs_stat.leaves);
+	fprintf(fp, "stat items %lu\n", fs_stat.all);
+	fprintf(fp, "stat unique_items %lu\n", fs_stat.unique_items);
+	fprintf(fp, "stat unique_stat_data %lu\n",
+		fs_stat.unique[TYPE_STAT_DATA]);
+	fprintf(fp, "stat unique_indirect %lu\n",
+		fs_stat.unique[TYPE_INDIRECT]);
+	fprintf(fp, "stat unique_direct %lu\n", fs_stat.unique[TYPE_DIRECT]);
+	fprintf(fp, "stat unique_directory %lu\n",
+		fs_stat.unique[TYPE_DIRENTRY]);
+	fprintf(fp, "stat unique_other %lu\n", fs_stat.unique[TYPE_MAXTYPE]);
+	fprintf(fp, "stat blocks_to_skip %lu\n", fs_stat.blocks_to_skip);
+	fprintf(fp, "stat files %lu\n", fs_stat.files);
+	fprintf(fp, "stat directories %lu\n", fs_stat.dirs);
+	fprintf(fp, "stat indirect_pointers %lu\n", fs_stat.pointers);
+	fprintf(fp, "stat extents %lu\n", fs_stat.extents);
+
+	for (i = 0; i <= fs_stat.max_items; i++)
+		if (fs_stat.items_per_leaf[i])
+			fprintf(fp, "hist items_per_leaf %u %lu\n", i,
+				fs_stat.items_per_leaf[i]);
+	for (i = 0; i < FILL_BUCKETS; i++)
+		if (fs_stat.leaf_fill[i])
+			fprintf(fp, "hist leaf_fill_percent %u %lu\n", i * 10,
+				fs_stat.leaf_fill[i]);
+	print_log2_histogram(fp, "file_size", fs_stat.file_size);
+	print_log2_histogram(fp, "dir_entries", fs_stat.dir_entries);
+	print_log2_histogram(fp, "file_extents", fs_stat.file_extents);
+	fflush(fp);
 }
-*/
 
 void do_stat(reiserfs_filsys_t fs)
 {
 	unsigned long i;
 	unsigned long done, total;
+	struct block_scan *scan;
 	struct buffer_head *bh;
 	int type;
 	FILE *fp;
 
-	obstack_init(&items);
-	items_tree = 0;
-
-/*
-    bh = bread (fs->s_dev, 8211, fs->s_blocksize);
-    stat1_the_leaf (fs, bh);
+	stat_table_init(&items, sizeof(struct stat_item), stat_item_equal);
+	stat_table_init(&objects, sizeof(struct stat_object),
+			stat_object_equal);
+	fs_stat.max_items = (fs->fs_blocksize - BLKH_SIZE) /
+	    (IH_SIZE + MIN_ITEM_LEN);
+	fs_stat.items_per_leaf = getmem((fs_stat.max_items + 1) *
+					sizeof(unsigned long));
 
-    return;
-*/
-
-	/* pass 0 of stating */
+	/* pass 0 of stating. Blocks are read and recognized by worker
+	   threads, leaves are gone through in the order of block numbers */
 	total = reiserfs_bitmap_ones(input_bitmap(fs));
 	done = 0;
-	for (i = 0; i < get_sb_block_count(fs->fs_ondisk_sb); i++) {
-		if (!reiserfs_bitmap_test_bit(input_bitmap(fs), i))
-			continue;
-
+	scan = block_scan_init(fs->fs_dev, fs->fs_blocksize,
+			       reiserfs_bitmap_next_set, input_bitmap(fs),
+			       who_is_this, 0);
+	reiserfs_bitmap_for_each_set(input_bitmap(fs), i) {
 		print_how_far(stderr, &done, total, 1, be_quiet(fs));
 
-		bh = bread(fs->fs_dev, i, fs->fs_blocksize);
-		if (!bh) {
+		type = block_scan_class(scan, i);
+		if (type == BLOCK_SCAN_ERROR) {
 			printf("could not read block %lu\n", i);
 			continue;
 		}
-		type = who_is_this(bh->b_data, bh->b_size);
 		if (type != THE_LEAF && type != HAS_IH_ARRAY) {
 			reiserfs_bitmap_clear_bit(input_bitmap(fs), i);
-			brelse(bh);
+			continue;
+		}
+		bh = block_scan_bread(scan, i);
+		if (!bh) {
+			printf("could not read block %lu\n", i);
 			continue;
 		}
 		fs_stat.leaves++;
 		stat1_the_leaf(fs, bh);
 		brelse(bh);
 	}
+	block_scan_done(scan);
+
+	stat_the_objects();
+	stat_table_free(&items);
+	stat_table_free(&objects);
 
 	reiserfs_warning(stderr, "\nThere were found on the '%s' device:\n"
 			 "\tleaves %lu\n"
@@ -204,12 +476,6 @@ void do_stat(reiserfs_filsys_t fs)
 			 "\t\tindirect %lu\n"
 			 "\t\tdirect %lu\n"
 			 "\t\tdirectory items %lu\n" "\tunique items %lu\n",
-			 /*
-			    "\tnames there (but \".\" and \"..\") %lu\n"
-			    "\tpointing to unique keys %lu\n"
-			    "other items %lu\n"
-			    "blocks containing only 1 dir item %lu\n",
-			  */
 			 fs->fs_file_name,
 			 fs_stat.leaves,
 			 fs_stat.all,
@@ -219,12 +485,9 @@ void do_stat(reiserfs_filsys_t fs)
 			 fs_stat.items[TYPE_INDIRECT],
 			 fs_stat.items[TYPE_DIRECT],
 			 fs_stat.items[TYPE_DIRENTRY], fs_stat.unique_items);
-/*
-		      fs_stat.names,
-		      fs_stat.unique_keys,
-		      fs_stat.items [4],
-		      fs_stat.dir_blocks);
-*/
+	print_stat(stdout);
+	freemem(fs_stat.items_per_leaf);
+
 	if (!input_bitmap_file_name(fs))
 		return;
 
@@ -238,25 +501,4 @@ void do_stat(reiserfs_filsys_t fs)
 
 	reiserfs_bitmap_save(fp, input_bitmap(fs));
 	fclose(fp);
-	return;
-
-	/* pass 2 of stating */
-	reiserfs_warning(stderr,
-			 "Looking for blocks containing only keys not pointed by any of entries\n");
-	total = reiserfs_bitmap_ones(input_bitmap(fs));
-	done = 0;
-	for (i = 0; i < get_sb_block_count(fs->fs_ondisk_sb); i++) {
-		if (!reiserfs_bitmap_test_bit(input_bitmap(fs), i))
-			continue;
-
-		print_how_far(stderr, &done, total, 1, be_quiet(fs));
-
-		bh = bread(fs->fs_dev, i, fs->fs_blocksize);
-		if (!bh) {
-			printf("could not read block %lu\n", i);
-			continue;
-		}
-		/*stat2_the_leaf (bh); */
-	}
-
 }
@@ -188,10 +188,8 @@ static void init_control_bitmap(reiserfs_filsys_t fs)
 		we_met_it(i);
 
 	if (fs->fs_badblocks_bm)
-		for (i = 0; i < get_sb_block_count(fs->fs_ondisk_sb); i++) {
-			if (reiserfs_bitmap_test_bit(fs->fs_badblocks_bm, i))
-				we_met_it(i);
-		}
+		reiserfs_bitmap_for_each_set(fs->fs_badblocks_bm, i)
+			we_met_it(i);
 }
 
 /* if we managed to complete tree scanning and if control bitmap and/or proper
@@ -64,6 +64,7 @@ int main(int argc, char *argv[]);
 #define OPT_YES				1 << 9
 #define BADBLOCKS_FILE			1 << 10
 #define OPT_FORCE			1 << 11
+#define OPT_CACHE_STATS			1 << 12
 
 /* pass0.c */
 extern reiserfs_bitmap_t *leaves_bitmap;
@@ -112,7 +113,6 @@ void mark_item_unreachable(struct item_head *ih);
 
 struct si *remove_saved_item(struct si *si);
 int tree_is_empty(void);
-void make_single_leaf_tree(struct buffer_head *bh);
 
 /* pass2.c */
 void pass_2(reiserfs_filsys_t );
@@ -453,6 +453,7 @@ struct fsck_data {
 #define fsck_hash_defined(fs) (fsck_data(fs)->options & OPT_HASH_DEFINED)
 #define fsck_skip_journal(fs) (fsck_data(fs)->options & OPT_SKIP_JOURNAL)
 #define fsck_yes_all(fs) (fsck_data(fs)->options & OPT_YES)
+#define fsck_cache_stats(fs) (fsck_data(fs)->options & OPT_CACHE_STATS)
 
 #define fsck_mode(fs) (fsck_data(fs)->mode)
 #define fsck_log_file(fs) (fsck_data(fs)->log)
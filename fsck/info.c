@@ -208,6 +208,23 @@ void stage_report(int pass, reiserfs_filsys_t fs)
 
 	}			/* switch */
 
+	if (fsck_cache_stats(fs)) {
+		static struct buffer_cache_stats last;
+		struct buffer_cache_stats stats;
+		unsigned long hits, misses;
+
+		get_buffer_cache_stats(&stats);
+		hits = stats.hits - last.hits;
+		misses = stats.misses - last.misses;
+		last = stats;
+
+		print_buffer_cache_stats(fsck_progress_file(fs));
+		fsck_progress("Buffer cache hit ratio of the pass: %.2f%% "
+			      "(hits %lu, misses %lu)\n", hits + misses ?
+			      100.0 * hits / (hits + misses) : 0.0, hits,
+			      misses);
+	}
+
 	memset(&fsck_data(fs)->rebuild.pass_u, 0,
 	       sizeof(fsck_data(fs)->rebuild.pass_u));
 
@@ -44,6 +44,7 @@ fsck_progress ("Usage: %s [mode] [options] "					\
 "  -r\t\t\tignored\n"							\
 "Expert options:\n"								\
 "  --no-journal-available\tdo not open nor replay journal\n"			\
+"  --cache-size size\t\tmemory for the block cache, K, M or G\n"		\
 "  -S | --scan-whole-partition\tbuild tree of all blocks of the device\n\n",	\
   argv[0]);									\
 										\
@@ -76,6 +77,7 @@ Options:
 "  -h | --hash hashname\n"\
 "  -g | --background\n"\
 "  -t \t\tdo test\n"\
+"  --cache-stats\tshow buffer cache statistics after every stage\n"\
 */
 
 /* fsck is called with one non-optional argument - file name of device
@@ -86,6 +88,7 @@ static char *parse_options(struct fsck_data *data, int argc, char *argv[])
 	int c;
 	static int mode = FSCK_CHECK;
 	static int flag;
+	long long int cache_size;
 
 	data->rebuild.scan_area = USED_BLOCKS;
 	while (1) {
@@ -126,6 +129,9 @@ static char *parse_options(struct fsck_data *data, int argc, char *argv[])
 			{"journal", required_argument, NULL, 'j'},
 			{"no-journal-available", no_argument, &flag,
 			 OPT_SKIP_JOURNAL},
+			{"cache-stats", no_argument, &flag, OPT_CACHE_STATS},
+			{"cache-size", required_argument, NULL,
+			 CACHE_SIZE_OPTION},
 
 			{"bad-block-file", required_argument, NULL, 'B'},
 
@@ -149,6 +155,11 @@ static char *parse_options(struct fsck_data *data, int argc, char *argv[])
 				data->options |= OPT_SKIP_JOURNAL;
 				flag = 0;
 			}
+			if (flag == OPT_CACHE_STATS) {
+				/* buffer cache statistics */
+				data->options |= OPT_CACHE_STATS;
+				flag = 0;
+			}
 			break;
 
 		case 'i':	/* --interactive */
@@ -255,6 +266,15 @@ static char *parse_options(struct fsck_data *data, int argc, char *argv[])
 			data->rebuild.test = atoi(optarg);
 			break;
 
+		case CACHE_SIZE_OPTION:	/* --cache-size */
+			cache_size = misc_str_to_bytes(optarg);
+			if (cache_size <= 0)
+				reiserfs_exit(EXIT_USER,
+					      "Wrong cache size is specified: %s",
+					      optarg);
+			set_buffer_cache_size(cache_size);
+			break;
+
 		default:
 			print_usage_and_exit();
 		}
@@ -840,6 +860,13 @@ static void prepare_fs_for_check(reiserfs_filsys_t fs)
 	if (fs->fs_flags == O_RDWR)
 		return;
 
+	if (reiserfs_is_packed(fs->fs_dev)) {
+		/* metadata packed by debugreiserfs -p is read-only */
+		fsck_progress("Filesystem is a packed metadata image. "
+			      "Skipping journal replay.\n");
+		return;
+	}
+
 	reiserfs_reopen(fs, O_RDWR);
 
 	fsck_data(fs)->mounted = misc_device_mounted(fs->fs_file_name);
@@ -1264,6 +1291,15 @@ static int open_devices_for_rollback(char *file_name, struct fsck_data *data)
 		return -1;
 	}
 
+	/* rollback writes blocks back, packs are read-only */
+	if (reiserfs_open_packed(fd)) {
+		reiserfs_warning(stderr, "reiserfsck: %s is a packed metadata "
+				 "image, it cannot be rolled back\n", file_name);
+		reiserfs_close_packed(fd);
+		close(fd);
+		return -1;
+	}
+
 	fs = getmem(sizeof(*fs));
 	fs->fs_dev = fd;
 	fs->fs_vp = data;
@@ -1277,6 +1313,13 @@ static int open_devices_for_rollback(char *file_name, struct fsck_data *data)
 					 "Cannot open journal partition\n");
 			return -1;
 		}
+		if (reiserfs_open_packed(fs->fs_journal_dev)) {
+			reiserfs_warning(stderr, "reiserfsck: %s is a packed "
+					 "metadata image, it cannot be rolled "
+					 "back\n", data->journal_dev_name);
+			reiserfs_close_packed(fs->fs_journal_dev);
+			return -1;
+		}
 	}
 
 	if (open_rollback_file(state_rollback_file(fs), fsck_data(fs)->log))
@@ -1394,6 +1437,13 @@ int main(int argc, char *argv[])
 				      error_message(error));
 		}
 
+		if (fs && reiserfs_is_packed(fs->fs_dev) &&
+		    data->mode != FSCK_CHECK) {
+			reiserfs_exit(EXIT_USER, "%s is a packed metadata "
+				      "image, it can only be checked with "
+				      "--check\n", file_name);
+		}
+
 		if (data->mode != FSCK_SB) {
 			if (no_reiserfs_found(fs)) {
 				reiserfs_exit(EXIT_OPER,
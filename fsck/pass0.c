@@ -1837,13 +1837,9 @@ int is_leaf_bad(struct buffer_head *bh)
 	return bad;
 }
 
-static int is_to_be_read(reiserfs_filsys_t fs, unsigned long block)
-{
-	return reiserfs_bitmap_test_bit(fsck_source_bitmap(fs), block);
-}
-
 static void do_pass_0(reiserfs_filsys_t fs)
 {
+	struct block_scan *scan;
 	struct buffer_head *bh;
 	unsigned long i;
 	int what_node;
@@ -1883,16 +1879,19 @@ static void do_pass_0(reiserfs_filsys_t fs)
 
 	total = reiserfs_bitmap_ones(fsck_source_bitmap(fs));
 
-	for (i = 0; i < get_sb_block_count(fs->fs_ondisk_sb); i++) {
-		if (!is_to_be_read(fs, i))
-			continue;
+	/* blocks are read and recognized by worker threads, only leaves get
+	   to the buffer cache and get corrected here */
+	scan = block_scan_init(fs->fs_dev, fs->fs_blocksize,
+			       reiserfs_bitmap_next_set, fsck_source_bitmap(fs),
+			       who_is_this, 0);
 
+	reiserfs_bitmap_for_each_set(fsck_source_bitmap(fs), i) {
 		print_how_far(fsck_progress_file(fs), &done, total, 1,
 			      fsck_quiet(fs));
 
-		bh = bread(fs->fs_dev, i, fs->fs_blocksize);
-		if (!bh) {
-			/* we were reading one block at time, and failed, so mark block bad */
+		what_node = block_scan_class(scan, i);
+		if (what_node == BLOCK_SCAN_ERROR) {
+			/* the block is not read again, it would fail again */
 			fsck_progress("%s: Reading of the block %lu failed\n",
 				      __FUNCTION__, i);
 			continue;
@@ -1915,16 +1914,17 @@ static void do_pass_0(reiserfs_filsys_t fs)
 		}
 
 		pass_0_stat(fs)->dealt_with++;
-		what_node = who_is_this(bh->b_data, bh->b_size);
-		if (what_node != THE_LEAF && what_node != HAS_IH_ARRAY) {
-			brelse(bh);
+		if (what_node != THE_LEAF && what_node != HAS_IH_ARRAY)
 			continue;
-		}
 
+		bh = block_scan_bread(scan, i);
+		if (!bh)
+			continue;
 		pass_0_stat(fs)->leaves++;
 		pass0_correct_leaf(fs, bh);
 		brelse(bh);
 	}
+	block_scan_done(scan);
 	fsck_progress("\n");
 
 	/* just in case */
@@ -2015,6 +2015,8 @@ unsigned long alloc_block(void)
 {
 	unsigned long block = 0;	/* FIXME: start point could be used */
 
+	/* allocation goes from the beginning, let it skip used areas */
+	reiserfs_bitmap_summarize(fsck_allocable_bitmap(fs));
 	if (reiserfs_bitmap_find_zero_bit(fsck_allocable_bitmap(fs), &block)) {
 		die("alloc_block: Allocable blocks counter is wrong");
 		return 0;
@@ -2199,11 +2201,8 @@ static void init_source_bitmap(reiserfs_filsys_t fs)
 	}
 
 	if (fs->fs_badblocks_bm)
-		for (i = 0; i < get_sb_block_count(fs->fs_ondisk_sb); i++) {
-			if (reiserfs_bitmap_test_bit(fs->fs_badblocks_bm, i))
-				reiserfs_bitmap_clear_bit(fsck_source_bitmap
-							  (fs), i);
-		}
+		reiserfs_bitmap_for_each_set(fs->fs_badblocks_bm, i)
+			reiserfs_bitmap_clear_bit(fsck_source_bitmap(fs), i);
 
 	fsck_source_bitmap(fs)->bm_set_bits =
 	    reiserfs_bitmap_ones(fsck_source_bitmap(fs));
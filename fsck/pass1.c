@@ -4,6 +4,7 @@
  */
 
 #include "fsck.h"
+#include <limits.h>
 
 reiserfs_bitmap_t *bad_unfm_in_tree_once_bitmap;
 
@@ -243,12 +244,13 @@ int tree_is_empty(void)
 		get_sb_root_block(fs->fs_ondisk_sb) == 0) ? 1 : 0;
 }
 
-void make_single_leaf_tree(struct buffer_head *bh)
+static void make_single_leaf_tree(struct buffer_head *bh)
 {
 	/* tree is empty, make tree root */
 	set_sb_root_block(fs->fs_ondisk_sb, bh->b_blocknr);
 	set_sb_tree_height(fs->fs_ondisk_sb, 2);
 	mark_buffer_dirty(fs->fs_super_bh);
+	reiserfs_forget_search_finger(fs);
 	leaf_is_in_tree_now(bh);
 }
 
@@ -321,6 +323,241 @@ out:
 	return;
 }
 
+/* pass 1 does not insert leaves one by one. It collects them and, when all
+   leaves are read, builds the tree bottom-up of the longest chain of leaves
+   which do not overlap. Collected leaves may take a part of the buffer cache
+   size only: when there are more of them, the tree is built of ones collected
+   so far and the rest are inserted one by one */
+struct pass1_leaf {
+	unsigned long block;
+	int used;		/* B_CHILD_SIZE of the leaf */
+	struct item_head first;	/* first and last item headers */
+	struct item_head last;
+	struct reiserfs_key max_key;	/* see get_max_buffer_key */
+};
+
+/* node of a tree level being built */
+struct pass1_node {
+	unsigned long block;
+	int used;
+	struct reiserfs_key key;	/* leftmost key of the subtree */
+};
+
+static struct pass1_leaf *pass1_leaves;
+static unsigned long pass1_nr_leaves;
+static int pass1_leaves_overflow;	/* leaves are inserted one by one */
+
+#define PASS1_LEAVES_CHUNK 1024
+#define PASS1_LEAVES_FRACTION 4
+
+static unsigned long pass1_leaves_limit(void)
+{
+	unsigned long limit;
+
+	limit = get_buffer_cache_size() / PASS1_LEAVES_FRACTION;
+	return limit < INT_MAX ? limit : INT_MAX;
+}
+
+static void collect_leaf(struct buffer_head *bh)
+{
+	struct pass1_leaf *leaf;
+
+	if (!(pass1_nr_leaves % PASS1_LEAVES_CHUNK))
+		pass1_leaves = expandmem(pass1_leaves, pass1_nr_leaves *
+					 sizeof(struct pass1_leaf),
+					 PASS1_LEAVES_CHUNK *
+					 sizeof(struct pass1_leaf));
+
+	leaf = pass1_leaves + pass1_nr_leaves++;
+	leaf->block = bh->b_blocknr;
+	leaf->used = B_CHILD_SIZE(bh);
+	memcpy(&leaf->first, item_head(bh, 0), IH_SIZE);
+	memcpy(&leaf->last, item_head(bh, B_NR_ITEMS(bh) - 1), IH_SIZE);
+	get_max_buffer_key(bh, &leaf->max_key);
+}
+
+static int leaf_compare(const void *p1, const void *p2)
+{
+	const struct pass1_leaf *l1 = p1, *l2 = p2;
+	int ret;
+
+	ret = comp_keys(&l1->max_key, &l2->max_key);
+	if (ret)
+		return ret;
+	return l1->block < l2->block ? -1 : l1->block > l2->block;
+}
+
+/* same as balance_condition_fails for collected leaves */
+static int leaves_balance_condition_fails(struct pass1_leaf *left,
+					  struct pass1_leaf *right)
+{
+	if (MAX_CHILD_SIZE(fs->fs_blocksize) - left->used >= right->used -
+	    (are_items_mergeable(&left->last, &right->first,
+				 fs->fs_blocksize) ? IH_SIZE : 0))
+		return 1;
+	return 0;
+}
+
+/* leaves sorted by the max key are taken greedily: a leaf goes to the chain
+   if it starts after the end of the previous one and they could not be
+   joined. That gives the largest number of leaves which do not overlap, the
+   rest is left to pass 2. Returns the number of leaves in the chain */
+static unsigned long choose_leaves(void)
+{
+	struct pass1_leaf *leaf, *last = NULL;
+	unsigned long i, nr = 0;
+
+	qsort(pass1_leaves, pass1_nr_leaves, sizeof(struct pass1_leaf),
+	      leaf_compare);
+
+	for (i = 0; i < pass1_nr_leaves; i++) {
+		leaf = pass1_leaves + i;
+		if (last && (comp_keys(&last->max_key, &leaf->first.ih_key) !=
+			     -1 /* second is greater */  ||
+			     leaves_balance_condition_fails(last, leaf))) {
+			mark_block_uninsertable(leaf->block);
+			continue;
+		}
+		last = pass1_leaves + nr++;
+		if (last != leaf)
+			*last = *leaf;
+	}
+	return nr;
+}
+
+/* leaves of the chain are read in block order to mark them and blocks they
+   point to used */
+static void mark_leaves_in_tree(unsigned long nr)
+{
+	reiserfs_bitmap_t *chain;
+	struct readahead *ra;
+	struct buffer_head *bh;
+	unsigned long i;
+
+	chain = reiserfs_create_bitmap(get_sb_block_count(fs->fs_ondisk_sb));
+	for (i = 0; i < nr; i++)
+		reiserfs_bitmap_set_bit(chain, pass1_leaves[i].block);
+
+	ra = readahead_init(fs->fs_dev, fs->fs_blocksize,
+			    reiserfs_bitmap_next_set, chain, 0);
+	reiserfs_bitmap_for_each_set(chain, i) {
+		bh = readahead_bread(ra, i);
+		if (!bh)
+			die("mark_leaves_in_tree: Could not read the leaf (%lu)", i);
+		leaf_is_in_tree_now(bh);
+		brelse(bh);
+	}
+	readahead_done(ra);
+	reiserfs_delete_bitmap(chain);
+}
+
+/* make nodes of given level pointing to nr nodes of the level below. Nodes
+   get children evenly, so that each of them is at least half full. Nodes
+   made replace their children at the beginning of the array, their number is
+   returned */
+static unsigned long build_level(struct pass1_node *nodes, unsigned long nr,
+				 int level)
+{
+	unsigned long count, child, i;
+	unsigned int max_children, children, j;
+	struct buffer_head *bh;
+
+	max_children = (MAX_CHILD_SIZE(fs->fs_blocksize) - DC_SIZE) /
+	    (KEY_SIZE + DC_SIZE) + 1;
+	count = (nr + max_children - 1) / max_children;
+
+	for (i = 0, child = 0; i < count; i++) {
+		children = nr / count + (i < nr % count ? 1 : 0);
+
+		bh = reiserfsck_get_new_buffer(nodes[child].block);
+		memset(bh->b_data, 0, bh->b_size);
+		set_blkh_level(B_BLK_HEAD(bh), level);
+		set_blkh_nr_items(B_BLK_HEAD(bh), children - 1);
+		set_blkh_free_space(B_BLK_HEAD(bh),
+				    MAX_CHILD_SIZE(bh->b_size) -
+				    (children - 1) * KEY_SIZE -
+				    children * DC_SIZE);
+
+		for (j = 0; j < children; j++) {
+			if (j)
+				copy_key(internal_key(bh, j - 1),
+					 &nodes[child + j].key);
+			set_dc(B_N_CHILD(bh, j), nodes[child + j].used,
+			       nodes[child + j].block);
+		}
+		mark_buffer_uptodate(bh, 1);
+		mark_buffer_dirty(bh);
+
+		/* i <= child, so children are not overwritten before use */
+		if (i != child)
+			copy_key(&nodes[i].key, &nodes[child].key);
+		nodes[i].block = bh->b_blocknr;
+		nodes[i].used = B_CHILD_SIZE(bh);
+		brelse(bh);
+
+		child += children;
+	}
+	return count;
+}
+
+static void build_tree_of_leaves(void)
+{
+	struct pass1_node *nodes;
+	unsigned long nr, i;
+	int level;
+
+	if (!tree_is_empty())
+		die("build_tree_of_leaves: The tree is expected to be empty");
+
+	nr = choose_leaves();
+	if (!nr)
+		goto out;
+
+	mark_leaves_in_tree(nr);
+
+	nodes = getmem(nr * sizeof(struct pass1_node));
+	for (i = 0; i < nr; i++) {
+		nodes[i].block = pass1_leaves[i].block;
+		nodes[i].used = pass1_leaves[i].used;
+		copy_key(&nodes[i].key, &pass1_leaves[i].first.ih_key);
+	}
+	freemem(pass1_leaves);
+	pass1_leaves = NULL;
+
+	for (level = DISK_LEAF_NODE_LEVEL; nr > 1; level++) {
+		if (level == MAX_HEIGHT - 1)
+			die("build_tree_of_leaves: The tree is too high");
+		nr = build_level(nodes, nr, level + 1);
+	}
+
+	set_sb_root_block(fs->fs_ondisk_sb, nodes[0].block);
+	set_sb_tree_height(fs->fs_ondisk_sb, level + 1);
+	mark_buffer_dirty(fs->fs_super_bh);
+	reiserfs_forget_search_finger(fs);
+	freemem(nodes);
+
+out:
+	if (pass1_leaves)
+		freemem(pass1_leaves);
+	pass1_leaves = NULL;
+	pass1_nr_leaves = 0;
+}
+
+static void add_leaf(struct buffer_head *bh)
+{
+	if (!pass1_leaves_overflow && !(pass1_nr_leaves % PASS1_LEAVES_CHUNK) &&
+	    (pass1_nr_leaves + PASS1_LEAVES_CHUNK) *
+	    sizeof(struct pass1_leaf) > pass1_leaves_limit()) {
+		build_tree_of_leaves();
+		pass1_leaves_overflow = 1;
+	}
+
+	if (pass1_leaves_overflow)
+		try_to_insert_pointer_to_leaf(bh);
+	else
+		collect_leaf(bh);
+}
+
 /* everything should be correct already in the leaf but contents of indirect
    items. So we only
    1. zero slots pointing to a leaf
@@ -512,15 +749,12 @@ static void init_new_bitmap(reiserfs_filsys_t fs)
 		mark_block_used(i, 1);
 
 	if (fs->fs_badblocks_bm)
-		for (i = 0; i < get_sb_block_count(fs->fs_ondisk_sb); i++) {
-			if (reiserfs_bitmap_test_bit(fs->fs_badblocks_bm, i)) {
-				if (reiserfs_bitmap_test_bit
-				    (fsck_new_bitmap(fs), i))
-					reiserfs_panic
-					    ("%s: The block pointer to not data area, must be fixed on the pass0.\n",
-					     __FUNCTION__);
-				reiserfs_bitmap_set_bit(fsck_new_bitmap(fs), i);
-			}
+		reiserfs_bitmap_for_each_set(fs->fs_badblocks_bm, i) {
+			if (reiserfs_bitmap_test_bit(fsck_new_bitmap(fs), i))
+				reiserfs_panic
+				    ("%s: The block pointer to not data area, must be fixed on the pass0.\n",
+				     __FUNCTION__);
+			reiserfs_bitmap_set_bit(fsck_new_bitmap(fs), i);
 		}
 #if 0
 	/* mark journal area as used if journal is standard or it is non standard
@@ -662,10 +896,10 @@ void load_pass_1_result(FILE * fp, reiserfs_filsys_t fs)
 		      reiserfs_bitmap_zeros(fsck_uninsertables(fs)));
 }
 
-/* reads blocks marked in leaves_bitmap and tries to insert them into
-   tree */
+/* reads blocks marked in leaves_bitmap and builds the tree of them */
 static void do_pass_1(reiserfs_filsys_t fs)
 {
+	struct readahead *ra;
 	struct buffer_head *bh;
 	unsigned long i;
 	int what_node;
@@ -673,17 +907,16 @@ static void do_pass_1(reiserfs_filsys_t fs)
 
 	/* on pass0 we have found that amount of leaves */
 	total = reiserfs_bitmap_ones(leaves_bitmap);
+	ra = readahead_init(fs->fs_dev, fs->fs_blocksize,
+			    reiserfs_bitmap_next_set, leaves_bitmap, 0);
 
 	/* read all leaves found on the pass 0 */
-	for (i = 0; i < get_sb_block_count(fs->fs_ondisk_sb); i++) {
-		if (!is_used_leaf(i))
-			continue;
-
+	reiserfs_bitmap_for_each_set(leaves_bitmap, i) {
 		print_how_far(fsck_progress_file(fs), &done, total, 1,
 			      fsck_quiet(fs));
 
 		/* at least one of nr_to_read blocks is to be checked */
-		bh = bread(fs->fs_dev, i, fs->fs_blocksize);
+		bh = readahead_bread(ra, i);
 		if (!bh) {
 			/* we were reading one block at time, and failed, so mark
 			   block bad */
@@ -731,7 +964,7 @@ static void do_pass_1(reiserfs_filsys_t fs)
 		if (block_of_journal(fs, i)
 		    && fsck_data(fs)->rebuild.use_journal_area) {
 			/* FIXME: temporary thing */
-			if (tree_is_empty()) {
+			if (!pass1_nr_leaves && tree_is_empty()) {
 				/* we insert inot tree only first leaf of journal */
 				unsigned long block;
 				struct buffer_head *new_bh;
@@ -743,7 +976,7 @@ static void do_pass_1(reiserfs_filsys_t fs)
 				memcpy(new_bh->b_data, bh->b_data, bh->b_size);
 				mark_buffer_uptodate(new_bh, 1);
 				mark_buffer_dirty(new_bh);
-				make_single_leaf_tree(new_bh);
+				add_leaf(new_bh);
 				brelse(new_bh);
 				brelse(bh);
 				continue;
@@ -755,9 +988,14 @@ static void do_pass_1(reiserfs_filsys_t fs)
 			continue;
 		}
 
-		try_to_insert_pointer_to_leaf(bh);
+		add_leaf(bh);
 		brelse(bh);
 	}
+	readahead_done(ra);
+
+	if (!pass1_leaves_overflow)
+		build_tree_of_leaves();
+	pass1_leaves_overflow = 0;
 
 	fsck_progress("\n");
 
@@ -4,6 +4,7 @@
  */
 
 #include "fsck.h"
+#include <limits.h>
 
 /* on pass2 we take leaves which could not be inserted into tree
    during pass1 and insert each item separately. It is possible that
@@ -397,6 +398,103 @@ void insert_item_separately(struct item_head *ih, char *item, int was_in_tree)
 	}
 }
 
+/* items of uninsertable leaves are read once into memory and put into
+   the tree in key order: sequential keys go mostly to the same leaf, which
+   the search finger finds without searching from the root */
+struct logged_item {
+	struct item_head ih;
+	char *body;
+	unsigned long nr;	/* to keep order of items with equal keys */
+};
+
+/* bodies are copied to chunks of this size */
+#define ITEM_LOG_CHUNK (1024 * 1024)
+
+/* the logs may take this part of the buffer cache size (see
+   set_buffer_cache_size), so that pass 2 stays within that memory */
+#define ITEM_LOG_FRACTION 4
+
+struct item_log {
+	struct logged_item *items;
+	unsigned long nr_items, max_items;
+
+	char *chunk;		/* first bytes point to the previous chunk */
+	unsigned long chunk_used;
+	unsigned long memory;	/* bytes taken by items and their bodies */
+};
+
+static void log_item(struct item_log *log, struct item_head *ih, char *body)
+{
+	struct logged_item *item;
+	unsigned int len = get_ih_item_len(ih);
+	unsigned long grow;
+	char *prev;
+
+	if (log->nr_items == log->max_items) {
+		grow = log->max_items ? log->max_items : 1024;
+		log->items = expandmem(log->items, log->max_items *
+				       sizeof(struct logged_item),
+				       grow * sizeof(struct logged_item));
+		log->max_items += grow;
+	}
+
+	if (!log->chunk || log->chunk_used + len > ITEM_LOG_CHUNK) {
+		prev = log->chunk;
+		log->chunk = getmem(ITEM_LOG_CHUNK);
+		memcpy(log->chunk, &prev, sizeof(prev));
+		log->chunk_used = sizeof(prev);
+	}
+
+	item = log->items + log->nr_items;
+	memcpy(&item->ih, ih, IH_SIZE);
+	item->body = log->chunk + log->chunk_used;
+	memcpy(item->body, body, len);
+	item->nr = log->nr_items++;
+
+	log->chunk_used += (len + 7) & ~7;
+	log->memory += ((len + 7) & ~7) + sizeof(struct logged_item);
+}
+
+static int logged_item_compare(const void *p1, const void *p2)
+{
+	const struct logged_item *i1 = p1, *i2 = p2;
+	int ret;
+
+	ret = comp_keys(&i1->ih.ih_key, &i2->ih.ih_key);
+	if (ret)
+		return ret;
+	return i1->nr < i2->nr ? -1 : i1->nr > i2->nr;
+}
+
+static void insert_logged_items(struct item_log *log, unsigned long *done,
+				unsigned long total)
+{
+	unsigned long i;
+
+	qsort(log->items, log->nr_items, sizeof(struct logged_item),
+	      logged_item_compare);
+
+	for (i = 0; i < log->nr_items; i++) {
+		insert_item_separately(&log->items[i].ih, log->items[i].body,
+				       0 /*was in tree */ );
+		print_how_far(fsck_progress_file(fs), done, total, 1,
+			      fsck_quiet(fs));
+	}
+}
+
+static void free_item_log(struct item_log *log)
+{
+	char *prev;
+
+	while (log->chunk) {
+		memcpy(&prev, log->chunk, sizeof(prev));
+		freemem(log->chunk);
+		log->chunk = prev;
+	}
+	freemem(log->items);
+	memset(log, 0, sizeof(*log));
+}
+
 static void put_stat_data_items(struct buffer_head *bh)
 {
 	int i;
@@ -481,73 +579,141 @@ void load_pass_2_result(reiserfs_filsys_t fs)
 	 */
 }
 
+/* insert stat data items (@stat_data is set) or the rest of items of
+   leaves which were not logged */
+static void put_unlogged_items(reiserfs_filsys_t fs,
+			       reiserfs_bitmap_t *unlogged, int stat_data,
+			       unsigned long *done, unsigned long total)
+{
+	struct readahead *ra;
+	struct buffer_head *bh;
+	unsigned long j;
+
+	ra = readahead_init(fs->fs_dev, fs->fs_blocksize,
+			    reiserfs_bitmap_next_set, unlogged, 0);
+	reiserfs_bitmap_for_each_set(unlogged, j) {
+		bh = readahead_bread(ra, j);
+		if (bh == NULL) {
+			fsck_log
+			    ("pass_2: Reading of the block (%lu) failed on the device 0x%x\n",
+			     j, fs->fs_dev);
+			continue;
+		}
+
+		if (stat_data)
+			put_stat_data_items(bh);
+		else {
+			put_not_stat_data_items(bh);
+			pass_2_stat(fs)->leaves++;
+			make_allocable(j);
+		}
+
+		print_how_far(fsck_progress_file(fs), done, total, 1,
+			      fsck_quiet(fs));
+		brelse(bh);
+	}
+	readahead_done(ra);
+}
+
 /* uninsertable blocks are marked by 0s in uninsertable_leaf_bitmap
-   during the pass 1. They must be not in the tree */
+   during the pass 1. They must be not in the tree. Their items are read
+   into memory once, stat data items are put into the tree first. Leaves
+   which did not fit into the memory limit of the logs are read again: once
+   for stat data items and once for the rest */
 static void do_pass_2(reiserfs_filsys_t fs)
 {
-
+	struct item_log sd_log, item_log;
+	reiserfs_bitmap_t *unlogged;
+	struct readahead *ra;
 	struct buffer_head *bh;
-	unsigned long j;
+	struct item_head *ih;
+	unsigned long j, limit;
 	int i, what_node;
 	unsigned long done = 0, total;
 
-	total = reiserfs_bitmap_zeros(fsck_uninsertables(fs)) * 2;
-	if (!total)
+	if (!reiserfs_bitmap_zeros(fsck_uninsertables(fs)))
 		return;
 
 	fsck_progress("\nPass 2:\n");
 
-	for (i = 0; i < 2; i++) {
-		j = 0;
-		while ((j < fsck_uninsertables(fs)->bm_bit_size) &&
-		       reiserfs_bitmap_find_zero_bit(fsck_uninsertables(fs),
-						     &j) == 0) {
-			bh = bread(fs->fs_dev, j, fs->fs_blocksize);
-			if (bh == NULL) {
-				fsck_log
-				    ("pass_2: Reading of the block (%lu) failed on the device 0x%x\n",
-				     j, fs->fs_dev);
-				goto cont;
-			}
+	memset(&sd_log, 0, sizeof(sd_log));
+	memset(&item_log, 0, sizeof(item_log));
+	limit = get_buffer_cache_size() / ITEM_LOG_FRACTION;
+	/* the item array grows twice at once, expandmem takes int sizes */
+	if (limit > INT_MAX / 4)
+		limit = INT_MAX / 4;
+
+	/* leaves which are to be read again */
+	unlogged = reiserfs_create_bitmap(get_sb_block_count(fs->fs_ondisk_sb));
+
+	ra = readahead_init(fs->fs_dev, fs->fs_blocksize,
+			    reiserfs_bitmap_next_zero, fsck_uninsertables(fs), 0);
+	j = 0;
+	while ((j < fsck_uninsertables(fs)->bm_bit_size) &&
+	       reiserfs_bitmap_find_zero_bit(fsck_uninsertables(fs), &j) == 0) {
+		bh = readahead_bread(ra, j);
+		if (bh == NULL) {
+			fsck_log
+			    ("pass_2: Reading of the block (%lu) failed on the device 0x%x\n",
+			     j, fs->fs_dev);
+			goto cont;
+		}
 
-			if (is_block_used(bh->b_blocknr)
-			    && !(block_of_journal(fs, bh->b_blocknr)
-				 && fsck_data(fs)->rebuild.use_journal_area)) {
-				fsck_log
-				    ("%s: The block (%lu) is in the tree already. Should not happen.\n",
-				     __FUNCTION__, bh->b_blocknr);
-				goto cont;
-			}
-			/* this must be leaf */
-			what_node = who_is_this(bh->b_data, bh->b_size);
-			if (what_node != THE_LEAF) {	// || B_IS_KEYS_LEVEL(bh)) {
-				fsck_log
-				    ("%s: The block (%b), marked as a leaf on the first two passes, "
-				     "is not a leaf! Will be skipped.\n",
-				     __FUNCTION__, bh);
-				goto cont;
-			}
-/*	
-	    fsck_log ("block %lu is being inserted\n", bh->b_blocknr);
-	    check_buffers_mem(fsck_log_file (fs));
-	    fflush(fsck_log_file (fs));
-*/
-			if (i) {
-				/* insert all not SD items */
-				put_not_stat_data_items(bh);
-				pass_2_stat(fs)->leaves++;
-				make_allocable(j);
-			} else
-				/* insert SD items only */
-				put_stat_data_items(bh);
-
-			print_how_far(fsck_progress_file(fs), &done, total, 1,
-				      fsck_quiet(fs));
-cont:
-			brelse(bh);
-			j++;
+		if (is_block_used(bh->b_blocknr)
+		    && !(block_of_journal(fs, bh->b_blocknr)
+			 && fsck_data(fs)->rebuild.use_journal_area)) {
+			fsck_log
+			    ("%s: The block (%lu) is in the tree already. Should not happen.\n",
+			     __FUNCTION__, bh->b_blocknr);
+			goto cont;
 		}
+		/* this must be leaf */
+		what_node = who_is_this(bh->b_data, bh->b_size);
+		if (what_node != THE_LEAF) {	// || B_IS_KEYS_LEVEL(bh)) {
+			fsck_log
+			    ("%s: The block (%b), marked as a leaf on the first two passes, "
+			     "is not a leaf! Will be skipped.\n",
+			     __FUNCTION__, bh);
+			goto cont;
+		}
+
+		/* item heads are more than what bodies get rounded up by */
+		if (sd_log.memory + item_log.memory + B_CHILD_SIZE(bh) +
+		    B_NR_ITEMS(bh) * sizeof(struct logged_item) > limit) {
+			reiserfs_bitmap_set_bit(unlogged, j);
+			goto cont;
+		}
+
+		ih = item_head(bh, 0);
+		for (i = 0; i < B_NR_ITEMS(bh); i++, ih++) {
+			if (is_bad_item(bh, ih, ih_item_body(bh, ih)))
+				continue;
+			log_item(is_stat_data_ih(ih) ? &sd_log : &item_log, ih,
+				 ih_item_body(bh, ih));
+		}
+
+		/* items are copied, the block may be reused */
+		pass_2_stat(fs)->leaves++;
+		make_allocable(j);
+cont:
+		brelse(bh);
+		j++;
 	}
+	readahead_done(ra);
+
+	total = sd_log.nr_items + item_log.nr_items +
+	    reiserfs_bitmap_ones(unlogged) * 2;
+
+	/* insert SD items first */
+	insert_logged_items(&sd_log, &done, total);
+	free_item_log(&sd_log);
+	put_unlogged_items(fs, unlogged, 1, &done, total);
+
+	insert_logged_items(&item_log, &done, total);
+	free_item_log(&item_log);
+	put_unlogged_items(fs, unlogged, 0, &done, total);
+
+	reiserfs_delete_bitmap(unlogged);
 
 	fsck_progress("\n");
 }
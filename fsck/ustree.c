@@ -202,7 +202,9 @@ void pass_through_tree(reiserfs_filsys_t fs, do_after_read_t action1,
 	int cur[MAX_HEIGHT] = { 0, };
 	int h = 0;
 	unsigned long block = get_sb_root_block(fs->fs_ondisk_sb);
-	int problem;
+	unsigned long *children;
+	int max_children;
+	int problem, i;
 	struct spinner spinner;
 
 	spinner_init(&spinner, fsck_progress_file(fs));
@@ -213,6 +215,10 @@ void pass_through_tree(reiserfs_filsys_t fs, do_after_read_t action1,
 		    block);
 	}
 
+	max_children = (MAX_CHILD_SIZE(fs->fs_blocksize) - DC_SIZE) /
+	    (KEY_SIZE + DC_SIZE) + 1;
+	children = getmem(max_children * sizeof(unsigned long));
+
 	while (1) {
 		problem = 0;
 
@@ -292,7 +298,16 @@ void pass_through_tree(reiserfs_filsys_t fs, do_after_read_t action1,
 		total[h] = B_NR_ITEMS(path[h]) + 1;
 		cur[h] = 1;
 		block = first_child(path[h]);
+
+		/* children are read one by one, let their reads go at once */
+		if (total[h] <= max_children) {
+			for (i = 0; i < total[h]; i++)
+				children[i] = get_child(i, path[h]);
+			prefetch_blocks(fs->fs_dev, fs->fs_blocksize, children,
+					total[h]);
+		}
 		h++;
 	}
+	freemem(children);
 	spinner_clear(&spinner);
 }
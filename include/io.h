@@ -38,6 +38,7 @@ struct buffer_head {
 #define BH_Dirty	1
 #define BH_Lock		2
 #define BH_Do_not_flush 3
+#define BH_Hot		4
 
 #define buffer_uptodate(bh) misc_test_bit(BH_Uptodate, &(bh)->b_state)
 #define buffer_dirty(bh) misc_test_bit(BH_Dirty, &(bh)->b_state)
@@ -50,6 +51,12 @@ struct buffer_head {
 #define mark_buffer_do_not_flush(bh) misc_set_bit(BH_Do_not_flush, &(bh)->b_state)
 #define clear_buffer_do_not_flush(bh) misc_clear_bit(BH_Do_not_flush, &(bh)->b_state)
 
+/* hint to the buffer cache: the block is used often (like internal nodes
+   are), keep it longer than blocks read by scans */
+#define buffer_hot(bh) misc_test_bit(BH_Hot, &(bh)->b_state)
+#define mark_buffer_hot(bh) misc_set_bit(BH_Hot, &(bh)->b_state)
+#define clear_buffer_hot(bh) misc_clear_bit(BH_Hot, &(bh)->b_state)
+
 /*
 printf ("%s:%s:%u %p %p %p\n",
 __FILE__, __FUNCTION__, __LINE__,
@@ -70,6 +77,11 @@ struct buffer_head *bread(int dev, unsigned long block, size_t size);
 struct buffer_head *reiserfs_bread(int dev, unsigned long block, int size,
 				   int *repeat);
 int bwrite(struct buffer_head *bh);
+void bwrite_buffers(struct buffer_head **bhs, int count);
+int zero_blocks(int dev, unsigned long start, unsigned long count,
+		unsigned long size);
+int discard_blocks(int dev, unsigned long start, unsigned long count,
+		   unsigned long size);
 void brelse(struct buffer_head *bh);
 void bforget(struct buffer_head *bh);
 void init_rollback_file(char *rollback_file, unsigned int *blocksize,
@@ -78,8 +90,77 @@ int open_rollback_file(char *rollback_file, FILE * log);
 void close_rollback_file();
 void do_fsck_rollback(int fd_device, int fd_journal_device, FILE * log);
 
+/* see set_device_reader */
+typedef int (*device_reader_t) (void *data, unsigned long long offset,
+				char *buf, size_t size);
+
+void set_device_reader(int dev, device_reader_t read, void *data);
+void *get_device_reader_data(int dev);
+
 void flush_buffers(int);
 void free_buffers(void);
 void invalidate_buffers(int);
 
+/* size of the buffer cache, if it is not set by --cache-size option */
+#define BUFFER_CACHE_SIZE_ENV "REISERFSPROGS_CACHE_SIZE"
+
+/* getopt_long value of --cache-size option of the utilities */
+#define CACHE_SIZE_OPTION 0x100
+
+void set_buffer_cache_size(unsigned long size);
+unsigned long get_buffer_cache_size(void);
+
+struct buffer_cache_stats {
+	unsigned long nr_buffers;
+	unsigned long memory;		/* bytes of buffer data */
+	unsigned long memory_limit;	/* see set_buffer_cache_size */
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long reads;
+	unsigned long writes;
+	unsigned long readaheads;	/* reads done by read-ahead */
+	unsigned long hot;		/* unused buffers on hot list */
+	unsigned long ghost_hits;	/* blocks read again got hot */
+
+	unsigned long hash_queues;	/* size of the hash table */
+	unsigned long used_queues;	/* non-empty hash queues */
+	unsigned long hashed;		/* buffers in the hash table */
+	unsigned long max_chain;	/* longest hash queue */
+	unsigned long lookups;		/* find_buffer calls */
+	unsigned long probes;		/* buffers compared by find_buffer */
+};
+
+/* read-ahead for scans over sets of blocks, see io.c */
+#define READAHEAD_END (~0UL)
+#define READAHEAD_WINDOW 256
+
+struct readahead;
+
+struct readahead *readahead_init(int dev, unsigned long size,
+				 unsigned long (*next) (void *, unsigned long),
+				 void *data, unsigned int window);
+struct buffer_head *readahead_bread(struct readahead *ra, unsigned long block);
+void readahead_done(struct readahead *ra);
+void prefetch_blocks(int dev, unsigned long size, unsigned long *blocks,
+		     unsigned int nr);
+
+/* parallel scan over sets of blocks, see io.c */
+#define BLOCK_SCAN_ERROR (-1)
+
+struct block_scan;
+
+struct block_scan *block_scan_init(int dev, unsigned long size,
+				   unsigned long (*next) (void *,
+							  unsigned long),
+				   void *data,
+				   int (*classify) (const char *, int),
+				   unsigned int threads);
+int block_scan_class(struct block_scan *scan, unsigned long block);
+struct buffer_head *block_scan_bread(struct block_scan *scan,
+				     unsigned long block);
+void block_scan_done(struct block_scan *scan);
+
+void get_buffer_cache_stats(struct buffer_cache_stats *stats);
+void print_buffer_cache_stats(FILE *fp);
+
 #endif
@@ -18,6 +18,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <linux/major.h>
 
@@ -82,6 +83,7 @@ void print_how_fast(unsigned long total, unsigned long passed, int cursor_pos,
 __u32 get_random(void);
 
 int user_confirmed(FILE * fp, const char *q, const char *yes);
+long long int misc_str_to_bytes(const char *str);
 
 /* Only le bitops operations are used. */
 static inline int misc_set_bit(unsigned long long nr, void *addr)
@@ -124,27 +126,46 @@ static inline int misc_test_bit(unsigned long long nr, const void *addr)
 	return ((mask & *p) != 0);
 }
 
-static inline unsigned long long misc_find_first_zero_bit(const void *vaddr,
-							  unsigned long long
-							  size)
+/* Find first set (@set != 0) or zero bit at or after @offset. Words without
+   such a bit are skipped at once. Returns @size if there is no such bit */
+static inline unsigned long long misc_find_next_bit(const void *vaddr,
+						    unsigned long long size,
+						    unsigned long long offset,
+						    int set)
 {
-	const __u8 *p = vaddr, *addr = vaddr;
-	unsigned long long res;
+	const __u8 *addr = vaddr;
+	unsigned long long bytes = (size + 7) >> 3;
+	unsigned long long i = offset >> 3;
+	unsigned long word, skip = set ? 0 : ~0UL;
+	__u8 byte;
 
-	if (!size)
-		return 0;
+	if (offset >= size)
+		return size;
 
-	size = (size >> 3) + ((size & 0x7) > 0);
-	while (*p++ == 255) {
-		if (--size == 0)
-			return (unsigned long long)(p - addr) << 3;
+	/* first byte is used partially */
+	byte = (set ? addr[i] : ~addr[i]) & (0xff << (offset & 7));
+	while (!byte) {
+		if (++i >= bytes)
+			return size;
+		for (; i + sizeof(word) <= bytes; i += sizeof(word)) {
+			memcpy(&word, addr + i, sizeof(word));
+			if (word != skip)
+				break;
+		}
+		if (i >= bytes)
+			return size;
+		byte = set ? addr[i] : ~addr[i];
 	}
 
-	--p;
-	for (res = 0; res < 8; res++)
-		if (!misc_test_bit(res, p))
-			break;
-	return res + (p - addr) * 8;
+	i = (i << 3) + __builtin_ctz(byte);
+	return i < size ? i : size;
+}
+
+static inline unsigned long long misc_find_first_zero_bit(const void *vaddr,
+							  unsigned long long
+							  size)
+{
+	return misc_find_next_bit(vaddr, size, 0, 0);
 }
 
 static inline unsigned long long misc_find_next_zero_bit(const void *vaddr,
@@ -153,48 +174,14 @@ static inline unsigned long long misc_find_next_zero_bit(const void *vaddr,
 							 unsigned long long
 							 offset)
 {
-	const __u8 *addr = vaddr;
-	const __u8 *p = addr + (offset >> 3);
-	int bit = offset & 7;
-	unsigned long long res;
-
-	if (offset >= size)
-		return size;
-
-	if (bit) {
-		/* Look for zero in first char */
-		for (res = bit; res < 8; res++)
-			if (!misc_test_bit(res, p))
-				return res + (p - addr) * 8;
-		p++;
-	}
-	/* No zero yet, search remaining full bytes for a zero */
-	res = misc_find_first_zero_bit(p, size - 8 * (p - addr));
-	return res + (p - addr) * 8;
+	return misc_find_next_bit(vaddr, size, offset, 0);
 }
 
 static inline unsigned long long misc_find_first_set_bit(const void *vaddr,
 							 unsigned long long
 							 size)
 {
-	const __u8 *p = vaddr, *addr = vaddr;
-	unsigned long long res;
-
-	if (!size)
-		return 0;
-
-	size = (size >> 3) + ((size & 0x7) > 0);
-	while (*p++ == 0) {
-		if (--size == 0)
-			return (unsigned long long)(p - addr) << 3;
-	}
-
-	--p;
-	for (res = 0; res < 8; res++)
-		if (misc_test_bit(res, p))
-			break;
-
-	return res + (p - addr) * 8;
+	return misc_find_next_bit(vaddr, size, 0, 1);
 }
 
 static inline unsigned long long misc_find_next_set_bit(const void *vaddr,
@@ -202,24 +189,7 @@ static inline unsigned long long misc_find_next_set_bit(const void *vaddr,
 							unsigned long long
 							offset)
 {
-	const __u8 *addr = vaddr;
-	const __u8 *p = addr + (offset >> 3);
-	int bit = offset & 7;
-	unsigned long long res;
-
-	if (offset >= size)
-		return size;
-
-	if (bit) {
-		/* Look for zero in first char */
-		for (res = bit; res < 8; res++)
-			if (misc_test_bit(res, p))
-				return res + (p - addr) * 8;
-		p++;
-	}
-	/* No set bit yet, search remaining full bytes for a 1 */
-	res = misc_find_first_set_bit(p, size - 8 * (p - addr));
-	return res + (p - addr) * 8;
+	return misc_find_next_bit(vaddr, size, offset, 1);
 }
 
 #define STAT_FIELD(Field, Type)						\
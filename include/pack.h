@@ -0,0 +1,178 @@
+/*
+ * Copyright 2000-2004 by Hans Reiser, licensing governed by
+ * reiserfsprogs/README
+ */
+
+#ifndef REISERFSPROGS_PACK_H
+#define REISERFSPROGS_PACK_H
+
+/* format of metadata packed by debugreiserfs -p */
+
+#include "reiserfs_lib.h"
+
+// the leaf is stored in compact form:
+// start magic number
+// block number __u32
+// item number __u16
+// struct packed_item
+// ..
+// end magic number
+
+/* we store hash code in high byte of 16 bits */
+#define LEAF_START_MAGIC 0xa6
+#define LEAF_END_MAGIC 0x5a
+
+#define FULL_BLOCK_START_MAGIC 0xb6
+#define FULL_BLOCK_END_MAGIC 0x6b
+#define UNFORMATTED_BITMAP_START_MAGIC 0xc7
+#define UNFORMATTED_BITMAP_END_MAGIC 0x7c
+#define END_MAGIC 0x8d
+#define INTERNAL_START_MAGIC
+#define INTERNAL_START_MAGIC
+#define SEPARATED_JOURNAL_START_MAGIC 0xf8
+#define SEPARATED_JOURNAL_END_MAGIC   0x8f
+
+#define ITEM_START_MAGIC 0x476576
+#define ITEM_END_MAGIC 0x2906504
+
+#define MAP_MAGIC 0xe9
+#define MAP_END_MAGIC 0x9e
+
+/* 12 bits of mask are used to define */
+#define NEW_FORMAT 			0x01	/* 1. 0 here means - old format, 1 - new format */
+#define DIR_ID     			0x02	/* 2. dir_id is stored */
+#define OBJECT_ID  			0x04	/* 3. objectid is stored */
+#define OFFSET_BITS_32 			0x08	/* 4. offset is stored as 32 bit */
+#define OFFSET_BITS_64 			0x10	/* 5. offset is stored as 64 bit */
+#define IH_ENTRY_COUNT 			0x20	/* 6. ih_free_space/ih_entry_count is stored */
+#define IH_FREE_SPACE  			0x20
+#define IH_FORMAT 			0x40	/* 7. ih_format is stored */
+#define WITH_SD_FIRST_DIRECT_BYTE 	0x80	/* 8. for old stat data first_direct_byte is stored */
+#define NLINK_BITS_32 			0x0100	/* 9. nlinks stored in 32 bits */
+#define SIZE_BITS_64  			0x0200	/* 10. size has to be stored in 64 bit */
+#define WHOLE_INDIRECT 			0x0400	/* 11. indirect item is stored with compression */
+#define SAFE_LINK			0x0800	/* 11. indirect item is stored with compression */
+
+#define TYPE_MASK 0x3		/* two lowest bits are used to store item type */
+//#define MASK_MASK 0xffffc /* what is packed: dirid, objectid, etc */
+#define ITEM_LEN_MASK 0xfff00000	/* contents of ih_item_len of item_head */
+
+struct packed_item {
+	__u32 type_2_mask_18_len_12;
+};
+
+static inline void set_pi_type(struct packed_item *pi, __u32 val)
+{
+	set_bit_field_XX(32, pi, val, 0, 2);
+}
+
+static inline __u32 get_pi_type(const struct packed_item *pi)
+{
+	get_bit_field_XX(32, pi, 0, 2);
+}
+
+static inline void set_pi_mask(struct packed_item *pi, __u32 val)
+{
+	set_bit_field_XX(32, pi, val, 2, 18);
+}
+
+static inline __u32 get_pi_mask(const struct packed_item *pi)
+{
+	get_bit_field_XX(32, pi, 2, 18);
+}
+
+static inline void set_pi_item_len(struct packed_item *pi, __u32 val)
+{
+	set_bit_field_XX(32, pi, val, 20, 12);
+}
+
+static inline __u32 get_pi_item_len(const struct packed_item *pi)
+{
+	get_bit_field_XX(32, pi, 20, 12);
+}
+
+#define HAS_DIR_ID      0x01
+#define HAS_GEN_COUNTER 0x02
+#define HAS_STATE       0x04
+#define YURA            0x08
+#define TEA             0x10
+#define R5              0x20
+
+struct packed_dir_entry {
+	__u8 mask;
+	__u16 entrylen;
+};
+
+/* packed_dir_entry.mask is *always* endian safe, since it's 8 bit */
+#define get_pe_entrylen(pe)     (le16_to_cpu((pe)->entrylen))
+#define set_pe_entrylen(pe,v)   ((pe)->entrylen = cpu_to_le16(v))
+
+/* Version 2 stream ends with an index of packed blocks followed by a
+   trailer, so a block can be found without unpacking the stream (see
+   reiserfs_open_packed). unpack stops at END_MAGIC, before them. Blocks of
+   a journal on a separate device are not in the index */
+struct packed_index_entry {
+	__le32 pie_block;
+	__le32 pie_len;		/* length of the record of the block */
+	__le64 pie_offset;	/* offset of the record in the stream */
+};
+
+#define PACKED_TRAILER_MAGIC "ReIsErPk"
+#define PACKED_VERSION 2
+
+struct packed_trailer {
+	__le64 pt_index_offset;
+	__le32 pt_index_nr;	/* number of index entries */
+	__le32 pt_block_count;	/* blocks of the packed device */
+	__le16 pt_blocksize;
+	__le16 pt_version;
+	__le32 pt_reserved;
+	char pt_magic[8];
+};
+
+/* packed stream being parsed */
+struct pack_input {
+	const char *buf;	/* bytes of the stream available */
+	const char *pos;	/* next byte */
+	const char *end;
+	unsigned long long base;	/* stream offset of ->buf */
+	/* get more of the stream to ->buf, non-zero at the end of it */
+	int (*fill) (struct pack_input *in);
+	void *data;
+};
+
+#define pack_input_offset(in) ((in)->base + ((in)->pos - (in)->buf))
+
+void pack_read(struct pack_input *in, void *buf, size_t size);
+
+#define pack_read8(in, pv) pack_read(in, pv, sizeof(__u8))
+#define pack_read16(in, pv) pack_read(in, pv, sizeof(__u16))
+#define pack_read32(in, pv) pack_read(in, pv, sizeof(__u32))
+#define pack_read64(in, pv) pack_read(in, pv, sizeof(__u64))
+
+#define pack_read_le16(in, pv)\
+{\
+    __le16 tmp; \
+    pack_read16(in, &tmp); \
+    *pv = le16_to_cpu(tmp); \
+}
+
+#define pack_read_le32(in, pv)\
+{\
+    __le32 tmp; \
+    pack_read32(in, &tmp); \
+    *pv = le32_to_cpu(tmp); \
+}
+
+#define pack_read_le64(in, pv)\
+{\
+    __le64 tmp; \
+    pack_read64(in, &tmp); \
+    *pv = le64_to_cpu(tmp); \
+}
+
+/* reiserfscore/packed.c */
+void unpack_leaf_items(struct pack_input *in, char *block, unsigned int size,
+		       hashf_t hash_func);
+
+#endif
@@ -128,6 +128,7 @@ int reiserfs_search_by_key_3(reiserfs_filsys_t , const struct reiserfs_key *key,
 			     struct reiserfs_path *path);
 int reiserfs_search_by_key_4(reiserfs_filsys_t , const struct reiserfs_key *key,
 			     struct reiserfs_path *path);
+void reiserfs_forget_search_finger(reiserfs_filsys_t);
 int reiserfs_search_by_entry_key(reiserfs_filsys_t,
 				 const struct reiserfs_key *key,
 				 struct reiserfs_path *path);
@@ -193,6 +194,20 @@ extern __u16 root_dir_format;
 extern __u16 lost_found_dir_format;
 
 /* bitmap.c */
+
+/* go through set bits of a bitmap (@bit is unsigned long), time taken is
+   proportional to number of set bits rather than bitmap size */
+#define reiserfs_bitmap_for_each_set(bm, bit)				\
+	for ((bit) = reiserfs_bitmap_find_next_set((bm), 0);		\
+	     (bit) < (bm)->bm_bit_size;					\
+	     (bit) = reiserfs_bitmap_find_next_set((bm), (bit) + 1))
+
+/* go through runs of set bits: [@start, @start + @count) */
+#define reiserfs_bitmap_for_each_run(bm, start, count)			\
+	for ((start) = 0;						\
+	     reiserfs_bitmap_find_next_run((bm), &(start), &(count));	\
+	     (start) += (count))
+
 int reiserfs_open_ondisk_bitmap(reiserfs_filsys_t );
 int reiserfs_create_ondisk_bitmap(reiserfs_filsys_t );
 void reiserfs_free_ondisk_bitmap(reiserfs_filsys_t );
@@ -216,6 +231,13 @@ void reiserfs_bitmap_clear_bit(reiserfs_bitmap_t *bm, unsigned int bit_number);
 
 int reiserfs_bitmap_test_bit(reiserfs_bitmap_t *bm, unsigned int bit_number);
 int reiserfs_bitmap_find_zero_bit(reiserfs_bitmap_t *bm, unsigned long *start);
+int reiserfs_bitmap_summarize(reiserfs_bitmap_t *bm);
+unsigned long reiserfs_bitmap_find_next_set(reiserfs_bitmap_t *bm,
+					    unsigned long from);
+int reiserfs_bitmap_find_next_run(reiserfs_bitmap_t *bm, unsigned long *start,
+				  unsigned long *count);
+unsigned long reiserfs_bitmap_next_set(void *bm, unsigned long from);
+unsigned long reiserfs_bitmap_next_zero(void *bm, unsigned long from);
 /*int reiserfs_fetch_ondisk_bitmap (reiserfs_bitmap_t *bm, reiserfs_filsys_t );*/
 /*int reiserfs_flush_bitmap (reiserfs_bitmap_t *bm, reiserfs_filsys_t );*/
 void reiserfs_bitmap_zero(reiserfs_bitmap_t *bm);
@@ -379,6 +401,8 @@ int reiserfs_create_journal(reiserfs_filsys_t fs, const char *j_filename,
 			    unsigned long offset, unsigned long len,
 			    int transaction_max_size, int force);
 int reiserfs_journal_opened(reiserfs_filsys_t );
+void reiserfs_load_journal(reiserfs_filsys_t fs);
+void reiserfs_unload_journal(reiserfs_filsys_t fs);
 void reiserfs_flush_journal(reiserfs_filsys_t fs);
 void reiserfs_free_journal(reiserfs_filsys_t fs);
 void reiserfs_close_journal(reiserfs_filsys_t );
@@ -437,4 +461,9 @@ int can_we_format_it(const char *device_name, int force);
 __u32 reiserfs_xattr_hash(const char *msg, int len);
 int reiserfs_check_xattr(const void *body, int len);
 int reiserfs_acl_count(size_t size);
+
+/* packed.c */
+unsigned long reiserfs_open_packed(int fd);
+void reiserfs_close_packed(int fd);
+int reiserfs_is_packed(int fd);
 #endif /* REISERFSPROGS_LIB_H */
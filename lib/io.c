@@ -3,10 +3,21 @@
  * reiserfsprogs/README
  */
 
+#define _GNU_SOURCE
+
 #include "io.h"
 
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#ifdef HAVE_LINUX_FALLOC_H
+#  include <linux/falloc.h>
+#endif
+#ifdef HAVE_PTHREAD
+#  include <pthread.h>
+#endif
 #include <asm/types.h>
 
 void check_memory_msg(void)
@@ -54,105 +65,342 @@ static int is_bad_block(unsigned long block)
 	return 0;
 }
 
-/* All buffers are in double linked cycled list.  If getblk found buffer with
-   wanted block number in hash queue it moves buffer to the end of list. */
+/* Buffers are kept in pools, one pool per block size. Inside of a pool every
+   buffer is on exactly one double linked cycled list, b_list tells which:
+
+   BUF_FREE   - buffer is not in the hash queue, its contents are garbage
+   BUF_CLEAN  - unused (b_count == 0) clean buffer, in LRU order. The head of
+		the list is the next buffer to be reused
+   BUF_HOT    - the same for buffers marked hot
+   BUF_DIRTY  - unused dirty buffer, it has to be written before reuse
+   BUF_PINNED - buffer is in use (b_count != 0)
+
+   Clean buffers are reused as 2Q does: BUF_CLEAN is the probation queue
+   every block read gets on, BUF_HOT is for blocks which were used again
+   after they had been dropped from the probation queue (blocks dropped
+   recently are remembered in "ghost" queue) and for blocks marked hot by
+   users (internal nodes). Buffers of BUF_CLEAN are reused first, unless
+   that list got shorter than 1/BUF_PROBATION_SHARE of unused clean buffers,
+   so a long scan through the device pushes out only buffers it read
+   itself.
+
+   Buffers are moved between lists by getblk, brelse, bforget and write-back,
+   so finding a buffer to reuse, releasing and growing take constant time.
+   b_count and b_state are also changed directly by reiserfscore (see
+   fix_node.c, do_balan.c), so a buffer may be on a wrong list for a while.
+   That is fixed lazily: whoever takes a buffer from the head of a list
+   checks it and refiles it if needed. */
+
+#define BUF_FREE	0
+#define BUF_CLEAN	1
+#define BUF_HOT		2
+#define BUF_DIRTY	3
+#define BUF_PINNED	4
+#define NR_BUF_LISTS	5
+
+#define BUF_PROBATION_SHARE 4
+
+struct buffer_pool {
+	unsigned long size;
+	struct buffer_head *lists[NR_BUF_LISTS];
+	int nr_on_list[NR_BUF_LISTS];
+	struct buffer_pool *next;
+};
 
 static int g_nr_buffers;
 
 static unsigned long buffers_memory;
 
 /* create buffers until we spend this fraction of system memory, this
-** is a hard limit on the amount of buffer ram used
+** is a hard limit on the amount of buffer ram used unless it is set
+** explicitly (see set_buffer_cache_size)
 */
 #define BUFFER_MEMORY_FRACTION 10
 
+/* used when the amount of system memory is unknown */
+#define BUFFER_MEMORY_DEFAULT (64 * 1024 * 1024)
+
 /* number of bytes in local buffer cache before we start forcing syncs
 ** of dirty data and reusing unused buffers instead of allocating new
 ** ones.  If a flush doesn't find reusable buffers, new ones are
-** still allocated up to the BUFFER_MEMORY_FRACTION percentage
+** still allocated up to the hard limit. When the size of the cache is
+** set explicitly, it is used as both limits
 **
 */
 #define BUFFER_SOFT_LIMIT (500 * 1024)
+static unsigned long buffer_soft_limit_start = BUFFER_SOFT_LIMIT;
 static unsigned long buffer_soft_limit = BUFFER_SOFT_LIMIT;
-
-#define NR_HASH_QUEUES 4096
-static struct buffer_head *g_a_hash_queues[NR_HASH_QUEUES];
-static struct buffer_head *Buffer_list_head;
-static struct buffer_head *g_free_buffers = NULL;
+static unsigned long buffer_memory_limit = 0;
+static int buffer_memory_limit_warned = 0;
+
+/* number of dirty buffers written at once when there is nothing to reuse */
+#define BUFFER_WRITEBACK_BATCH 32
+
+static void write_buffers(struct buffer_head **bhs, int count);
+
+/* hash table of cached buffers. It is doubled every time the number of buffers
+   gets bigger than the number of hash queues, so that chains stay short */
+#define MIN_HASH_QUEUES 4096
+static struct buffer_head **g_a_hash_queues;
+static unsigned long g_nr_hash_queues;
+static unsigned long g_nr_hashed;
+static unsigned long hash_lookups = 0;
+static unsigned long hash_probes = 0;
+static struct buffer_pool *g_buffer_pools;
+
+/* ghost queue: ring of keys of buffers reused from the probation queue,
+   hashed to be found quickly */
+struct ghost {
+	int dev;		/* -1 if the slot is empty */
+	unsigned long block;
+	unsigned long size;
+	long next;		/* next ghost in the hash chain or -1 */
+};
+
+static struct ghost *g_ghosts;
+static long *g_ghost_hash;
+static unsigned long g_nr_ghosts;	/* power of 2 */
+static unsigned long g_ghost_pos;
+static unsigned long ghost_hits = 0;
 static struct buffer_head *g_buffer_heads;
+static struct buffer_head *g_buffer_heads_last;
 static int buffer_hits = 0;
 static int buffer_misses = 0;
 static int buffer_reads = 0;
 static int buffer_writes = 0;
+static unsigned long buffer_readaheads = 0;
+
+static struct buffer_pool *get_buffer_pool(unsigned long size)
+{
+	struct buffer_pool *pool;
+
+	for (pool = g_buffer_pools; pool; pool = pool->next)
+		if (pool->size == size)
+			return pool;
+
+	pool = getmem(sizeof(struct buffer_pool));
+	pool->size = size;
+	pool->next = g_buffer_pools;
+	g_buffer_pools = pool;
+	return pool;
+}
 
-static void _show_buffers(struct buffer_head **list, int dev,
-			  unsigned long size)
+static void show_buffers(int dev, int size)
 {
 	int all = 0;
 	int dirty = 0;
 	int in_use = 0;		/* count != 0 */
 	int free = 0;
+	struct buffer_pool *pool;
 	struct buffer_head *next;
+	int i;
 
-	next = *list;
-	if (!next)
-		return;
+	pool = get_buffer_pool(size);
+	for (i = 0; i < NR_BUF_LISTS; i++) {
+		next = pool->lists[i];
+		if (!next)
+			continue;
 
-	for (;;) {
-		if (next->b_dev == dev && next->b_size == size) {
-			all++;
-			if (next->b_count != 0) {
-				in_use++;
-			}
-			if (buffer_dirty(next)) {
-				dirty++;
-			}
-			if (buffer_clean(next) && next->b_count == 0) {
-				free++;
+		for (;;) {
+			if (next->b_dev == dev) {
+				all++;
+				if (next->b_count != 0) {
+					in_use++;
+				}
+				if (buffer_dirty(next)) {
+					dirty++;
+				}
+				if (buffer_clean(next) && next->b_count == 0) {
+					free++;
+				}
 			}
+			next = next->b_next;
+			if (next == pool->lists[i])
+				break;
 		}
-		next = next->b_next;
-		if (next == *list)
-			break;
 	}
 
 	printf
-	    ("show_buffers (dev %d, size %lu): free %d, count != 0 %d, dirty %d, "
+	    ("show_buffers (dev %d, size %d): free %d, count != 0 %d, dirty %d, "
 	     "all %d\n", dev, size, free, in_use, dirty, all);
 }
 
-static void show_buffers(int dev, int size)
+/* block numbers of spread bitmaps, of nodes allocated one after another, etc
+   differ from each other in a regular way, so all bits of the key are mixed
+   (this is the finalizer of MurmurHash3) */
+static __u64 block_key_hash(int dev, unsigned long block, unsigned long size)
 {
-	_show_buffers(&Buffer_list_head, dev, size);
-	_show_buffers(&g_free_buffers, dev, size);
+	__u64 h;
+
+	h = (__u64)block ^ ((__u64)(unsigned int)dev << 32) ^
+	    ((__u64)size << 48);
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
 }
 
-static void insert_into_hash_queue(struct buffer_head *bh)
+static unsigned long buffer_hash(int dev, unsigned long block,
+				 unsigned long size)
+{
+	/* number of hash queues is always power of 2 */
+	return (unsigned long)block_key_hash(dev, block, size) &
+	    (g_nr_hash_queues - 1);
+}
+
+static long *ghost_chain(int dev, unsigned long block, unsigned long size)
+{
+	return &g_ghost_hash[block_key_hash(dev, block, size) &
+			     (g_nr_ghosts - 1)];
+}
+
+/* the ghost queue is emptied when it is resized */
+static void resize_ghosts(unsigned long nr)
+{
+	unsigned long i;
+
+	if (g_ghosts) {
+		freemem(g_ghosts);
+		freemem(g_ghost_hash);
+	}
+
+	g_ghosts = getmem(nr * sizeof(struct ghost));
+	g_ghost_hash = getmem(nr * sizeof(long));
+	for (i = 0; i < nr; i++) {
+		g_ghosts[i].dev = -1;
+		g_ghost_hash[i] = -1;
+	}
+	g_nr_ghosts = nr;
+	g_ghost_pos = 0;
+}
+
+static void unlink_ghost(long i)
 {
-	int index = bh->b_blocknr % NR_HASH_QUEUES;
+	struct ghost *ghost = &g_ghosts[i];
+	long *chain;
+
+	chain = ghost_chain(ghost->dev, ghost->block, ghost->size);
+	while (*chain != i)
+		chain = &g_ghosts[*chain].next;
+	*chain = ghost->next;
+	ghost->dev = -1;
+}
+
+/* remember the block of the buffer which is about to be reused */
+static void remember_ghost(struct buffer_head *bh)
+{
+	struct ghost *ghost;
+	long *chain;
+
+	if (!g_nr_ghosts)
+		return;
+
+	ghost = &g_ghosts[g_ghost_pos];
+	if (ghost->dev != -1)
+		unlink_ghost(g_ghost_pos);
+
+	ghost->dev = bh->b_dev;
+	ghost->block = bh->b_blocknr;
+	ghost->size = bh->b_size;
+	chain = ghost_chain(bh->b_dev, bh->b_blocknr, bh->b_size);
+	ghost->next = *chain;
+	*chain = g_ghost_pos;
 
+	g_ghost_pos = (g_ghost_pos + 1) & (g_nr_ghosts - 1);
+}
+
+/* returns 1 if the block was reused from the probation queue recently */
+static int forget_ghost(int dev, unsigned long block, unsigned long size)
+{
+	long i;
+
+	if (!g_nr_ghosts)
+		return 0;
+
+	for (i = *ghost_chain(dev, block, size); i != -1; i = g_ghosts[i].next) {
+		if (g_ghosts[i].block == block && g_ghosts[i].size == size &&
+		    g_ghosts[i].dev == dev) {
+			unlink_ghost(i);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static struct buffer_head **hash_queue(int dev, unsigned long block,
+				       unsigned long size)
+{
+	return &g_a_hash_queues[buffer_hash(dev, block, size)];
+}
+
+static void __insert_into_hash_queue(struct buffer_head *bh)
+{
+	struct buffer_head **queue;
+
+	queue = hash_queue(bh->b_dev, bh->b_blocknr, bh->b_size);
+	if (*queue) {
+		(*queue)->b_hash_prev = bh;
+		bh->b_hash_next = *queue;
+	}
+	*queue = bh;
+}
+
+/* rehash all cached buffers into table of @nr_queues hash queues */
+static void resize_hash_table(unsigned long nr_queues)
+{
+	struct buffer_head **old = g_a_hash_queues;
+	unsigned long old_nr = g_nr_hash_queues;
+	struct buffer_head *bh;
+	unsigned long i;
+
+	g_a_hash_queues = getmem(nr_queues * sizeof(struct buffer_head *));
+	g_nr_hash_queues = nr_queues;
+
+	for (i = 0; i < old_nr; i++) {
+		while ((bh = old[i]) != NULL) {
+			old[i] = bh->b_hash_next;
+			bh->b_hash_next = bh->b_hash_prev = NULL;
+			__insert_into_hash_queue(bh);
+		}
+	}
+
+	if (old)
+		freemem(old);
+
+	/* the ghost queue remembers about a half of cache size blocks */
+	resize_ghosts(nr_queues / 2);
+}
+
+static void insert_into_hash_queue(struct buffer_head *bh)
+{
 	if (bh->b_hash_prev || bh->b_hash_next)
 		die("insert_into_hash_queue: hash queue corrupted");
 
-	if (g_a_hash_queues[index]) {
-		g_a_hash_queues[index]->b_hash_prev = bh;
-		bh->b_hash_next = g_a_hash_queues[index];
-	}
-	g_a_hash_queues[index] = bh;
+	if (!g_a_hash_queues)
+		resize_hash_table(MIN_HASH_QUEUES);
+
+	__insert_into_hash_queue(bh);
+	g_nr_hashed++;
 }
 
 static void remove_from_hash_queue(struct buffer_head *bh)
 {
-	if (bh->b_hash_next == NULL && bh->b_hash_prev == NULL
-	    && bh != g_a_hash_queues[bh->b_blocknr % NR_HASH_QUEUES])
+	struct buffer_head **queue;
+
+	if (!g_a_hash_queues)
+		return;
+
+	queue = hash_queue(bh->b_dev, bh->b_blocknr, bh->b_size);
+	if (bh->b_hash_next == NULL && bh->b_hash_prev == NULL && bh != *queue)
 		/* (b_dev == -1) ? */
 		return;
 
-	if (bh == g_a_hash_queues[bh->b_blocknr % NR_HASH_QUEUES]) {
+	if (bh == *queue) {
 		if (bh->b_hash_prev)
 			die("remove_from_hash_queue: hash queue corrupted");
-		g_a_hash_queues[bh->b_blocknr % NR_HASH_QUEUES] =
-		    bh->b_hash_next;
+		*queue = bh->b_hash_next;
 	}
 	if (bh->b_hash_next)
 		bh->b_hash_next->b_hash_prev = bh->b_hash_prev;
@@ -161,6 +409,7 @@ static void remove_from_hash_queue(struct buffer_head *bh)
 		bh->b_hash_prev->b_hash_next = bh->b_hash_next;
 
 	bh->b_hash_prev = bh->b_hash_next = NULL;
+	g_nr_hashed--;
 }
 
 static void put_buffer_list_end(struct buffer_head **list,
@@ -207,46 +456,95 @@ static void put_buffer_list_head(struct buffer_head **list,
 	*list = bh;
 }
 
-/*
-#include <sys/mman.h>
+/* move buffer to the end (or to the head) of the given list of its pool */
+static void __refile_buffer(struct buffer_pool *pool, struct buffer_head *bh,
+			    unsigned int list, int to_head)
+{
+	remove_from_buffer_list(&pool->lists[bh->b_list], bh);
+	pool->nr_on_list[bh->b_list]--;
 
-static size_t estimate_memory_amount (void)
+	if (list == BUF_FREE)
+		remove_from_hash_queue(bh);
+
+	bh->b_list = list;
+	if (to_head)
+		put_buffer_list_head(&pool->lists[list], bh);
+	else
+		put_buffer_list_end(&pool->lists[list], bh);
+	pool->nr_on_list[list]++;
+}
+
+static void refile_buffer(struct buffer_head *bh, unsigned int list,
+			  int to_head)
 {
-    size_t len = 1;
-    size_t max = 0;
-    void * addr;
+	__refile_buffer(get_buffer_pool(bh->b_size), bh, list, to_head);
+}
 
-    while (len > 0) {
-	addr = mmap (0, len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-	if (addr == MAP_FAILED) {
-	    if (errno != ENOMEM)
-		die ("mmap failed: %s\n", strerror(errno));
-	    break;
-	}
-	if (mlock (addr, len) != 0) {
-	    if (errno == EPERM)
-		die ("No permission to run mlock");
-	    break;
-	}
+/* which list an unused buffer has to be on */
+static unsigned int unused_buffer_list(struct buffer_head *bh)
+{
+	if (!buffer_uptodate(bh))
+		/* nothing worth keeping there, bwrite would not write it
+		   either */
+		return BUF_FREE;
+	if (buffer_dirty(bh))
+		return BUF_DIRTY;
+	return buffer_hot(bh) ? BUF_HOT : BUF_CLEAN;
+}
 
-	munlock (addr, len);
-	munmap (addr, len);
-	max = len;
-	len *= 2;
-    }
+static unsigned long estimate_memory_amount(void)
+{
+	long pages, page_size;
+	unsigned long long bytes;
 
-    // * If we've looped, we don't want to return 0, we want to return the
-    // * last successful len before we looped. In the event that mmap/mlock
-    // * failed for len = 1, max will still be 0, so we don't get an invalid
-    // * result
-    return max;
+	pages = sysconf(_SC_PHYS_PAGES);
+	page_size = sysconf(_SC_PAGESIZE);
+	if (pages <= 0 || page_size <= 0)
+		return 0;
+
+	bytes = (unsigned long long)pages * page_size;
+	if (bytes > (unsigned long)-1)
+		bytes = (unsigned long)-1;
+	return bytes;
+}
+
+/* set the hard limit (and the soft one) of the buffer cache in bytes */
+void set_buffer_cache_size(unsigned long size)
+{
+	buffer_memory_limit = size;
+	buffer_soft_limit_start = size;
+	buffer_soft_limit = size;
+}
+
+unsigned long get_buffer_cache_size(void)
+{
+	long long int size;
+	char *env;
+
+	if (buffer_memory_limit)
+		return buffer_memory_limit;
+
+	env = getenv(BUFFER_CACHE_SIZE_ENV);
+	if (env && (size = misc_str_to_bytes(env)) > 0) {
+		set_buffer_cache_size(size);
+		return buffer_memory_limit;
+	}
+
+	buffer_memory_limit = estimate_memory_amount() / BUFFER_MEMORY_FRACTION;
+	if (!buffer_memory_limit)
+		buffer_memory_limit = BUFFER_MEMORY_DEFAULT;
+	if (buffer_soft_limit_start > buffer_memory_limit) {
+		buffer_soft_limit_start = buffer_memory_limit;
+		buffer_soft_limit = buffer_memory_limit;
+	}
+	return buffer_memory_limit;
 }
-*/
 
 #define GROW_BUFFERS__NEW_BUFERS_PER_CALL 10
 
-/* creates number of new buffers and insert them into head of buffer list */
-static int grow_buffers(int size)
+/* creates number of new buffers and insert them into head of free list of the
+   pool */
+static int grow_buffers(struct buffer_pool *pool)
 {
 	int i;
 	struct buffer_head *bh, *tmp;
@@ -255,34 +553,35 @@ static int grow_buffers(int size)
 	bh = (struct buffer_head *)getmem(GROW_BUFFERS__NEW_BUFERS_PER_CALL *
 					  sizeof(struct buffer_head) +
 					  sizeof(struct buffer_head *));
+	/* link new array to the end of array list */
 	if (!g_buffer_heads)
 		g_buffer_heads = bh;
-	else {
-		/* link new array to the end of array list */
-		tmp = g_buffer_heads;
-		while (*(struct buffer_head **)
-		       (tmp + GROW_BUFFERS__NEW_BUFERS_PER_CALL) != NULL)
-			tmp =
-			    *(struct buffer_head **)(tmp +
-						     GROW_BUFFERS__NEW_BUFERS_PER_CALL);
-		*(struct buffer_head **)(tmp +
+	else
+		*(struct buffer_head **)(g_buffer_heads_last +
 					 GROW_BUFFERS__NEW_BUFERS_PER_CALL) =
 		    bh;
-	}
+	g_buffer_heads_last = bh;
 
 	for (i = 0; i < GROW_BUFFERS__NEW_BUFERS_PER_CALL; i++) {
 
 		tmp = bh + i;
 		memset(tmp, 0, sizeof(struct buffer_head));
-		tmp->b_data = getmem(size);
+		tmp->b_data = getmem(pool->size);
 		if (!tmp->b_data)
 			die("grow_buffers: no memory for new buffer data");
 		tmp->b_dev = -1;
-		tmp->b_size = size;
-		put_buffer_list_head(&g_free_buffers, tmp);
+		tmp->b_size = pool->size;
+		tmp->b_list = BUF_FREE;
+		put_buffer_list_head(&pool->lists[BUF_FREE], tmp);
+		pool->nr_on_list[BUF_FREE]++;
 	}
-	buffers_memory += GROW_BUFFERS__NEW_BUFERS_PER_CALL * size;
+	buffers_memory += GROW_BUFFERS__NEW_BUFERS_PER_CALL * pool->size;
 	g_nr_buffers += GROW_BUFFERS__NEW_BUFERS_PER_CALL;
+
+	/* keep load factor of the hash table not greater than 1 */
+	if ((unsigned long)g_nr_buffers > g_nr_hash_queues)
+		resize_hash_table(g_nr_hash_queues ? g_nr_hash_queues * 2 :
+				  MIN_HASH_QUEUES);
 	return GROW_BUFFERS__NEW_BUFERS_PER_CALL;
 }
 
@@ -291,11 +590,16 @@ struct buffer_head *find_buffer(int dev, unsigned long block,
 {
 	struct buffer_head *next;
 
-	next = g_a_hash_queues[block % NR_HASH_QUEUES];
+	if (!g_a_hash_queues)
+		return NULL;
+
+	hash_lookups++;
+	next = *hash_queue(dev, block, size);
 	for (;;) {
 		struct buffer_head *tmp = next;
 		if (!next)
 			break;
+		hash_probes++;
 		next = tmp->b_hash_next;
 		if (tmp->b_blocknr != block || tmp->b_size != size
 		    || tmp->b_dev != dev)
@@ -306,116 +610,233 @@ struct buffer_head *find_buffer(int dev, unsigned long block,
 	return next;
 }
 
-static struct buffer_head *get_free_buffer(struct buffer_head **list,
-					   unsigned long size)
+/* get the least recently used buffer of the clean list which is still clean
+   and unused */
+static struct buffer_head *get_clean_buffer(struct buffer_pool *pool,
+					    unsigned int list)
 {
-	struct buffer_head *next;
+	struct buffer_head *bh;
+
+	while ((bh = pool->lists[list]) != NULL) {
+		if (bh->b_count != 0)
+			__refile_buffer(pool, bh, BUF_PINNED, 0);
+		else if (buffer_dirty(bh))
+			__refile_buffer(pool, bh, BUF_DIRTY, 0);
+		else
+			break;
+	}
+	return bh;
+}
+
+/* take a buffer from the free list or the least recently used clean one */
+static struct buffer_head *get_free_buffer(struct buffer_pool *pool,
+					   int reuse_clean)
+{
+	struct buffer_head *bh;
+	int nr;
+
+	while ((bh = pool->lists[BUF_FREE]) != NULL) {
+		if (bh->b_count != 0)
+			__refile_buffer(pool, bh, BUF_PINNED, 0);
+		else
+			goto found;
+	}
 
-	next = *list;
-	if (!next)
+	if (!reuse_clean)
 		return NULL;
 
-	for (;;) {
-		if (!next)
-			die("get_free_buffer: buffer list is corrupted");
-		if (next->b_count == 0 && buffer_clean(next)
-		    && next->b_size == size) {
-			remove_from_hash_queue(next);
-			remove_from_buffer_list(list, next);
-			return next;
-		}
-		next = next->b_next;
-		if (next == *list)
-			break;
+	nr = pool->nr_on_list[BUF_CLEAN] + pool->nr_on_list[BUF_HOT];
+
+	bh = NULL;
+	if (pool->nr_on_list[BUF_CLEAN] > nr / BUF_PROBATION_SHARE) {
+		bh = get_clean_buffer(pool, BUF_CLEAN);
+		if (bh)
+			remember_ghost(bh);
 	}
-	return NULL;
+	if (!bh)
+		bh = get_clean_buffer(pool, BUF_HOT);
+	if (!bh) {
+		bh = get_clean_buffer(pool, BUF_CLEAN);
+		if (bh)
+			remember_ghost(bh);
+	}
+	if (!bh)
+		return NULL;
+
+found:
+	__refile_buffer(pool, bh, BUF_PINNED, 0);
+	return bh;
 }
 
-/* to_write == 0 when all blocks have to be flushed. Otherwise - write only
-   buffers with b_count == 0 */
-static int sync_buffers(struct buffer_head **list, int dev, int to_write)
+static int buffer_to_be_written(struct buffer_head *bh)
 {
-	struct buffer_head *next;
+	return buffer_dirty(bh) && buffer_uptodate(bh) &&
+	    !buffer_do_not_flush(bh);
+}
+
+/* write up to @to_write unused dirty buffers of the pool starting from least
+   recently used ones. Returns number of buffers which became reusable */
+static int sync_buffers(struct buffer_pool *pool, int to_write)
+{
+	struct buffer_head *bhs[BUFFER_WRITEBACK_BATCH];
+	struct buffer_head *bh;
 	int written = 0;
+	int nr, i, count = 0;
 
-restart:
-	next = *list;
-	if (!next)
-		return 0;
-	for (;;) {
-		if (!next)
-			die("sync_buffers: buffer list is corrupted");
+	if (to_write > BUFFER_WRITEBACK_BATCH)
+		to_write = BUFFER_WRITEBACK_BATCH;
 
-		if (next->b_dev == dev && buffer_dirty(next)
-		    && buffer_uptodate(next)) {
-			if ((to_write == 0 || next->b_count == 0)
-			    && !buffer_do_not_flush(next)) {
-				bwrite(next);
-			}
-		}
+	/* every buffer is looked at once at most: ones which can not be
+	   written now are moved to the end of the list */
+	nr = pool->nr_on_list[BUF_DIRTY];
+	while (nr-- && count < to_write) {
+		bh = pool->lists[BUF_DIRTY];
 
-		/* if this buffer is reusable, put it onto the end of the free list */
-		if (next->b_count == 0 && buffer_clean(next)) {
-			remove_from_hash_queue(next);
-			remove_from_buffer_list(list, next);
-			put_buffer_list_end(&g_free_buffers, next);
-			written++;
-			if (written == to_write)
-				return written;
-			goto restart;
+		if (bh->b_count != 0) {
+			__refile_buffer(pool, bh, BUF_PINNED, 0);
+			continue;
 		}
-		if (to_write && written >= to_write)
-			return written;
 
-		next = next->b_next;
-		if (next == *list)
-			break;
+		if (buffer_to_be_written(bh))
+			bhs[count++] = bh;
+		__refile_buffer(pool, bh, BUF_DIRTY, 0);
+	}
+
+	write_buffers(bhs, count);
+
+	for (i = 0; i < count; i++) {
+		if (bhs[i]->b_list != BUF_DIRTY || !buffer_clean(bhs[i]))
+			continue;
+		/* it is one of the least recently used ones */
+		__refile_buffer(pool, bhs[i], unused_buffer_list(bhs[i]), 1);
+		written++;
 	}
 
 	return written;
 }
 
+/* collect dirty buffers of the device into @bhs */
+static int collect_dirty_buffers(struct buffer_pool *pool, unsigned int list,
+				 int dev, struct buffer_head **bhs)
+{
+	struct buffer_head *bh = pool->lists[list];
+	int nr = pool->nr_on_list[list];
+	int count = 0;
+
+	while (nr--) {
+		if (bh->b_dev == dev && buffer_to_be_written(bh))
+			bhs[count++] = bh;
+		bh = bh->b_next;
+	}
+	return count;
+}
+
+/* unused buffers of the device are dropped from the cache */
+static void drop_clean_buffers(struct buffer_pool *pool, unsigned int list,
+			       int dev)
+{
+	struct buffer_head *bh, *next;
+	int nr;
+
+	nr = pool->nr_on_list[list];
+	next = pool->lists[list];
+	while (nr--) {
+		bh = next;
+		next = bh->b_next;
+
+		if (bh->b_dev == dev && bh->b_count == 0 && buffer_clean(bh))
+			__refile_buffer(pool, bh, BUF_FREE, 0);
+	}
+}
+
+/* write all dirty buffers of the device, used or not, in the order of block
+   numbers. Unused buffers of the device are dropped from the cache */
 void flush_buffers(int dev)
 {
+	struct buffer_pool *pool;
+	struct buffer_head **bhs;
+	int count;
+
 	if (dev == -1)
 		die("flush_buffers: device is not specified");
 
-	sync_buffers(&Buffer_list_head, dev, 0 /*all */ );
-	buffer_soft_limit = BUFFER_SOFT_LIMIT;
+	for (pool = g_buffer_pools; pool; pool = pool->next) {
+		if (pool->nr_on_list[BUF_CLEAN] + pool->nr_on_list[BUF_HOT] +
+		    pool->nr_on_list[BUF_DIRTY] +
+		    pool->nr_on_list[BUF_PINNED] == 0)
+			continue;
+
+		bhs = getmem((pool->nr_on_list[BUF_CLEAN] +
+			      pool->nr_on_list[BUF_HOT] +
+			      pool->nr_on_list[BUF_DIRTY] +
+			      pool->nr_on_list[BUF_PINNED]) *
+			     sizeof(struct buffer_head *));
+		count = collect_dirty_buffers(pool, BUF_DIRTY, dev, bhs);
+		count += collect_dirty_buffers(pool, BUF_CLEAN, dev,
+					       bhs + count);
+		count += collect_dirty_buffers(pool, BUF_HOT, dev,
+					       bhs + count);
+		count += collect_dirty_buffers(pool, BUF_PINNED, dev,
+					       bhs + count);
+		write_buffers(bhs, count);
+		freemem(bhs);
+
+		drop_clean_buffers(pool, BUF_DIRTY, dev);
+		drop_clean_buffers(pool, BUF_CLEAN, dev);
+		drop_clean_buffers(pool, BUF_HOT, dev);
+		drop_clean_buffers(pool, BUF_PINNED, dev);
+	}
+	buffer_soft_limit = buffer_soft_limit_start;
 }
 
 struct buffer_head *getblk(int dev, unsigned long block, int size)
 {
+	struct buffer_pool *pool;
 	struct buffer_head *bh;
 
 	bh = find_buffer(dev, block, size);
 	if (bh) {
-		/* move the buffer to the end of list */
-
 		/*checkmem (bh->b_data, bh->b_size); */
 
-		remove_from_buffer_list(&Buffer_list_head, bh);
-		put_buffer_list_end(&Buffer_list_head, bh);
+		if (bh->b_list != BUF_PINNED)
+			refile_buffer(bh, BUF_PINNED, 0);
 		bh->b_count++;
 		buffer_hits++;
 		return bh;
 	}
 	buffer_misses++;
 
-	bh = get_free_buffer(&g_free_buffers, size);
+	pool = get_buffer_pool(size);
+	get_buffer_cache_size();
+
+	/* until the soft limit is reached new buffers are preferred to reusing
+	   of cached ones */
+	bh = get_free_buffer(pool, buffers_memory >= buffer_soft_limit);
 	if (bh == NULL) {
 		if (buffers_memory >= buffer_soft_limit) {
-			if (sync_buffers(&Buffer_list_head, dev, 32) == 0) {
-				grow_buffers(size);
+			if (sync_buffers(pool, BUFFER_WRITEBACK_BATCH) == 0) {
+				/* nothing to reuse, every buffer is in use */
+				if (buffers_memory >= get_buffer_cache_size() &&
+				    !buffer_memory_limit_warned) {
+					fprintf(stderr, "getblk: buffer cache "
+						"limit (%lu KB) exceeded, all "
+						"buffers are in use\n",
+						get_buffer_cache_size() / 1024);
+					buffer_memory_limit_warned = 1;
+				}
+				grow_buffers(pool);
 				buffer_soft_limit = buffers_memory +
 				    GROW_BUFFERS__NEW_BUFERS_PER_CALL * size;
+				if (buffer_soft_limit > get_buffer_cache_size())
+					buffer_soft_limit =
+					    get_buffer_cache_size();
 			}
 		} else {
-			if (grow_buffers(size) == 0)
-				sync_buffers(&Buffer_list_head, dev, 32);
+			if (grow_buffers(pool) == 0)
+				sync_buffers(pool, BUFFER_WRITEBACK_BATCH);
 		}
 
-		bh = get_free_buffer(&g_free_buffers, size);
+		bh = get_free_buffer(pool, 1);
 		if (bh == NULL) {
 			show_buffers(dev, size);
 			die("getblk: no free buffers after grow_buffers "
@@ -423,6 +844,8 @@ struct buffer_head *getblk(int dev, unsigned long block, int size)
 		}
 	}
 
+	remove_from_hash_queue(bh);
+
 	bh->b_count = 1;
 	bh->b_dev = dev;
 	bh->b_size = size;
@@ -431,92 +854,743 @@ struct buffer_head *getblk(int dev, unsigned long block, int size)
 	memset(bh->b_data, 0, size);
 	misc_clear_bit(BH_Dirty, &bh->b_state);
 	misc_clear_bit(BH_Uptodate, &bh->b_state);
+	clear_buffer_hot(bh);
+	if (forget_ghost(dev, block, size)) {
+		/* it was used not so long ago */
+		mark_buffer_hot(bh);
+		ghost_hits++;
+	}
+
+	insert_into_hash_queue(bh);
+	/*checkmem (bh->b_data, bh->b_size); */
+
+	return bh;
+}
+
+void brelse(struct buffer_head *bh)
+{
+	if (!bh)
+		return;
+
+	if (bh->b_count == 0)
+		die("brelse: can not free a free buffer %lu", bh->b_blocknr);
+
+	/*checkmem (bh->b_data, get_mem_size (bh->b_data)); */
+
+	bh->b_count--;
+	if (bh->b_count == 0)
+		refile_buffer(bh, unused_buffer_list(bh), 0);
+}
+
+void bforget(struct buffer_head *bh)
+{
+	if (bh) {
+		bh->b_state = 0;
+		remove_from_hash_queue(bh);
+		brelse(bh);
+		if (bh->b_count == 0)
+			/* reuse it first */
+			refile_buffer(bh, BUF_FREE, 1);
+	}
+}
+
+/* Blocks of some devices are not read from their descriptors, they are made
+   by a function instead, like blocks of a packed metadata image opened as a
+   device (see reiserfs_open_packed). Such devices are read-only, writing to
+   them is an error */
+struct device_reader {
+	int dev;
+	device_reader_t read;
+	void *data;
+	struct device_reader *next;
+};
+
+static struct device_reader *device_readers;
+
+static struct device_reader *find_device_reader(int dev)
+{
+	struct device_reader *reader;
+
+	for (reader = device_readers; reader; reader = reader->next)
+		if (reader->dev == dev)
+			return reader;
+	return NULL;
+}
+
+/* make blocks of @dev with @read, NULL @read makes @dev ordinary again */
+void set_device_reader(int dev, device_reader_t read, void *data)
+{
+	struct device_reader **p, *reader;
+
+	for (p = &device_readers; *p; p = &(*p)->next)
+		if ((*p)->dev == dev)
+			break;
+
+	if (!read) {
+		if ((reader = *p) != NULL) {
+			*p = reader->next;
+			freemem(reader);
+		}
+		return;
+	}
+
+	if (!*p) {
+		*p = getmem(sizeof(struct device_reader));
+		(*p)->dev = dev;
+	}
+	(*p)->read = read;
+	(*p)->data = data;
+}
+
+void *get_device_reader_data(int dev)
+{
+	struct device_reader *reader = find_device_reader(dev);
+
+	return reader ? reader->data : NULL;
+}
+
+static int f_read(struct buffer_head *bh)
+{
+	struct device_reader *reader;
+	unsigned long long offset;
+	ssize_t bytes;
+
+	buffer_reads++;
+
+	offset = (unsigned long long)bh->b_size * bh->b_blocknr;
+	if ((reader = find_device_reader(bh->b_dev)) != NULL)
+		return reader->read(reader->data, offset, bh->b_data,
+				    bh->b_size) ? -1 : 0;
+
+	if (lseek(bh->b_dev, offset, SEEK_SET) < 0)
+		return -1;
+
+	bytes = read(bh->b_dev, bh->b_data, bh->b_size);
+
+	return bytes < 0 ? -1 : (bytes != (ssize_t) bh->b_size ? 1 : 0);
+}
+
+struct buffer_head *bread(int dev, unsigned long block, size_t size)
+{
+	struct buffer_head *bh;
+	int ret;
+
+	if (is_bad_block(block))
+		return NULL;
+
+	bh = getblk(dev, block, size);
+
+	/*checkmem (bh->b_data, get_mem_size(bh->b_data)); */
+
+	if (buffer_uptodate(bh))
+		return bh;
+
+	ret = f_read(bh);
+
+	if (ret > 0) {
+		die("%s: End of file, cannot read the block (%lu).\n",
+		    __FUNCTION__, block);
+	} else if (ret < 0) {
+		/* BAD BLOCK LIST SUPPORT
+		 * die ("%s: Cannot read a block # %lu. Specify list of badblocks\n",*/
+
+		if (errno == EIO) {
+			check_hd_msg();
+			die("%s: Cannot read the block (%lu): (%s).\n",
+			    __FUNCTION__, block, strerror(errno));
+		} else {
+			fprintf(stderr,
+				"%s: Cannot read the block (%lu): (%s).\n",
+				__FUNCTION__, block, strerror(errno));
+			return NULL;
+		}
+	}
+
+	mark_buffer_uptodate(bh, 0);
+	return bh;
+}
+
+/* Read-ahead for scans which go through a set of blocks in increasing order
+   (passes of reiserfsck, packing, scanning). The caller still decides which
+   blocks to read, @next only predicts them:
+
+	next(data, from) - the smallest block >= @from the caller is going to
+			   read, or READAHEAD_END
+
+   Predicted blocks up to @window ahead of the one being read are advised to
+   the kernel (neighbouring ones by one request), so the device works while
+   the caller is busy with the current block. When a predicted block is
+   requested, it and the predicted blocks following it contiguously are read
+   into the buffer cache by one system call. Blocks are returned in the order
+   they are asked for, a prediction which turned out wrong costs one extra
+   read and nothing else. */
+
+/* max number of blocks read into the buffer cache at once */
+#define READAHEAD_MAX_RUN 32
+
+/* two advised extents are merged if there are not more blocks between them */
+#define READAHEAD_MAX_GAP 8
+
+struct readahead {
+	int dev;
+	unsigned long size;
+	unsigned long (*next) (void *data, unsigned long from);
+	void *data;
+
+	/* ring of predicted blocks which were advised and not requested yet */
+	unsigned long *blocks;
+	unsigned int window;
+	unsigned int first;
+	unsigned int nr;
+
+	/* where to continue the prediction from */
+	unsigned long from;
+};
+
+struct readahead *readahead_init(int dev, unsigned long size,
+				 unsigned long (*next) (void *, unsigned long),
+				 void *data, unsigned int window)
+{
+	struct readahead *ra;
+
+	if (!window)
+		window = READAHEAD_WINDOW;
+
+	ra = getmem(sizeof(struct readahead));
+	ra->blocks = getmem(window * sizeof(unsigned long));
+	ra->dev = dev;
+	ra->size = size;
+	ra->next = next;
+	ra->data = data;
+	ra->window = window;
+	return ra;
+}
+
+void readahead_done(struct readahead *ra)
+{
+	if (!ra)
+		return;
+	freemem(ra->blocks);
+	freemem(ra);
+}
+
+static void readahead_advise(struct readahead *ra, unsigned long start,
+			     unsigned long count)
+{
+#ifdef HAVE_POSIX_FADVISE
+	posix_fadvise(ra->dev, (loff_t) start * ra->size,
+		      (loff_t) count * ra->size, POSIX_FADV_WILLNEED);
+#endif
+}
+
+/* predict blocks until the ring is full and advise them */
+static void readahead_fill(struct readahead *ra)
+{
+	unsigned long block, start = 0, count = 0;
+
+	while (ra->nr < ra->window && ra->from != READAHEAD_END) {
+		block = ra->next(ra->data, ra->from);
+		if (block == READAHEAD_END) {
+			ra->from = READAHEAD_END;
+			break;
+		}
+		ra->blocks[(ra->first + ra->nr) % ra->window] = block;
+		ra->nr++;
+		ra->from = block + 1;
+
+		if (count && block <= start + count + READAHEAD_MAX_GAP) {
+			count = block - start + 1;
+			continue;
+		}
+		if (count)
+			readahead_advise(ra, start, count);
+		start = block;
+		count = 1;
+	}
+
+	if (count)
+		readahead_advise(ra, start, count);
+}
+
+/* read the first predicted block and predicted blocks following it
+   contiguously into the buffer cache */
+static void readahead_read_run(struct readahead *ra)
+{
+#ifdef HAVE_PREADV
+	struct buffer_head *bh[READAHEAD_MAX_RUN];
+	struct iovec iov[READAHEAD_MAX_RUN];
+	unsigned long block;
+	unsigned int i, nr;
+	ssize_t bytes;
+
+	if (find_device_reader(ra->dev))
+		return;
+
+	block = ra->blocks[ra->first];
+	for (nr = 0; nr < READAHEAD_MAX_RUN && nr < ra->nr; nr++) {
+		if (ra->blocks[(ra->first + nr) % ra->window] != block + nr ||
+		    is_bad_block(block + nr) ||
+		    find_buffer(ra->dev, block + nr, ra->size))
+			break;
+	}
+
+	/* single blocks are left to bread */
+	if (nr < 2)
+		return;
+
+	for (i = 0; i < nr; i++) {
+		bh[i] = getblk(ra->dev, block + i, ra->size);
+		iov[i].iov_base = bh[i]->b_data;
+		iov[i].iov_len = ra->size;
+	}
+
+	bytes = preadv(ra->dev, iov, nr, (loff_t) block * ra->size);
+
+	for (i = 0; i < nr; i++) {
+		/* blocks which failed to be read will be read again by bread,
+		   which will complain properly */
+		if (bytes >= (ssize_t) ((i + 1) * ra->size)) {
+			mark_buffer_uptodate(bh[i], 0);
+			buffer_reads++;
+			buffer_readaheads++;
+		}
+		brelse(bh[i]);
+	}
+#endif
+}
+
+/* bread the block of the scan @ra */
+struct buffer_head *readahead_bread(struct readahead *ra, unsigned long block)
+{
+	/* forget blocks the caller has decided not to read */
+	while (ra->nr && ra->blocks[ra->first] < block) {
+		ra->first = (ra->first + 1) % ra->window;
+		ra->nr--;
+	}
+
+	if (ra->from != READAHEAD_END && ra->from <= block)
+		ra->from = block + 1;
+
+	/* predict blocks by portions, not one by one */
+	if (ra->nr <= ra->window / 2)
+		readahead_fill(ra);
+
+	if (ra->nr && ra->blocks[ra->first] == block) {
+		if (!find_buffer(ra->dev, block, ra->size))
+			readahead_read_run(ra);
+		ra->first = (ra->first + 1) % ra->window;
+		ra->nr--;
+	}
+
+	return bread(ra->dev, block, ra->size);
+}
+
+static int block_compare(const void *p1, const void *p2)
+{
+	unsigned long b1 = *(const unsigned long *)p1;
+	unsigned long b2 = *(const unsigned long *)p2;
+
+	return b1 < b2 ? -1 : b1 > b2;
+}
+
+/* ask the kernel to start reading @blocks, which are going to be bread
+   soon, so that their reads are in flight at the same time. @blocks get
+   sorted, blocks close to each other are advised together */
+void prefetch_blocks(int dev, unsigned long size, unsigned long *blocks,
+		     unsigned int nr)
+{
+#ifdef HAVE_POSIX_FADVISE
+	unsigned long start = 0, count = 0;
+	struct buffer_head *bh;
+	unsigned int i;
+
+	qsort(blocks, nr, sizeof(unsigned long), block_compare);
+
+	for (i = 0; i < nr; i++) {
+		if (is_bad_block(blocks[i]))
+			continue;
+		bh = find_buffer(dev, blocks[i], size);
+		if (bh && buffer_uptodate(bh))
+			continue;
+
+		if (count && blocks[i] <= start + count + READAHEAD_MAX_GAP) {
+			count = blocks[i] - start + 1;
+			continue;
+		}
+		if (count)
+			posix_fadvise(dev, (loff_t) start * size,
+				      (loff_t) count * size,
+				      POSIX_FADV_WILLNEED);
+		start = blocks[i];
+		count = 1;
+	}
+
+	if (count)
+		posix_fadvise(dev, (loff_t) start * size, (loff_t) count * size,
+			      POSIX_FADV_WILLNEED);
+#endif
+}
+
+/* Parallel scan of a set of blocks. It is like read-ahead above, but blocks
+   are read by worker threads into memory of the scan and @classify is called
+   on their contents there:
+
+	classify(buf, size) - non-negative number telling what the block is
+
+   The caller asks for blocks in increasing order, gets what @classify said
+   about every one of them and takes into the buffer cache only blocks it is
+   interested in. Workers do not touch anything but the scan, everything
+   which changes state of the program is done by the caller in the order of
+   blocks, so results do not depend on the number of threads. With a single
+   processor there are no workers, blocks are read with read-ahead. */
+
+#define BLOCK_SCAN_MAX_THREADS 8
+#define BLOCK_SCAN_SLOTS_PER_THREAD 32
+
+/* workers read contiguous predicted blocks by runs of up to this size */
+#define BLOCK_SCAN_MAX_RUN 16
+
+#define SLOT_QUEUED 0
+#define SLOT_DONE 1
+
+struct block_scan_slot {
+	unsigned long block;
+	int state;
+	int result;		/* of classify or BLOCK_SCAN_ERROR */
+	char *data;
+};
+
+struct block_scan {
+	int dev;
+	unsigned long size;
+	unsigned long (*next) (void *data, unsigned long from);
+	void *data;
+	int (*classify) (const char *buf, int size);
+
+	/* ring of predicted blocks: [head, taken) are being read or read
+	   already, [taken, queued) wait for a worker */
+	struct block_scan_slot *slots;
+	unsigned int nr_slots;
+	unsigned long head;
+	unsigned long taken;
+	unsigned long queued;
+	unsigned long from;	/* where to continue the prediction from */
+
+	/* what the last block_scan_class was about */
+	struct block_scan_slot *last;
+	struct block_scan_slot own;	/* block which was not predicted */
+	int cached;		/* block was in the buffer cache */
+
+	/* with no workers the scan is a read-ahead into the buffer cache */
+	struct readahead *ra;
+	struct buffer_head *bh;	/* the last block got from @ra */
+
+#ifdef HAVE_PTHREAD
+	pthread_t threads[BLOCK_SCAN_MAX_THREADS];
+	unsigned int nr_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	int stop;
+#endif
+};
 
-	put_buffer_list_end(&Buffer_list_head, bh);
-	insert_into_hash_queue(bh);
-	/*checkmem (bh->b_data, bh->b_size); */
+static int block_scan_read(struct block_scan *scan, unsigned long block,
+			   char *buf)
+{
+	struct device_reader *reader;
 
-	return bh;
+	if (is_bad_block(block))
+		return BLOCK_SCAN_ERROR;
+
+	if ((reader = find_device_reader(scan->dev)) != NULL) {
+		if (reader->read(reader->data, (loff_t) block * scan->size,
+				 buf, scan->size))
+			return BLOCK_SCAN_ERROR;
+	} else if (pread(scan->dev, buf, scan->size,
+			 (loff_t) block * scan->size) != (ssize_t) scan->size)
+		return BLOCK_SCAN_ERROR;
+
+	return scan->classify(buf, scan->size);
 }
 
-void brelse(struct buffer_head *bh)
+#ifdef HAVE_PTHREAD
+/* read blocks of contiguous slots at once */
+static void block_scan_read_run(struct block_scan *scan,
+				struct block_scan_slot **run, unsigned int nr)
 {
-	if (!bh)
+#ifdef HAVE_PREADV
+	struct iovec iov[BLOCK_SCAN_MAX_RUN];
+	unsigned int i;
+	ssize_t bytes;
+
+	if (nr > 1) {
+		for (i = 0; i < nr; i++) {
+			iov[i].iov_base = run[i]->data;
+			iov[i].iov_len = scan->size;
+		}
+		bytes = preadv(scan->dev, iov, nr,
+			       (loff_t) run[0]->block * scan->size);
+
+		for (i = 0; i < nr; i++) {
+			if (bytes >= (ssize_t) ((i + 1) * scan->size))
+				run[i]->result = scan->classify(run[i]->data,
+								scan->size);
+			else
+				/* try it alone */
+				run[i]->result = block_scan_read(scan,
+								 run[i]->block,
+								 run[i]->data);
+		}
 		return;
+	}
+#endif
+	run[0]->result = block_scan_read(scan, run[0]->block, run[0]->data);
+}
 
-	if (bh->b_count == 0)
-		die("brelse: can not free a free buffer %lu", bh->b_blocknr);
+static void *block_scan_worker(void *arg)
+{
+	struct block_scan *scan = arg;
+	struct block_scan_slot *run[BLOCK_SCAN_MAX_RUN], *slot;
+	unsigned int i, nr;
 
-	/*checkmem (bh->b_data, get_mem_size (bh->b_data)); */
+	pthread_mutex_lock(&scan->lock);
+	while (1) {
+		while (!scan->stop && scan->taken == scan->queued)
+			pthread_cond_wait(&scan->work, &scan->lock);
+		if (scan->stop)
+			break;
 
-	bh->b_count--;
+		/* take the first waiting slot and slots of blocks following it */
+		nr = 0;
+		do {
+			slot = &scan->slots[scan->taken % scan->nr_slots];
+			if (nr && (slot->block != run[nr - 1]->block + 1 ||
+				   is_bad_block(slot->block)))
+				break;
+			run[nr++] = slot;
+			scan->taken++;
+		} while (nr < BLOCK_SCAN_MAX_RUN && scan->taken < scan->queued);
+		pthread_mutex_unlock(&scan->lock);
+
+		block_scan_read_run(scan, run, nr);
+
+		pthread_mutex_lock(&scan->lock);
+		for (i = 0; i < nr; i++)
+			run[i]->state = SLOT_DONE;
+		pthread_cond_broadcast(&scan->done);
+	}
+	pthread_mutex_unlock(&scan->lock);
+	return NULL;
 }
 
-void bforget(struct buffer_head *bh)
+/* predict blocks until the ring is full, called with the lock held */
+static void block_scan_fill(struct block_scan *scan)
 {
-	if (bh) {
-		bh->b_state = 0;
-		brelse(bh);
-		remove_from_hash_queue(bh);
-		remove_from_buffer_list(&Buffer_list_head, bh);
-		put_buffer_list_head(&Buffer_list_head, bh);
+	struct block_scan_slot *slot;
+	unsigned long block;
+
+	while (scan->queued - scan->head < scan->nr_slots &&
+	       scan->from != READAHEAD_END) {
+		block = scan->next(scan->data, scan->from);
+		if (block == READAHEAD_END) {
+			scan->from = READAHEAD_END;
+			break;
+		}
+		slot = &scan->slots[scan->queued % scan->nr_slots];
+		slot->block = block;
+		slot->state = SLOT_QUEUED;
+		scan->queued++;
+		scan->from = block + 1;
 	}
+	pthread_cond_broadcast(&scan->work);
 }
+#endif
 
-/* Returns 0 on success; 1 - end of file; 0 - OK. */
-static int f_read(struct buffer_head *bh)
+/* @threads == 0 means a thread per processor */
+struct block_scan *block_scan_init(int dev, unsigned long size,
+				   unsigned long (*next) (void *,
+							  unsigned long),
+				   void *data,
+				   int (*classify) (const char *, int),
+				   unsigned int threads)
 {
-	unsigned long long offset;
-	ssize_t bytes;
+	struct block_scan *scan;
+#ifdef HAVE_PTHREAD
+	unsigned int i;
+#endif
 
-	buffer_reads++;
+	scan = getmem(sizeof(struct block_scan));
+	scan->dev = dev;
+	scan->size = size;
+	scan->next = next;
+	scan->data = data;
+	scan->classify = classify;
+	scan->own.data = getmem(size);
 
-	offset = (unsigned long long)bh->b_size * bh->b_blocknr;
-	if (lseek(bh->b_dev, offset, SEEK_SET) < 0)
-		return -1;
+#ifdef HAVE_PTHREAD
+	if (!threads) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
 
-	bytes = read(bh->b_dev, bh->b_data, bh->b_size);
+		threads = cpus > 0 ? cpus : 1;
+	}
+	if (threads > BLOCK_SCAN_MAX_THREADS)
+		threads = BLOCK_SCAN_MAX_THREADS;
+	/* device readers are not for worker threads */
+	if (find_device_reader(dev))
+		threads = 1;
+
+	scan->nr_slots = threads * BLOCK_SCAN_SLOTS_PER_THREAD;
+	scan->slots = getmem(scan->nr_slots * sizeof(struct block_scan_slot));
+	scan->slots[0].data = getmem(scan->nr_slots * size);
+	for (i = 1; i < scan->nr_slots; i++)
+		scan->slots[i].data = scan->slots[0].data + i * size;
+
+	pthread_mutex_init(&scan->lock, NULL);
+	pthread_cond_init(&scan->work, NULL);
+	pthread_cond_init(&scan->done, NULL);
+	/* a single processor is better used without switching to a worker
+	   for every block */
+	while (threads > 1 && scan->nr_threads < threads) {
+		if (pthread_create(&scan->threads[scan->nr_threads], NULL,
+				   block_scan_worker, scan))
+			break;
+		scan->nr_threads++;
+	}
+	if (!scan->nr_threads)
+#endif
+		scan->ra = readahead_init(dev, size, next, data, 0);
+	return scan;
+}
 
-	return bytes < 0 ? -1 : (bytes != (ssize_t) bh->b_size ? 1 : 0);
+void block_scan_done(struct block_scan *scan)
+{
+	if (!scan)
+		return;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&scan->lock);
+	scan->stop = 1;
+	pthread_cond_broadcast(&scan->work);
+	pthread_mutex_unlock(&scan->lock);
+	while (scan->nr_threads)
+		pthread_join(scan->threads[--scan->nr_threads], NULL);
+	pthread_cond_destroy(&scan->done);
+	pthread_cond_destroy(&scan->work);
+	pthread_mutex_destroy(&scan->lock);
+	freemem(scan->slots[0].data);
+	freemem(scan->slots);
+#endif
+	if (scan->ra) {
+		brelse(scan->bh);
+		readahead_done(scan->ra);
+	}
+	freemem(scan->own.data);
+	freemem(scan);
 }
 
-struct buffer_head *bread(int dev, unsigned long block, size_t size)
+/* what @classify says about @block, BLOCK_SCAN_ERROR if it could not be
+   read. Blocks are to be asked for in increasing order */
+int block_scan_class(struct block_scan *scan, unsigned long block)
 {
 	struct buffer_head *bh;
-	int ret;
 
-	if (is_bad_block(block))
-		return NULL;
+	scan->last = NULL;
+	scan->cached = 0;
+
+	if (scan->ra) {
+		brelse(scan->bh);
+		scan->bh = readahead_bread(scan->ra, block);
+		if (!scan->bh) {
+			scan->own.block = block;
+			scan->own.result = BLOCK_SCAN_ERROR;
+			scan->last = &scan->own;
+			return BLOCK_SCAN_ERROR;
+		}
+		return scan->classify(scan->bh->b_data, scan->size);
+	}
 
-	bh = getblk(dev, block, size);
+#ifdef HAVE_PTHREAD
+	if (scan->nr_threads) {
+		struct block_scan_slot *slot;
+
+		pthread_mutex_lock(&scan->lock);
+		/* forget blocks the caller has got or decided not to read,
+		   their slots are reused only when workers are done with
+		   them */
+		while (scan->head < scan->taken) {
+			slot = &scan->slots[scan->head % scan->nr_slots];
+			if (slot->block >= block)
+				break;
+			while (slot->state != SLOT_DONE)
+				pthread_cond_wait(&scan->done, &scan->lock);
+			scan->head++;
+		}
+		while (scan->head < scan->queued &&
+		       scan->slots[scan->head % scan->nr_slots].block < block) {
+			/* not taken by workers yet, take it back */
+			scan->head++;
+			if (scan->taken < scan->head)
+				scan->taken = scan->head;
+		}
+		if (scan->from != READAHEAD_END && scan->from <= block)
+			scan->from = block + 1;
+		block_scan_fill(scan);
+
+		slot = &scan->slots[scan->head % scan->nr_slots];
+		if (scan->head < scan->queued && slot->block == block) {
+			while (slot->state != SLOT_DONE)
+				pthread_cond_wait(&scan->done, &scan->lock);
+			/* the slot is freed by the next call */
+			scan->last = slot;
+		}
+		pthread_mutex_unlock(&scan->lock);
+	}
+#endif
 
-	/*checkmem (bh->b_data, get_mem_size(bh->b_data)); */
+	/* the buffer cache may have a block newer than the disk */
+	bh = find_buffer(scan->dev, block, scan->size);
+	if (bh && buffer_uptodate(bh)) {
+		scan->cached = 1;
+		return scan->classify(bh->b_data, scan->size);
+	}
 
-	if (buffer_uptodate(bh))
+	if (!scan->last) {
+		scan->own.block = block;
+		scan->own.result = block_scan_read(scan, block, scan->own.data);
+		scan->last = &scan->own;
+	}
+	if (scan->last->result != BLOCK_SCAN_ERROR)
+		buffer_reads++;
+	return scan->last->result;
+}
+
+/* buffer of the block block_scan_class was called for last time, NULL if
+   it could not be read */
+struct buffer_head *block_scan_bread(struct block_scan *scan,
+				     unsigned long block)
+{
+	struct buffer_head *bh;
+
+	if (scan->bh && scan->bh->b_blocknr == block) {
+		bh = scan->bh;
+		scan->bh = NULL;
 		return bh;
+	}
 
-	ret = f_read(bh);
+	if (scan->last && scan->last->block == block &&
+	    scan->last->result == BLOCK_SCAN_ERROR)
+		/* the caller has been told already */
+		return NULL;
 
-	if (ret > 0) {
-		die("%s: End of file, cannot read the block (%lu).\n",
-		    __FUNCTION__, block);
-	} else if (ret < 0) {
-		/* BAD BLOCK LIST SUPPORT
-		 * die ("%s: Cannot read a block # %lu. Specify list of badblocks\n",*/
+	if (scan->cached || !scan->last || scan->last->block != block)
+		return bread(scan->dev, block, scan->size);
 
-		if (errno == EIO) {
-			check_hd_msg();
-			die("%s: Cannot read the block (%lu): (%s).\n",
-			    __FUNCTION__, block, strerror(errno));
-		} else {
-			fprintf(stderr,
-				"%s: Cannot read the block (%lu): (%s).\n",
-				__FUNCTION__, block, strerror(errno));
-			return NULL;
-		}
+	bh = getblk(scan->dev, block, scan->size);
+	if (!buffer_uptodate(bh)) {
+		memcpy(bh->b_data, scan->last->data, scan->size);
+		mark_buffer_uptodate(bh, 0);
 	}
-
-	mark_buffer_uptodate(bh, 0);
 	return bh;
 }
 
@@ -800,12 +1874,72 @@ static void rollback__mark_block_saved (struct block_handler * rb_e) {
 //    printf(" OK");
 }
 */
-/* for now - just make sure that bad blocks did not get here */
-int bwrite(struct buffer_head *bh)
+/* save the block contents which are about to be overwritten into the rollback
+   file */
+static void rollback_save_block(struct buffer_head *bh)
 {
 	unsigned long long offset;
-	long long bytes, size;
+	struct stat buf;
+	__u32 position;
+	struct block_handler block_h;
+
+	if (s_rollback_file == NULL)
+		return;
+
+	if (bh->b_size != (unsigned long)rollback_blocksize) {
+		fprintf(stderr,
+			"rollback: block (%lu) has the size different from "
+			"the fs uses, block skipped\n", bh->b_blocknr);
+		return;
+	}
+
+	if (fstat(bh->b_dev, &buf)) {
+		fprintf(stderr,
+			"bwrite: fstat of (%d) returned -1: %s\n",
+			bh->b_dev, strerror(errno));
+		return;
+	}
+
+	block_h.blocknr = bh->b_blocknr;
+	block_h.device = buf.st_rdev;
+	if (reiserfs_bin_search(&block_h, rollback_blocks_array,
+				rollback_blocks_number, sizeof(block_h),
+				&position, blockdev_list_compare)
+	    == POSITION_FOUND)
+		return;
+
+	/*read initial data from the disk */
+	offset = (loff_t) bh->b_size * (loff_t) bh->b_blocknr;
+	if (pread(bh->b_dev, rollback_data, bh->b_size, offset)
+	    != (long long)bh->b_size) {
+		fprintf(stderr,
+			"bwrite: read (block=%lu, dev=%d): %s\n",
+			bh->b_blocknr, bh->b_dev, strerror(errno));
+		exit(8);
+	}
+
+	fwrite(&buf.st_rdev, sizeof(buf.st_rdev), 1, s_rollback_file);
+	fwrite(&offset, sizeof(offset), 1, s_rollback_file);
+	fwrite(rollback_data, rollback_blocksize, 1, s_rollback_file);
+	fflush(s_rollback_file);
+	blocklist__insert_in_position(&block_h,
+				      (void *)(&rollback_blocks_array),
+				      &rollback_blocks_number,
+				      sizeof(block_h), &position);
+
+	/*if you want to know what gets saved, uncomment it */
+/*    if (log_file != 0 && log_file != stdout) {
+	fprintf (log_file, "rollback: block %lu of device %Lu was "
+		"backed up\n", bh->b_blocknr, buf.st_rdev);
+    }
+*/
+}
 
+/* everything what is to be done before the buffer contents go to disk.
+   Returns 0 if the buffer does not have to be written */
+static int start_buffer_write(struct buffer_head *bh)
+{
+	/* for now - just make sure that bad blocks did not get here */
 	if (is_bad_block(bh->b_blocknr)) {
 		fprintf(stderr,
 			"bwrite: bad block is going to be written: %lu\n",
@@ -816,11 +1950,35 @@ int bwrite(struct buffer_head *bh)
 	if (!buffer_dirty(bh) || !buffer_uptodate(bh))
 		return 0;
 
+	if (find_device_reader(bh->b_dev)) {
+		fprintf(stderr, "bwrite: block=%lu, dev=%d: %s\n",
+			bh->b_blocknr, bh->b_dev, strerror(EROFS));
+		exit(8);	/* File system errors left uncorrected */
+	}
+
 	buffer_writes++;
 	if (bh->b_start_io)
 		/* this is used by undo feature of reiserfsck */
 		bh->b_start_io(bh->b_blocknr);
 
+	rollback_save_block(bh);
+	return 1;
+}
+
+static void end_buffer_write(struct buffer_head *bh)
+{
+	mark_buffer_clean(bh);
+
+	if (bh->b_end_io) {
+		bh->b_end_io(bh, 1);
+	}
+}
+
+static void write_buffer_data(struct buffer_head *bh)
+{
+	unsigned long long offset;
+	long long bytes, size;
+
 	size = bh->b_size;
 	offset = (loff_t) size *(loff_t) bh->b_blocknr;
 
@@ -831,78 +1989,6 @@ int bwrite(struct buffer_head *bh)
 		exit(8);	/* File system errors left uncorrected */
 	}
 
-	if (s_rollback_file != NULL
-	    && bh->b_size == (unsigned long)rollback_blocksize) {
-		struct stat buf;
-		__u32 position;
-		struct block_handler block_h;
-
-		/*log previous content into the log */
-		if (!fstat(bh->b_dev, &buf)) {
-			block_h.blocknr = bh->b_blocknr;
-			block_h.device = buf.st_rdev;
-			if (reiserfs_bin_search(&block_h, rollback_blocks_array,
-						rollback_blocks_number,
-						sizeof(block_h), &position,
-						blockdev_list_compare)
-			    != POSITION_FOUND) {
-				/*read initial data from the disk */
-				if (read(bh->b_dev, rollback_data, bh->b_size)
-				    == (long long)bh->b_size) {
-					fwrite(&buf.st_rdev,
-					       sizeof(buf.st_rdev), 1,
-					       s_rollback_file);
-					fwrite(&offset, sizeof(offset), 1,
-					       s_rollback_file);
-					fwrite(rollback_data,
-					       rollback_blocksize, 1,
-					       s_rollback_file);
-					fflush(s_rollback_file);
-					blocklist__insert_in_position(&block_h,
-								      (void
-								       *)
-								      (&rollback_blocks_array),
-								      &rollback_blocks_number,
-								      sizeof
-								      (block_h),
-								      &position);
-
-					/*if you want to know what gets saved, uncomment it */
-/*                    if (log_file != 0 && log_file != stdout) {
-                        fprintf (log_file, "rollback: block %lu of device %Lu was "
-			    "backed up\n", bh->b_blocknr, buf.st_rdev);
-                    }
-*/
-
-				} else {
-					fprintf(stderr,
-						"bwrite: read (block=%lu, dev=%d): %s\n",
-						bh->b_blocknr, bh->b_dev,
-						strerror(errno));
-					exit(8);
-				}
-
-				if (lseek(bh->b_dev, offset, SEEK_SET) ==
-				    (loff_t) - 1) {
-					fprintf(stderr,
-						"bwrite: lseek to position %llu (block=%lu, "
-						"dev=%d): %s\n", offset,
-						bh->b_blocknr, bh->b_dev,
-						strerror(errno));
-					exit(8);
-				}
-			}
-		} else {
-			fprintf(stderr,
-				"bwrite: fstat of (%d) returned -1: %s\n",
-				bh->b_dev, strerror(errno));
-		}
-	} else if (s_rollback_file != NULL) {
-		fprintf(stderr,
-			"rollback: block (%lu) has the size different from "
-			"the fs uses, block skipped\n", bh->b_blocknr);
-	}
-
 	bytes = write(bh->b_dev, bh->b_data, size);
 	if (bytes != size) {
 		fprintf(stderr,
@@ -911,16 +1997,234 @@ int bwrite(struct buffer_head *bh)
 			strerror(errno));
 		exit(8);
 	}
+}
 
-	mark_buffer_clean(bh);
+int bwrite(struct buffer_head *bh)
+{
+	if (!start_buffer_write(bh))
+		return 0;
 
-	if (bh->b_end_io) {
-		bh->b_end_io(bh, 1);
+	write_buffer_data(bh);
+	end_buffer_write(bh);
+	return 0;
+}
+
+/* write @count buffers sorted by block number, other dirty buffers of their
+   devices stay in the cache. Unused ones are refiled as they became clean */
+void bwrite_buffers(struct buffer_head **bhs, int count)
+{
+	int i;
+
+	write_buffers(bhs, count);
+	for (i = 0; i < count; i++)
+		if (bhs[i]->b_count == 0)
+			refile_buffer(bhs[i], unused_buffer_list(bhs[i]), 0);
+}
+
+#if defined(__linux__) && defined(_IO)
+#  ifndef BLKDISCARD
+#    define BLKDISCARD _IO(0x12, 119)
+#  endif
+#  ifndef BLKZEROOUT
+#    define BLKZEROOUT _IO(0x12, 127)
+#  endif
+#endif
+
+/* size of zeroes written by one system call when the device cannot zero
+   blocks itself */
+#define ZERO_CHUNK_SIZE (1024 * 1024)
+
+static int is_block_device(int dev)
+{
+	struct stat st;
+
+	return !fstat(dev, &st) && S_ISBLK(st.st_mode);
+}
+
+/* ask the device (or the file system the file is on) to zero the range
+   without transferring zeroes */
+static int zero_range(int dev, loff_t offset, loff_t len)
+{
+#ifdef BLKZEROOUT
+	if (is_block_device(dev)) {
+		__u64 range[2] = { offset, len };
+
+		return ioctl(dev, BLKZEROOUT, range);
+	}
+#endif
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_ZERO_RANGE)
+	return fallocate(dev, FALLOC_FL_ZERO_RANGE, offset, len);
+#else
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
+static int write_zeroes(int dev, loff_t offset, loff_t len)
+{
+	char *zeroes;
+	ssize_t bytes;
+
+	zeroes = getmem(ZERO_CHUNK_SIZE);
+	while (len) {
+		bytes = pwrite(dev, zeroes, len < ZERO_CHUNK_SIZE ?
+			       len : ZERO_CHUNK_SIZE, offset);
+		if (bytes <= 0) {
+			if (bytes == 0)
+				errno = EIO;
+			break;
+		}
+		offset += bytes;
+		len -= bytes;
+	}
+	freemem(zeroes);
+	return len ? -1 : 0;
+}
+
+/* zero @count blocks starting from @start on the disk and in the buffer
+   cache. Bad blocks are skipped. Returns 0 on success, -1 and errno
+   otherwise */
+int zero_blocks(int dev, unsigned long start, unsigned long count,
+		unsigned long size)
+{
+	struct buffer_head *bh;
+	unsigned long i, nr;
+	loff_t offset, len;
+
+	if (find_device_reader(dev)) {
+		errno = EROFS;
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		bh = find_buffer(dev, start + i, size);
+		if (bh) {
+			memset(bh->b_data, 0, size);
+			mark_buffer_uptodate(bh, 1);
+			mark_buffer_clean(bh);
+			/* it is not to be kept on the dirty list */
+			if (bh->b_count == 0)
+				refile_buffer(bh, unused_buffer_list(bh), 0);
+		}
+	}
+
+	while (count) {
+		for (nr = 0; nr < count && !is_bad_block(start + nr); nr++) ;
+		if (nr) {
+			offset = (loff_t) start * size;
+			len = (loff_t) nr * size;
+			if (zero_range(dev, offset, len) &&
+			    write_zeroes(dev, offset, len))
+				return -1;
+			buffer_writes += nr;
+		}
+		if (nr < count)
+			/* skip the bad block */
+			nr++;
+		start += nr;
+		count -= nr;
+	}
+	return 0;
+}
+
+/* tell the device that @count blocks starting from @start are unused, their
+   contents become undefined. Returns -1 if the device does not support
+   that */
+int discard_blocks(int dev, unsigned long start, unsigned long count,
+		   unsigned long size)
+{
+	loff_t offset = (loff_t) start * size, len = (loff_t) count * size;
+
+	if (find_device_reader(dev)) {
+		errno = EROFS;
+		return -1;
 	}
 
+#ifdef BLKDISCARD
+	if (is_block_device(dev)) {
+		__u64 range[2] = { offset, len };
+
+		return ioctl(dev, BLKDISCARD, range);
+	}
+#endif
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+	return fallocate(dev, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			 offset, len);
+#else
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
+/* max number of buffers written by one system call */
+#define WRITE_MAX_RUN 64
+
+static int buffer_block_compare(const void *p1, const void *p2)
+{
+	const struct buffer_head *bh1 = *(struct buffer_head * const *)p1;
+	const struct buffer_head *bh2 = *(struct buffer_head * const *)p2;
+
+	if (bh1->b_dev != bh2->b_dev)
+		return bh1->b_dev < bh2->b_dev ? -1 : 1;
+	if (bh1->b_size != bh2->b_size)
+		return bh1->b_size < bh2->b_size ? -1 : 1;
+	if (bh1->b_blocknr != bh2->b_blocknr)
+		return bh1->b_blocknr < bh2->b_blocknr ? -1 : 1;
 	return 0;
 }
 
+/* write @count buffers sorted by block number. Buffers of contiguous blocks
+   are written by one system call */
+static void write_buffers(struct buffer_head **bhs, int count)
+{
+	struct iovec iov[WRITE_MAX_RUN];
+	struct buffer_head *run[WRITE_MAX_RUN];
+	struct buffer_head *bh;
+	long long bytes, size;
+	int i, j, nr;
+
+	qsort(bhs, count, sizeof(struct buffer_head *), buffer_block_compare);
+
+	i = 0;
+	while (i < count) {
+		nr = 0;
+		while (i < count && nr < WRITE_MAX_RUN) {
+			bh = bhs[i];
+			if (nr && (bh->b_dev != run[0]->b_dev ||
+				   bh->b_size != run[0]->b_size ||
+				   bh->b_blocknr != run[0]->b_blocknr + nr))
+				break;
+			i++;
+			if (!start_buffer_write(bh)) {
+				/* it does not have to be written */
+				if (nr)
+					break;
+				continue;
+			}
+			iov[nr].iov_base = bh->b_data;
+			iov[nr].iov_len = bh->b_size;
+			run[nr++] = bh;
+		}
+		if (nr == 0)
+			continue;
+
+		size = (long long)run[0]->b_size * nr;
+#ifdef HAVE_PWRITEV
+		bytes = pwritev(run[0]->b_dev, iov, nr,
+				(loff_t) run[0]->b_size * run[0]->b_blocknr);
+#else
+		bytes = -1;
+#endif
+		for (j = 0; j < nr; j++) {
+			/* if that failed, buffers are written one by one to
+			   complain properly */
+			if (bytes != size)
+				write_buffer_data(run[j]);
+			end_buffer_write(run[j]);
+		}
+	}
+}
+
 static int _check_and_free_buffer_list(struct buffer_head *list)
 {
 	struct buffer_head *next = list;
@@ -954,13 +2258,19 @@ static void check_and_free_buffer_mem(void)
 {
 	int count = 0;
 	struct buffer_head *next;
+	struct buffer_pool *pool;
+	int i;
 
 //    printf("check and free buffer mem, hits %d misses %d reads %d writes %d\n",
 //          buffer_hits, buffer_misses, buffer_reads, buffer_writes) ;
 	/*sync_buffers (0, 0); */
 
-	count = _check_and_free_buffer_list(Buffer_list_head);
-	count += _check_and_free_buffer_list(g_free_buffers);
+	while ((pool = g_buffer_pools)) {
+		for (i = 0; i < NR_BUF_LISTS; i++)
+			count += _check_and_free_buffer_list(pool->lists[i]);
+		g_buffer_pools = pool->next;
+		freemem(pool);
+	}
 
 	if (count != g_nr_buffers)
 		die("check_and_free_buffer_mem: found %d buffers, must be %d",
@@ -973,43 +2283,123 @@ static void check_and_free_buffer_mem(void)
 
 		freemem(next);
 	}
+	g_buffer_heads_last = NULL;
+
+	if (g_a_hash_queues) {
+		freemem(g_a_hash_queues);
+		g_a_hash_queues = NULL;
+		g_nr_hash_queues = 0;
+		g_nr_hashed = 0;
+	}
+
+	if (g_ghosts) {
+		freemem(g_ghosts);
+		freemem(g_ghost_hash);
+		g_ghosts = NULL;
+		g_ghost_hash = NULL;
+		g_nr_ghosts = 0;
+	}
 
 	return;
 }
 
+void get_buffer_cache_stats(struct buffer_cache_stats *stats)
+{
+	struct buffer_pool *pool;
+	struct buffer_head *bh;
+	unsigned long i, len;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->nr_buffers = g_nr_buffers;
+	stats->memory = buffers_memory;
+	stats->memory_limit = buffer_memory_limit;
+	stats->hits = buffer_hits;
+	stats->misses = buffer_misses;
+	stats->reads = buffer_reads;
+	stats->writes = buffer_writes;
+	stats->readaheads = buffer_readaheads;
+	stats->ghost_hits = ghost_hits;
+	for (pool = g_buffer_pools; pool; pool = pool->next)
+		stats->hot += pool->nr_on_list[BUF_HOT];
+
+	stats->hash_queues = g_nr_hash_queues;
+	stats->hashed = g_nr_hashed;
+	stats->lookups = hash_lookups;
+	stats->probes = hash_probes;
+	for (i = 0; i < g_nr_hash_queues; i++) {
+		len = 0;
+		for (bh = g_a_hash_queues[i]; bh; bh = bh->b_hash_next)
+			len++;
+		if (len)
+			stats->used_queues++;
+		if (len > stats->max_chain)
+			stats->max_chain = len;
+	}
+}
+
+void print_buffer_cache_stats(FILE *fp)
+{
+	struct buffer_cache_stats stats;
+
+	get_buffer_cache_stats(&stats);
+
+	fprintf(fp, "Buffer cache: %lu buffers (%lu KB of %lu KB), hits %lu, "
+		"misses %lu, reads %lu (%lu read ahead), writes %lu\n",
+		stats.nr_buffers, stats.memory / 1024,
+		stats.memory_limit / 1024, stats.hits, stats.misses,
+		stats.reads, stats.readaheads, stats.writes);
+	fprintf(fp, "Buffer cache: %lu unused hot buffers, %lu blocks got hot "
+		"being read again\n", stats.hot, stats.ghost_hits);
+	fprintf(fp, "Buffer hash: %lu queues (%lu used), %lu buffers, load "
+		"factor %.2f, longest chain %lu, %.2f compares per lookup\n",
+		stats.hash_queues, stats.used_queues, stats.hashed,
+		stats.hash_queues ?
+		(double)stats.hashed / stats.hash_queues : 0.0,
+		stats.max_chain, stats.lookups ?
+		(double)stats.probes / stats.lookups : 0.0);
+}
+
 /* */
 void free_buffers(void)
 {
 	check_and_free_buffer_mem();
 }
 
-static void _invalidate_buffer_list(struct buffer_head *list, int dev)
+static void _invalidate_buffer_list(struct buffer_pool *pool,
+				    unsigned int list, int dev)
 {
-	struct buffer_head *next;
+	struct buffer_head *bh, *next;
+	int nr;
 
-	if (!list)
-		return;
+	nr = pool->nr_on_list[list];
+	next = pool->lists[list];
+	while (nr--) {
+		bh = next;
+		next = bh->b_next;
 
-	next = list;
+		if (bh->b_dev != dev)
+			continue;
 
-	for (;;) {
-		if (next->b_dev == dev) {
-			if (buffer_dirty(next) || next->b_count)
-				fprintf(stderr,
-					"invalidate_buffers: dirty buffer or used buffer (%d %lu) found\n",
-					next->b_count, next->b_blocknr);
-			next->b_state = 0;
-			remove_from_hash_queue(next);
-		}
-		next = next->b_next;
-		if (next == list)
-			break;
+		if (buffer_dirty(bh) || bh->b_count)
+			fprintf(stderr,
+				"invalidate_buffers: dirty buffer or used buffer (%d %lu) found\n",
+				bh->b_count, bh->b_blocknr);
+		bh->b_state = 0;
+		remove_from_hash_queue(bh);
+		if (bh->b_count == 0)
+			__refile_buffer(pool, bh, BUF_FREE, 0);
 	}
 }
 
 /* forget all buffers of the given device */
 void invalidate_buffers(int dev)
 {
-	_invalidate_buffer_list(Buffer_list_head, dev);
-	_invalidate_buffer_list(g_free_buffers, dev);
+	struct buffer_pool *pool;
+
+	for (pool = g_buffer_pools; pool; pool = pool->next) {
+		_invalidate_buffer_list(pool, BUF_CLEAN, dev);
+		_invalidate_buffer_list(pool, BUF_HOT, dev);
+		_invalidate_buffer_list(pool, BUF_DIRTY, dev);
+		_invalidate_buffer_list(pool, BUF_PINNED, dev);
+	}
 }
@@ -19,6 +19,7 @@
 #include <linux/hdreg.h>
 #include <dirent.h>
 #include <assert.h>
+#include <limits.h>
 
 #include <sys/ioctl.h>
 #include <signal.h>
@@ -811,3 +812,41 @@ int user_confirmed(FILE * fp, const char *q, const char *yes)
 
 	return 1;
 }
+
+/* converts string like "512K", "64M" or "1G" to number of bytes. Returns -1
+   if the string is not valid or the number does not fit into unsigned long */
+long long int misc_str_to_bytes(const char *str)
+{
+	long long int bytes;
+	char *end;
+
+	errno = 0;
+	bytes = strtoll(str, &end, 10);
+	if (errno || end == str || bytes < 0)
+		return -1;
+
+	switch (*end) {
+	case 'G':
+	case 'g':
+		if (bytes > LLONG_MAX / 1024)
+			return -1;
+		bytes *= 1024;
+		/* fall through */
+	case 'M':
+	case 'm':
+		if (bytes > LLONG_MAX / 1024)
+			return -1;
+		bytes *= 1024;
+		/* fall through */
+	case 'K':
+	case 'k':
+		if (bytes > LLONG_MAX / 1024)
+			return -1;
+		bytes *= 1024;
+		end++;
+	}
+
+	if (*end || (unsigned long long)bytes > ULONG_MAX)
+		return -1;
+	return bytes;
+}
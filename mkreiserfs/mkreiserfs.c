@@ -71,6 +71,7 @@ static void print_usage_and_exit(void)
 		"  -u | --uuid UUID                 store UUID in the superblock\n"
 		"  -l | --label LABEL               store LABEL in the superblock\n"
 		"  --format 3.5|3.6                 old 3.5 format or newer 3.6\n"
+		"  --discard                        discard unused blocks of the device\n"
 		"  -f | --force                     specified once, make mkreiserfs the whole\n"
 		"                                   disk, not block device or mounted partition;\n"
 		"                                   specified twice, do not ask for confirmation\n"
@@ -95,6 +96,7 @@ static char *Format;
 static unsigned char UUID[16];
 static char *LABEL = NULL;
 static char *badblocks_file;
+static int Discard = 0;
 
 enum mkfs_mode {
 	DEBUG_MODE = 1 << 0,
@@ -166,11 +168,12 @@ static void invalidate_other_formats(int dev)
 	brelse(bh);
 }
 
+/* number of journal blocks zeroed at once, between progress updates */
+#define ZERO_JOURNAL_BATCH 1024
+
 static void zero_journal(reiserfs_filsys_t fs)
 {
-	unsigned long start, len, done;
-	struct buffer_head *bh;
-	unsigned int i;
+	unsigned long start, len, done, i, count;
 
 	fprintf(stdout, "Initializing journal - ");
 
@@ -178,23 +181,47 @@ static void zero_journal(reiserfs_filsys_t fs)
 	len = get_jp_journal_size(sb_jp(fs->fs_ondisk_sb));
 
 	done = 0;
-	for (i = 0; i < len; i++) {
-		print_how_far(stdout, &done, len, 1, 1 /*be quiet */ );
-		bh = getblk(fs->fs_journal_dev, start + i, fs->fs_blocksize);
-		if (!bh) {
-			reiserfs_exit(1, "zero_journal: getblk failed");
-		}
-		memset(bh->b_data, 0, bh->b_size);
-		mark_buffer_dirty(bh);
-		mark_buffer_uptodate(bh, 1);
-		bwrite(bh);
-		brelse(bh);
+	for (i = 0; i < len; i += count) {
+		count = len - i < ZERO_JOURNAL_BATCH ? len - i :
+		    ZERO_JOURNAL_BATCH;
+		print_how_far(stdout, &done, len, count, 1 /*be quiet */ );
+		if (zero_blocks(fs->fs_journal_dev, start + i, count,
+				fs->fs_blocksize))
+			reiserfs_exit(1, "zero_journal: zeroing blocks "
+				      "failed: %s", strerror(errno));
 	}
 
 	fprintf(stdout, "\n");
 	fflush(stdout);
 }
 
+/* let the device know that blocks which are free in the new file system do
+   not hold data, so thin provisioned and flash devices can release them */
+static void discard_free_blocks(reiserfs_filsys_t fs)
+{
+	reiserfs_bitmap_t *bm = fs->fs_bitmap2;
+	unsigned long start, end;
+
+	fprintf(stdout, "Discarding unused blocks - ");
+	fflush(stdout);
+
+	start = reiserfs_bitmap_next_zero(bm, 0);
+	while (start != READAHEAD_END) {
+		end = reiserfs_bitmap_next_set(bm, start);
+		if (end == READAHEAD_END)
+			end = bm->bm_bit_size;
+		if (discard_blocks(fs->fs_dev, start, end - start,
+				   fs->fs_blocksize)) {
+			fprintf(stdout, "not supported (%s)\n",
+				strerror(errno));
+			return;
+		}
+		start = reiserfs_bitmap_next_zero(bm, end);
+	}
+
+	fprintf(stdout, "done\n");
+}
+
 /* this only sets few first bits in bitmap block. Fills not initialized fields
    of super block (root block and bitmap block numbers) */
 static void make_bitmap(reiserfs_filsys_t fs)
@@ -602,6 +629,7 @@ int main(int argc, char **argv)
 			{"uuid", required_argument, NULL, 'u'},
 			{"label", required_argument, NULL, 'l'},
 			{"format", required_argument, &flag, 1},
+			{"discard", no_argument, &Discard, 1},
 			{}
 		};
 		int option_index;
@@ -802,6 +830,8 @@ int main(int argc, char **argv)
 			return 1;
 	}
 
+	if (Discard)
+		discard_free_blocks(fs);
 	invalidate_other_formats(fs->fs_dev);
 	zero_journal(fs);
 
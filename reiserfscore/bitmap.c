@@ -9,19 +9,218 @@
 
 #include "includes.h"
 #include <assert.h>
+#include <sys/mman.h>
+
+/* bitmaps are made by reiserfs_create_bitmap only, the state which is not
+   exported follows struct _bitmap of the installed header */
+struct bitmap_private {
+	reiserfs_bitmap_t bm;	/* must be the first */
+	unsigned int *chunk_set;	/* set bits per chunk of the map, see
+					   reiserfs_bitmap_summarize */
+	unsigned long mapped;	/* size of anonymous mapping holding bm_map,
+				   0 if it is getmem-ed */
+};
+
+#define bm_private(bm) ((struct bitmap_private *)(bm))
+#define bm_chunk_set(bm) (bm_private(bm)->chunk_set)
+#define bm_mapped(bm) (bm_private(bm)->mapped)
+
+/* Bitmaps are arrays of bytes where bit N is bit N % 8 of byte N / 8, so
+   counting and logical operations can go a word at a time: order of bits
+   in a word matters only for finding a bit */
+typedef unsigned long bm_word_t;
+
+enum bm_op {
+	BM_OR,			/* to |= from */
+	BM_AND_NOT,		/* to &= ~from */
+	BM_COMPARE		/* to is not changed */
+};
+
+static inline bm_word_t bm_load(const char *p)
+{
+	bm_word_t word;
+
+	memcpy(&word, p, sizeof(word));
+	return word;
+}
+
+static inline void bm_store(char *p, bm_word_t word)
+{
+	memcpy(p, &word, sizeof(word));
+}
+
+/* bits of the last byte which belong to a bitmap of @bit_count bits */
+static inline unsigned char bm_tail_mask(unsigned long bit_count)
+{
+	return (1 << (bit_count & 7)) - 1;
+}
+
+/* bits of @to which @op changes (differ from @from for BM_COMPARE) */
+static inline bm_word_t bm_changed(bm_word_t to, bm_word_t from,
+				   enum bm_op op)
+{
+	switch (op) {
+	case BM_OR:
+		return from & ~to;
+	case BM_AND_NOT:
+		return from & to;
+	default:
+		return from ^ to;
+	}
+}
+
+/* apply @op to the first @bit_count bits of @to, returns number of bits
+   changed (or different) */
+static inline unsigned long bm_apply(char *to, const char *from,
+				     unsigned long bit_count, enum bm_op op)
+{
+	unsigned long bytes = bit_count / 8;
+	unsigned long i, count = 0;
+	bm_word_t changed;
+
+	for (i = 0; i + sizeof(bm_word_t) <= bytes; i += sizeof(bm_word_t)) {
+		changed = bm_changed(bm_load(to + i), bm_load(from + i), op);
+		if (!changed)
+			continue;
+		count += __builtin_popcountl(changed);
+		if (op != BM_COMPARE)
+			bm_store(to + i, bm_load(to + i) ^ changed);
+	}
+
+	for (; i <= bytes; i++) {
+		if (i == bytes && !(bit_count & 7))
+			break;
+		changed = bm_changed((unsigned char)to[i],
+				     (unsigned char)from[i], op) & 0xff;
+		if (i == bytes)
+			changed &= bm_tail_mask(bit_count);
+		count += __builtin_popcountl(changed);
+		if (op != BM_COMPARE)
+			to[i] ^= changed;
+	}
+
+	return count;
+}
+
+/* number of set bits among the first @bit_count bits of @map */
+static unsigned long bm_count(const char *map, unsigned long bit_count)
+{
+	unsigned long bytes = bit_count / 8;
+	unsigned long i, count = 0;
+
+	for (i = 0; i + sizeof(bm_word_t) <= bytes; i += sizeof(bm_word_t))
+		count += __builtin_popcountl(bm_load(map + i));
+	for (; i < bytes; i++)
+		count += __builtin_popcount((unsigned char)map[i]);
+	if (bit_count & 7)
+		count += __builtin_popcount((unsigned char)map[bytes] &
+					    bm_tail_mask(bit_count));
+	return count;
+}
+
+/* A bitmap may have a summary: number of set bits in every chunk of
+   BM_CHUNK_BITS bits. Searches skip full (or empty) chunks without looking
+   at them, so allocation from a nearly full bitmap does not scan it from
+   the beginning every time */
+#define BM_CHUNK_BITS (1 << 15)
+
+static inline unsigned long bm_chunks(reiserfs_bitmap_t *bm)
+{
+	return (bm->bm_bit_size + BM_CHUNK_BITS - 1) / BM_CHUNK_BITS;
+}
+
+/* (re)count the summary after the map was changed not bit by bit */
+static void bm_summary_update(reiserfs_bitmap_t *bm)
+{
+	unsigned long i, nr, bits;
+
+	if (!bm_chunk_set(bm))
+		return;
+
+	nr = bm_chunks(bm);
+	for (i = 0; i < nr; i++) {
+		bits = bm->bm_bit_size - i * BM_CHUNK_BITS;
+		if (bits > BM_CHUNK_BITS)
+			bits = BM_CHUNK_BITS;
+		bm_chunk_set(bm)[i] =
+		    bm_count(bm->bm_map + i * (BM_CHUNK_BITS / 8), bits);
+	}
+}
+
+/* bits of a chunk which are in the bitmap */
+static inline unsigned long bm_chunk_bits(reiserfs_bitmap_t *bm,
+					  unsigned long chunk)
+{
+	unsigned long bits = bm->bm_bit_size - chunk * BM_CHUNK_BITS;
+
+	return bits > BM_CHUNK_BITS ? BM_CHUNK_BITS : bits;
+}
+
+/* first set (zero) bit at or after @from, bm_bit_size if there is no one */
+static unsigned long bm_find_next(reiserfs_bitmap_t *bm, unsigned long from,
+				  int set)
+{
+	unsigned long chunk, end, bit;
+
+	if (!bm_chunk_set(bm))
+		return misc_find_next_bit(bm->bm_map, bm->bm_bit_size, from,
+					  set);
+
+	while (from < bm->bm_bit_size) {
+		chunk = from / BM_CHUNK_BITS;
+		end = chunk * BM_CHUNK_BITS + bm_chunk_bits(bm, chunk);
+		if (set ? bm_chunk_set(bm)[chunk] != 0 :
+		    bm_chunk_set(bm)[chunk] != bm_chunk_bits(bm, chunk)) {
+			bit = misc_find_next_bit(bm->bm_map, end, from, set);
+			if (bit < end)
+				return bit;
+		}
+		from = end;
+	}
+	return bm->bm_bit_size;
+}
+
+/* Big maps are anonymous mappings: pages which were never written to take
+   no memory. fsck keeps many bitmaps of the device size and most of them
+   have set bits in few areas only, so those cost what their set areas do */
+#define BM_MAP_THRESHOLD (1024 * 1024)
+
+static char *bm_alloc_map(reiserfs_bitmap_t *bm, unsigned long size)
+{
+	void *map;
+
+	bm_mapped(bm) = 0;
+	if (size < BM_MAP_THRESHOLD)
+		return getmem(size);
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (map == MAP_FAILED)
+		return getmem(size);
+	bm_mapped(bm) = size;
+	return map;
+}
+
+static void bm_free_map(char *map, unsigned long mapped)
+{
+	if (mapped)
+		munmap(map, mapped);
+	else
+		freemem(map);
+}
 
 /* create clean bitmap */
 reiserfs_bitmap_t *reiserfs_create_bitmap(unsigned int bit_count)
 {
 	reiserfs_bitmap_t *bm;
 
-	bm = getmem(sizeof(*bm));
+	bm = getmem(sizeof(struct bitmap_private));
 	if (!bm)
 		return NULL;
 	bm->bm_bit_size = bit_count;
 	bm->bm_byte_size = ((unsigned long long)bit_count + 7) / 8;
 	bm->bm_set_bits = 0;
-	bm->bm_map = getmem(bm->bm_byte_size);
+	bm->bm_map = bm_alloc_map(bm, bm->bm_byte_size);
 	if (!bm->bm_map) {
 		freemem(bm);
 		return NULL;
@@ -35,14 +234,16 @@ reiserfs_bitmap_t *reiserfs_create_bitmap(unsigned int bit_count)
 int reiserfs_expand_bitmap(reiserfs_bitmap_t *bm, unsigned int bit_count)
 {
 	unsigned int byte_count = ((bit_count + 7) / 8);
+	unsigned long mapped = bm_mapped(bm);
 	char *new_map;
 
-	new_map = expandmem(bm->bm_map, bm->bm_byte_size,
-			    byte_count - bm->bm_byte_size);
-
+	new_map = bm_alloc_map(bm, byte_count);
 	if (!new_map) {
+		bm_mapped(bm) = mapped;
 		return 1;
 	}
+	memcpy(new_map, bm->bm_map, bm->bm_byte_size);
+	bm_free_map(bm->bm_map, mapped);
 
 	bm->bm_map = new_map;
 	bm->bm_byte_size = byte_count;
@@ -50,32 +251,35 @@ int reiserfs_expand_bitmap(reiserfs_bitmap_t *bm, unsigned int bit_count)
 
 	bm->bm_dirty = 1;
 
+	if (bm_chunk_set(bm)) {
+		freemem(bm_chunk_set(bm));
+		bm_chunk_set(bm) = NULL;
+		return reiserfs_bitmap_summarize(bm);
+	}
+
 	return 0;
 }
 
 void reiserfs_shrink_bitmap(reiserfs_bitmap_t *bm, unsigned int bit_count)
 {
-	unsigned long i;
-
 	assert(bm->bm_bit_size >= bit_count);
 
 	bm->bm_byte_size = (bit_count + 7) / 8;
 	bm->bm_bit_size = bit_count;
-	bm->bm_set_bits = 0;
+	bm->bm_set_bits = bm_count(bm->bm_map, bit_count);
 
 	bm->bm_dirty = 1;
 
-	for (i = 0; i < bm->bm_bit_size; i++) {
-		if (reiserfs_bitmap_test_bit(bm, i))
-			bm->bm_set_bits++;
-	}
+	bm_summary_update(bm);
 }
 
 /* bitmap destructor */
 void reiserfs_delete_bitmap(reiserfs_bitmap_t *bm)
 {
-	freemem(bm->bm_map);
+	bm_free_map(bm->bm_map, bm_mapped(bm));
 	bm->bm_map = NULL;	/* to not reuse bitmap handle */
+	if (bm_chunk_set(bm))
+		freemem(bm_chunk_set(bm));
 	bm->bm_bit_size = 0;
 	bm->bm_byte_size = 0;
 	freemem(bm);
@@ -88,44 +292,16 @@ void reiserfs_bitmap_copy(reiserfs_bitmap_t *to, reiserfs_bitmap_t *from)
 	to->bm_bit_size = from->bm_bit_size;
 	to->bm_set_bits = from->bm_set_bits;
 	to->bm_dirty = 1;
+	bm_summary_update(to);
 }
 
 int reiserfs_bitmap_compare(reiserfs_bitmap_t *bm1, reiserfs_bitmap_t *bm2)
 {
-	unsigned long i, diff;
-	unsigned long int bytes, bits;
-
 	assert(bm1->bm_byte_size == bm2->bm_byte_size &&
 	       bm1->bm_bit_size == bm2->bm_bit_size);
 
-	diff = 0;
-
-	/* compare full bytes */
-	bytes = bm1->bm_bit_size / 8;
-	bits = bytes * 8;
-	if (memcmp(bm1->bm_map, bm2->bm_map, bytes)) {
-		for (i = 0; i < bits; i++)
-			if (reiserfs_bitmap_test_bit(bm1, i) !=
-			    reiserfs_bitmap_test_bit(bm2, i))
-				diff++;
-	}
-
-	/* compare last byte of bitmap which can be used partially */
-	bits = bm1->bm_bit_size % 8;
-	for (i = bm1->bm_bit_size / 8 * 8; i < bm1->bm_bit_size / 8 * 8 + bits;
-	     i++)
-		if (reiserfs_bitmap_test_bit(bm1, i) !=
-		    reiserfs_bitmap_test_bit(bm2, i))
-			diff++;
-
-/*	int mask;
-
-	mask = 255 >> (8 - bits);
-	if ((bm1->bm_map [bytes] & mask) != (bm2->bm_map [bytes] & mask)) {
-	    diff ++;
-	}
-    }*/
-	return diff;
+	return bm_apply(bm1->bm_map, bm2->bm_map, bm1->bm_bit_size,
+			BM_COMPARE);
 }
 
 /*
@@ -137,18 +313,16 @@ int reiserfs_bitmap_compare(reiserfs_bitmap_t *bm1, reiserfs_bitmap_t *bm2)
 void reiserfs_bitmap_disjunction(reiserfs_bitmap_t *to,
 				 reiserfs_bitmap_t *from)
 {
-	unsigned int i;
+	unsigned long changed;
 
 	assert(to->bm_byte_size == from->bm_byte_size &&
 	       to->bm_bit_size == from->bm_bit_size);
 
-	for (i = 0; i < to->bm_bit_size; i++) {
-		if (misc_test_bit(i, from->bm_map)
-		    && !misc_test_bit(i, to->bm_map)) {
-			misc_set_bit(i, to->bm_map);
-			to->bm_set_bits++;
-			to->bm_dirty = 1;
-		}
+	changed = bm_apply(to->bm_map, from->bm_map, to->bm_bit_size, BM_OR);
+	if (changed) {
+		to->bm_set_bits += changed;
+		to->bm_dirty = 1;
+		bm_summary_update(to);
 	}
 }
 
@@ -161,18 +335,17 @@ void reiserfs_bitmap_disjunction(reiserfs_bitmap_t *to,
 void reiserfs_bitmap_delta(reiserfs_bitmap_t *base,
 			   reiserfs_bitmap_t *exclude)
 {
-	unsigned int i;
+	unsigned long changed;
 
 	assert(base->bm_byte_size == exclude->bm_byte_size &&
 	       base->bm_bit_size == exclude->bm_bit_size);
 
-	for (i = 0; i < base->bm_bit_size; i++) {
-		if (misc_test_bit(i, exclude->bm_map)
-		    && misc_test_bit(i, base->bm_map)) {
-			misc_clear_bit(i, base->bm_map);
-			base->bm_set_bits--;
-			base->bm_dirty = 1;
-		}
+	changed = bm_apply(base->bm_map, exclude->bm_map, base->bm_bit_size,
+			   BM_AND_NOT);
+	if (changed) {
+		base->bm_set_bits -= changed;
+		base->bm_dirty = 1;
+		bm_summary_update(base);
 	}
 }
 
@@ -183,6 +356,8 @@ void reiserfs_bitmap_set_bit(reiserfs_bitmap_t *bm, unsigned int bit_number)
 		return;
 	misc_set_bit(bit_number, bm->bm_map);
 	bm->bm_set_bits++;
+	if (bm_chunk_set(bm))
+		bm_chunk_set(bm)[bit_number / BM_CHUNK_BITS]++;
 	bm->bm_dirty = 1;
 }
 
@@ -193,6 +368,8 @@ void reiserfs_bitmap_clear_bit(reiserfs_bitmap_t *bm, unsigned int bit_number)
 		return;
 	misc_clear_bit(bit_number, bm->bm_map);
 	bm->bm_set_bits--;
+	if (bm_chunk_set(bm))
+		bm_chunk_set(bm)[bit_number / BM_CHUNK_BITS]--;
 	bm->bm_dirty = 1;
 }
 
@@ -219,7 +396,7 @@ int reiserfs_bitmap_find_zero_bit(reiserfs_bitmap_t *bm, unsigned long *first)
 	unsigned long bit_nr = *first;
 	assert(*first < bm->bm_bit_size);
 
-	bit_nr = misc_find_next_zero_bit(bm->bm_map, bm->bm_bit_size, *first);
+	bit_nr = bm_find_next(bm, *first, 0);
 
 	if (bit_nr >= bm->bm_bit_size) {	/* search failed */
 		return 1;
@@ -229,12 +406,93 @@ int reiserfs_bitmap_find_zero_bit(reiserfs_bitmap_t *bm, unsigned long *first)
 	return 0;
 }
 
+/* keep a summary for the bitmap to speed searches up. Bitmaps used for
+   block allocation want it. Returns non-zero if memory could not be got */
+int reiserfs_bitmap_summarize(reiserfs_bitmap_t *bm)
+{
+	if (bm_chunk_set(bm) || !bm->bm_bit_size)
+		return 0;
+
+	bm_chunk_set(bm) = getmem(bm_chunks(bm) * sizeof(unsigned int));
+	if (!bm_chunk_set(bm))
+		return 1;
+	bm_summary_update(bm);
+	return 0;
+}
+
+/* first set bit at or after @from, bm_bit_size if there is no one */
+unsigned long reiserfs_bitmap_find_next_set(reiserfs_bitmap_t *bm,
+					    unsigned long from)
+{
+	return bm_find_next(bm, from, 1);
+}
+
+/* find first run of set bits at or after *@start. Returns 0 if there is no
+   one, otherwise its first bit and length are put to @start and @count */
+int reiserfs_bitmap_find_next_run(reiserfs_bitmap_t *bm, unsigned long *start,
+				  unsigned long *count)
+{
+	unsigned long first, end;
+
+	first = bm_find_next(bm, *start, 1);
+	if (first >= bm->bm_bit_size)
+		return 0;
+	end = bm_find_next(bm, first, 0);
+
+	*start = first;
+	*count = end - first;
+	return 1;
+}
+
+/* predictors for readahead_init: a scan is going to read blocks whose bits
+   are set (zero) */
+unsigned long reiserfs_bitmap_next_set(void *data, unsigned long from)
+{
+	reiserfs_bitmap_t *bm = data;
+	unsigned long bit_nr;
+
+	if (from >= bm->bm_bit_size)
+		return READAHEAD_END;
+	bit_nr = bm_find_next(bm, from, 1);
+	return bit_nr < bm->bm_bit_size ? bit_nr : READAHEAD_END;
+}
+
+unsigned long reiserfs_bitmap_next_zero(void *data, unsigned long from)
+{
+	reiserfs_bitmap_t *bm = data;
+	unsigned long bit_nr;
+
+	if (from >= bm->bm_bit_size)
+		return READAHEAD_END;
+	bit_nr = bm_find_next(bm, from, 0);
+	return bit_nr < bm->bm_bit_size ? bit_nr : READAHEAD_END;
+}
+
+/* predictor for readahead_init: bitmap blocks of the filesystem. Spread
+   bitmap blocks are far from each other, so reading them one by one costs
+   a seek each */
+static unsigned long next_bitmap_block(void *data, unsigned long from)
+{
+	reiserfs_filsys_t fs = data;
+	unsigned long first = fs->fs_super_bh->b_blocknr + 1;
+	unsigned long nr = reiserfs_fs_bmap_nr(fs);
+	unsigned long bits = fs->fs_blocksize * 8;
+
+	if (from <= first)
+		return first;
+	if (!spread_bitmaps(fs))
+		return from < first + nr ? from : READAHEAD_END;
+	from = (from + bits - 1) / bits;
+	return from < nr ? from * bits : READAHEAD_END;
+}
+
 /* read every bitmap block and copy their content into bitmap 'bm' */
 static int reiserfs_fetch_ondisk_bitmap(reiserfs_bitmap_t *bm,
 					reiserfs_filsys_t fs)
 {
 	unsigned int last_byte_unused_bits;
 	unsigned long block, to_copy;
+	struct readahead *ra;
 	struct buffer_head *bh;
 	unsigned int i;
 	int copied;
@@ -250,8 +508,11 @@ static int reiserfs_fetch_ondisk_bitmap(reiserfs_bitmap_t *bm,
 	p = bm->bm_map;
 	block = fs->fs_super_bh->b_blocknr + 1;
 
+	/* have many bitmap blocks being read at once */
+	ra = readahead_init(fs->fs_dev, fs->fs_blocksize, next_bitmap_block,
+			    fs, 0);
 	while (to_copy) {
-		bh = bread(fs->fs_dev, block, fs->fs_blocksize);
+		bh = readahead_bread(ra, block);
 		if (!bh) {
 			reiserfs_warning(stderr,
 					 "reiserfs_fetch_ondisk_bitmap: "
@@ -292,6 +553,7 @@ static int reiserfs_fetch_ondisk_bitmap(reiserfs_bitmap_t *bm,
 		else
 			block++;
 	}
+	readahead_done(ra);
 
 	/* on disk bitmap has bits out of SB_BLOCK_COUNT set to 1, where as
 	   reiserfs_bitmap_t has those bits set to 0 */
@@ -304,11 +566,8 @@ static int reiserfs_fetch_ondisk_bitmap(reiserfs_bitmap_t *bm,
 			misc_clear_bit(bm->bm_bit_size + i, bm->bm_map);
 	}
 
-	bm->bm_set_bits = 0;
-	/* FIXME: optimize that */
-	for (i = 0; i < bm->bm_bit_size; i++)
-		if (reiserfs_bitmap_test_bit(bm, i))
-			bm->bm_set_bits++;
+	bm->bm_set_bits = bm_count(bm->bm_map, bm->bm_bit_size);
+	bm_summary_update(bm);
 
 	bm->bm_dirty = 0;
 
@@ -392,9 +651,13 @@ int reiserfs_flush_to_ondisk_bitmap(reiserfs_bitmap_t *bm,
 
 void reiserfs_bitmap_zero(reiserfs_bitmap_t *bm)
 {
-	memset(bm->bm_map, 0, bm->bm_byte_size);
+	/* give pages of the mapping back, they will read as zeros */
+	if (!bm_mapped(bm) ||
+	    madvise(bm->bm_map, bm->bm_byte_size, MADV_DONTNEED))
+		memset(bm->bm_map, 0, bm->bm_byte_size);
 	bm->bm_set_bits = 0;
 	bm->bm_dirty = 1;
+	bm_summary_update(bm);
 }
 
 void reiserfs_bitmap_fill(reiserfs_bitmap_t *bm)
@@ -402,6 +665,7 @@ void reiserfs_bitmap_fill(reiserfs_bitmap_t *bm)
 	memset(bm->bm_map, 0xff, bm->bm_byte_size);
 	bm->bm_set_bits = bm->bm_bit_size;
 	bm->bm_dirty = 1;
+	bm_summary_update(bm);
 }
 
 /* format of bitmap saved in a file:
@@ -409,10 +673,50 @@ void reiserfs_bitmap_fill(reiserfs_bitmap_t *bm)
    bm_bit_size (32 bits)
    number of ranges of used and free blocks (32 bits)
    number of contiguously used block, .. of free blocks, used, free, etc
+   magic number (32 bits)
+
+   version 2 of it, written by reiserfs_bitmap_save now:
+   magic number 2 (32 bits)
+   format version (32 bits)
+   bm_bit_size (32 bits)
+   lengths of ranges of used blocks, free, used, etc (32 bits each), their
+   sum is bm_bit_size
+   checksum of the lengths (32 bits)
    magic number (32 bits) */
 
 #define BITMAP_START_MAGIC 374031
+#define BITMAP_START_MAGIC_2 374032
 #define BITMAP_END_MAGIC 7786472
+#define BITMAP_FORMAT_VERSION 2
+
+/* FNV-1a over lengths of ranges */
+#define BITMAP_CHECKSUM_INIT 2166136261U
+
+static __u32 bitmap_checksum(__u32 sum, __u32 v)
+{
+	int i;
+
+	for (i = 0; i < 4; i++, v >>= 8) {
+		sum ^= v & 0xff;
+		sum *= 16777619U;
+	}
+	return sum;
+}
+
+/* set bits [@from, @from + @count) of the map */
+static void bm_set_range(char *map, unsigned long from, unsigned long count)
+{
+	unsigned long end = from + count;
+
+	while (from < end && (from & 7))
+		misc_set_bit(from++, map);
+	if (end - from >= 8) {
+		memset(map + from / 8, 0xff, (end - from) / 8);
+		from += (end - from) & ~7UL;
+	}
+	while (from < end)
+		misc_set_bit(from++, map);
+}
 
 FILE *open_file(const char *filename, char *const option)
 {
@@ -433,103 +737,41 @@ void close_file(FILE * fp)
 	/*reiserfs_warning (stderr, "done\n"); fflush (stderr); */
 }
 
+#define BITMAP_SAVE_BUFFER 1024
+
 void reiserfs_bitmap_save(FILE * fp, reiserfs_bitmap_t *bm)
 {
-//    FILE * fp;
+	__u32 buf[BITMAP_SAVE_BUFFER];
+	__u32 sum = BITMAP_CHECKSUM_INIT;
+	unsigned long bit, end;
+	int set, count;
 	__u32 v;
-	int zeros;
-	int count;
-	unsigned int i;
-	int extents;
-	long position;
-
-	/*  fp = fopen (filename, "w+");
-	   if (!fp) {
-	   reiserfs_warning (stderr, "reiserfs_bitmap_save: could not save bitmap in %s: %s",
-	   filename, strerror(errno));
-	   return;
-	   } */
-
-//    reiserfs_warning (stderr, "Saving bitmap in \"%s\" .. ", filename); fflush (stderr);
 
-	v = BITMAP_START_MAGIC;
+	v = BITMAP_START_MAGIC_2;
+	fwrite(&v, 4, 1, fp);
+	v = BITMAP_FORMAT_VERSION;
 	fwrite(&v, 4, 1, fp);
-
 	v = bm->bm_bit_size;
 	fwrite(&v, 4, 1, fp);
 
-	/*printf ("SAVE: bit_size - %d\n", v); */
-
-	position = ftell(fp);
-
-	if (fseek(fp, 4, SEEK_CUR)) {
-		reiserfs_warning(stderr,
-				 "reiserfs_bitmap_save: fseek failed: %s\n",
-				 strerror(errno));
-//      fclose (fp);
-		return;
-	}
-
-	zeros = 0;
+	/* ranges are found word at a time and written in big chunks */
 	count = 0;
-	extents = 0;
-	for (i = 0; i < v; i++) {
-		if (reiserfs_bitmap_test_bit(bm, i)) {
-			if (zeros) {
-				/* previous bit was not set, write amount of not set
-				   bits, switch to count set bits */
-				fwrite(&count, 4, 1, fp);
-				/*printf ("SAVE: Free %d\n", count); */
-				extents++;
-				count = 1;
-				zeros = 0;
-			} else {
-				/* one more zero bit appeared */
-				count++;
-			}
-		} else {
-			/* zero bit found */
-			if (zeros) {
-				count++;
-			} else {
-				/* previous bit was set, write amount of set bits,
-				   switch to count not set bits */
-				fwrite(&count, 4, 1, fp);
-				/*printf ("SAVE: Used %d\n", count); */
-				extents++;
-				count = 1;
-				zeros = 1;
-			}
+	set = 1;
+	for (bit = 0; bit < bm->bm_bit_size; bit = end, set = !set) {
+		end = bm_find_next(bm, bit, !set);
+		buf[count] = end - bit;
+		sum = bitmap_checksum(sum, buf[count]);
+		if (++count == BITMAP_SAVE_BUFFER) {
+			fwrite(buf, 4, count, fp);
+			count = 0;
 		}
 	}
+	if (count)
+		fwrite(buf, 4, count, fp);
 
-	fwrite(&count, 4, 1, fp);
-	extents++;
-/*
-    if (zeros)
-	printf ("SAVE: Free %d\n", count);
-    else	
-	printf ("SAVE: Used %d\n", count);
-*/
-
+	fwrite(&sum, 4, 1, fp);
 	v = BITMAP_END_MAGIC;
 	fwrite(&v, 4, 1, fp);
-
-	if (fseek(fp, position, SEEK_SET)) {
-		reiserfs_warning(stderr,
-				 "reiserfs_bitmap_save: fseek failed: %s",
-				 strerror(errno));
-		return;
-	}
-
-	fwrite(&extents, 4, 1, fp);
-
-	if (fseek(fp, 0, SEEK_END)) {
-		reiserfs_warning(stderr,
-				 "reiserfs_bitmap_save: fseek failed: %s",
-				 strerror(errno));
-		return;
-	}
 }
 
 /* format of fsck dump file:
@@ -601,91 +843,114 @@ int is_stage_magic_correct(FILE * fp)
 	return (__u16) v;
 }
 
-reiserfs_bitmap_t *reiserfs_bitmap_load(FILE * fp)
+/* read ranges of the old format */
+static int bitmap_load_1(FILE * fp, reiserfs_bitmap_t *bm)
 {
-//    FILE * fp;
-	__u32 v;
-	int count;
-	int i, j;
-	int extents;
-	int bit;
-	reiserfs_bitmap_t *bm;
+	unsigned long bit = 0;
+	__u32 extents, count, i;
+
+	if (fread(&extents, 4, 1, fp) != 1)
+		return 1;
 
-/*    fp = fopen (filename, "r");
-    if (!fp) {
-	reiserfs_warning (stderr, "reiserfs_bitmap_load: fopen failed: %s\n", strerror(errno));
+	for (i = 0; i < extents; i++) {
+		if (fread(&count, 4, 1, fp) != 1 ||
+		    count > bm->bm_bit_size - bit)
+			return 1;
+		if (i % 2 == 0)
+			bm_set_range(bm->bm_map, bit, count);
+		bit += count;
+	}
 	return 0;
-    }*/
+}
 
-	fread(&v, 4, 1, fp);
-	if (v != BITMAP_START_MAGIC) {
+static int bitmap_load_2(FILE * fp, reiserfs_bitmap_t *bm)
+{
+	__u32 sum = BITMAP_CHECKSUM_INIT;
+	unsigned long bit = 0;
+	__u32 count, v;
+	int set = 1;
+
+	while (bit < bm->bm_bit_size) {
+		if (fread(&count, 4, 1, fp) != 1 ||
+		    count > bm->bm_bit_size - bit)
+			return 1;
+		sum = bitmap_checksum(sum, count);
+		if (set)
+			bm_set_range(bm->bm_map, bit, count);
+		bit += count;
+		set = !set;
+	}
+
+	if (fread(&v, 4, 1, fp) != 1 || v != sum) {
+		reiserfs_warning(stderr, "reiserfs_bitmap_load: "
+				 "wrong checksum\n");
+		return 1;
+	}
+	return 0;
+}
+
+reiserfs_bitmap_t *reiserfs_bitmap_load(FILE * fp)
+{
+	reiserfs_bitmap_t *bm;
+	__u32 magic, v;
+	int ret;
+
+	if (fread(&magic, 4, 1, fp) != 1 ||
+	    (magic != BITMAP_START_MAGIC && magic != BITMAP_START_MAGIC_2)) {
 		reiserfs_warning(stderr, "reiserfs_bitmap_load: "
 				 "no bitmap start magic found");
-//      fclose (fp);
+		return NULL;
+	}
+
+	if (magic == BITMAP_START_MAGIC_2 &&
+	    (fread(&v, 4, 1, fp) != 1 || v != BITMAP_FORMAT_VERSION)) {
+		reiserfs_warning(stderr, "reiserfs_bitmap_load: "
+				 "unknown format version\n");
 		return NULL;
 	}
 
 	/* read bit size of bitmap */
-	fread(&v, 4, 1, fp);
+	if (fread(&v, 4, 1, fp) != 1)
+		return NULL;
 
 	bm = reiserfs_create_bitmap(v);
 	if (!bm) {
 		reiserfs_warning(stderr,
 				 "reiserfs_bitmap_load: creation failed");
-//      fclose (fp);
 		return NULL;
 	}
 
-	/*printf ("LOAD: bit_size - %d\n", v); */
-
-	fread(&extents, 4, 1, fp);
-
-	/*printf ("LOAD: extents - %d\n", extents); */
-
-	bit = 0;
-	for (i = 0; i < extents; i++) {
-		fread(&count, 4, 1, fp);
-/*
-	if (i % 2)
-	    printf ("LOAD: Free %d\n", count);
+	if (magic == BITMAP_START_MAGIC_2)
+		ret = bitmap_load_2(fp, bm);
 	else
-	    printf ("LOAD: Used %d\n", count);
-*/
-		for (j = 0; j < count; j++, bit++)
-			if (i % 2 == 0) {
-				reiserfs_bitmap_set_bit(bm, bit);
-			}
-	}
-
-	fread(&v, 4, 1, fp);
-
-	/*printf ("LOAD: Endmagic %d\n", v); */
+		ret = bitmap_load_1(fp, bm);
 
-//    fclose (fp);
-	if (v != BITMAP_END_MAGIC) {
+	if (ret || fread(&v, 4, 1, fp) != 1 || v != BITMAP_END_MAGIC) {
 		reiserfs_warning(stderr, "reiserfs_bitmap_load: "
 				 "no bitmap end magic found");
+		reiserfs_delete_bitmap(bm);
 		return NULL;
 	}
 
-	/*    reiserfs_warning (stderr, "%d bits set - done\n", reiserfs_bitmap_ones (bm)); */
-	fflush(stderr);
+	bm->bm_set_bits = bm_count(bm->bm_map, bm->bm_bit_size);
 	return bm;
 }
 
 void reiserfs_bitmap_invert(reiserfs_bitmap_t *bm)
 {
-	unsigned int i;
+	unsigned long bytes = bm->bm_bit_size / 8;
+	unsigned long i;
 
-	/*reiserfs_warning (stderr, "Bitmap inverting..");fflush (stderr); */
-	for (i = 0; i < bm->bm_bit_size; i++) {
-		if (reiserfs_bitmap_test_bit(bm, i))
-			reiserfs_bitmap_clear_bit(bm, i);
-		else
-			reiserfs_bitmap_set_bit(bm, i);
-	}
+	for (i = 0; i + sizeof(bm_word_t) <= bytes; i += sizeof(bm_word_t))
+		bm_store(bm->bm_map + i, ~bm_load(bm->bm_map + i));
+	for (; i < bytes; i++)
+		bm->bm_map[i] = ~bm->bm_map[i];
+	if (bm->bm_bit_size & 7)
+		bm->bm_map[bytes] ^= bm_tail_mask(bm->bm_bit_size);
 
-	/*reiserfs_warning (stderr, "done\n"); */
+	bm->bm_set_bits = bm->bm_bit_size - bm->bm_set_bits;
+	bm->bm_dirty = 1;
+	bm_summary_update(bm);
 }
 
 void reiserfs_free_ondisk_bitmap(reiserfs_filsys_t fs)
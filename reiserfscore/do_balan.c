@@ -1534,6 +1534,9 @@ void do_balance(struct tree_balance *tb,	/* tree_balance structure
 		return;
 	}
 
+	/* delimiting keys and pointers are about to change */
+	reiserfs_forget_search_finger(tb->tb_fs);
+
 	if (flag == M_INTERNAL) {
 		insert_ptr[0] = (struct buffer_head *)body;
 		/* we must prepare insert_key */
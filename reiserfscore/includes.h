@@ -20,3 +20,27 @@
 #include <malloc.h>
 #include <sys/vfs.h>
 #include <time.h>
+
+/* path of the last reiserfs_search_by_key_x with delimiting keys of its
+   nodes, the next search starts from the lowest node covering its key */
+struct reiserfs_search_finger {
+	int height;		/* number of valid levels, 0 if none */
+	unsigned long root;
+	unsigned long blocks[MAX_HEIGHT];
+	int positions[MAX_HEIGHT];
+	struct reiserfs_key lkeys[MAX_HEIGHT];
+	struct reiserfs_key rkeys[MAX_HEIGHT];
+};
+
+/* filsys structures made by reiserfs_open and reiserfs_create are followed
+   by the state the library does not export, so that struct reiserfs_filsys
+   of the installed header stays as it was */
+struct reiserfs_filsys_private {
+	struct reiserfs_filsys fs;	/* must be the first */
+	struct buffer_head **journal_image;	/* journal blocks kept in
+						   memory by
+						   reiserfs_load_journal */
+	struct reiserfs_search_finger finger;
+};
+
+#define fs_private(fs) ((struct reiserfs_filsys_private *)(fs))
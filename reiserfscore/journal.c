@@ -251,40 +251,6 @@ int next_transaction(reiserfs_filsys_t fs, reiserfs_trans_t *trans,
 	return found;
 }
 
-static void read_journal_write_in_place(reiserfs_filsys_t fs,
-					reiserfs_trans_t *trans,
-					unsigned int index,
-					unsigned long in_journal,
-					unsigned long in_place)
-{
-	struct buffer_head *j_bh, *bh;
-
-	j_bh = bread(fs->fs_journal_dev, in_journal, fs->fs_blocksize);
-	if (!j_bh) {
-		fprintf(stderr,
-			"replay_one_transaction: transaction %lu: reading %lu block failed\n",
-			trans->trans_id, in_journal);
-		return;
-	}
-	if (not_journalable(fs, in_place)) {
-		fprintf(stderr,
-			"replay_one_transaction: transaction %lu: block %ld should not be journalled (%lu)\n",
-			trans->trans_id, in_journal, in_place);
-		brelse(j_bh);
-		return;
-	}
-
-	bh = getblk(fs->fs_dev, in_place, fs->fs_blocksize);
-
-	memcpy(bh->b_data, j_bh->b_data, bh->b_size);
-	mark_buffer_dirty(bh);
-	mark_buffer_uptodate(bh, 1);
-	bwrite(bh);
-	brelse(bh);
-	brelse(j_bh);
-
-}
-
 /* go through all blocks of transaction and call 'action' each of them */
 void for_each_block(reiserfs_filsys_t fs, reiserfs_trans_t *trans,
 		    action_on_block_t action)
@@ -337,13 +303,6 @@ void for_each_block(reiserfs_filsys_t fs, reiserfs_trans_t *trans,
 	brelse(c_bh);
 }
 
-/* transaction is supposed to be valid */
-int replay_one_transaction(reiserfs_filsys_t fs, reiserfs_trans_t *trans)
-{
-	for_each_block(fs, trans, read_journal_write_in_place);
-	fsync(fs->fs_dev);
-	return 0;
-}
 
 void for_each_transaction(reiserfs_filsys_t fs, action_on_trans_t action)
 {
@@ -506,6 +465,15 @@ int reiserfs_open_journal(reiserfs_filsys_t fs, const char *j_filename,
 	if (fs->fs_journal_dev == -1)
 		return -1;
 
+	/* the journal is on the device itself, which is a pack */
+	count = reiserfs_open_packed(fs->fs_journal_dev);
+	if (count && (flags & O_ACCMODE) != O_RDONLY) {
+		reiserfs_close_packed(fs->fs_journal_dev);
+		close(fs->fs_journal_dev);
+		errno = EROFS;
+		return -1;
+	}
+
 	asprintf(&fs->fs_j_file_name, "%s", j_filename);
 
 	if (get_jp_journal_size(sb_jp(sb)) < JOURNAL_MIN_SIZE) {
@@ -513,11 +481,13 @@ int reiserfs_open_journal(reiserfs_filsys_t fs, const char *j_filename,
 				 "specified journal device %s.\nMust be not less than (%lu).\n",
 				 get_jp_journal_size(sb_jp(sb)) + 1, j_filename,
 				 JOURNAL_MIN_SIZE + 1);
+		reiserfs_close_packed(fs->fs_journal_dev);
 		close(fs->fs_journal_dev);
 		return 1;
 	}
 
-	if (!(count = count_blocks(j_filename, fs->fs_blocksize))) {
+	if (!count && !(count = count_blocks(j_filename, fs->fs_blocksize))) {
+		reiserfs_close_packed(fs->fs_journal_dev);
 		close(fs->fs_journal_dev);
 		return -1;
 	}
@@ -531,6 +501,7 @@ int reiserfs_open_journal(reiserfs_filsys_t fs, const char *j_filename,
 				 j_filename,
 				 get_jp_journal_1st_block(sb_jp(sb)),
 				 get_jp_journal_size(sb_jp(sb)) + 1, count);
+		reiserfs_close_packed(fs->fs_journal_dev);
 		close(fs->fs_journal_dev);
 		return 1;
 	}
@@ -543,6 +514,7 @@ int reiserfs_open_journal(reiserfs_filsys_t fs, const char *j_filename,
 	if (!fs->fs_jh_bh) {
 		reiserfs_warning(stderr, "reiserfs_open_journal: bread failed "
 				 "reading journal  header.\n");
+		reiserfs_close_packed(fs->fs_journal_dev);
 		close(fs->fs_journal_dev);
 		return -1;
 	}
@@ -752,10 +724,17 @@ void reiserfs_reopen_journal(reiserfs_filsys_t fs, int flag)
 	if (!reiserfs_journal_opened(fs))
 		return;
 
+	if (reiserfs_is_packed(fs->fs_journal_dev) &&
+	    (flag & O_ACCMODE) != O_RDONLY)
+		die("reiserfs_reopen_journal: %s is a packed metadata image, "
+		    "it can not be opened for writing", fs->fs_j_file_name);
+
+	reiserfs_unload_journal(fs);
 	jh_block = fs->fs_jh_bh->b_blocknr;
 	brelse(fs->fs_jh_bh);
 	flush_buffers(fs->fs_journal_dev);
 	invalidate_buffers(fs->fs_journal_dev);
+	reiserfs_close_packed(fs->fs_journal_dev);
 	if (close(fs->fs_journal_dev))
 		die("reiserfs_reopen_journal: closed failed: %s",
 		    strerror(errno));
@@ -767,6 +746,7 @@ void reiserfs_reopen_journal(reiserfs_filsys_t fs, int flag)
 	    );
 	if (fs->fs_journal_dev == -1)
 		die("reiserfs_reopen_journal: could not reopen journal device");
+	reiserfs_open_packed(fs->fs_journal_dev);
 
 	fs->fs_jh_bh = bread(fs->fs_journal_dev, jh_block, fs->fs_blocksize);
 	if (!fs->fs_jh_bh)
@@ -778,6 +758,64 @@ int reiserfs_journal_opened(reiserfs_filsys_t fs)
 	return fs->fs_jh_bh ? 1 : 0;
 }
 
+static unsigned long next_journal_block(void *data, unsigned long from)
+{
+	reiserfs_filsys_t fs = data;
+	unsigned long j_start;
+
+	j_start = get_jp_journal_1st_block(sb_jp(fs->fs_ondisk_sb));
+	if (from < j_start)
+		return j_start;
+	if (from >= j_start + get_jp_journal_size(sb_jp(fs->fs_ondisk_sb)))
+		return READAHEAD_END;
+	return from;
+}
+
+/* transactions are looked for, checked and replayed by reading descriptor,
+   commit and logged blocks all over the journal, many of them more than
+   once. When the buffer cache is big enough, read the whole journal area
+   sequentially and keep it in memory, so that those breads do not go to
+   the disk */
+void reiserfs_load_journal(reiserfs_filsys_t fs)
+{
+	struct buffer_head **image;
+	struct readahead *ra;
+	unsigned long j_start, j_size, i;
+
+	if (!reiserfs_journal_opened(fs) || fs_private(fs)->journal_image)
+		return;
+
+	j_start = get_jp_journal_1st_block(sb_jp(fs->fs_ondisk_sb));
+	j_size = get_jp_journal_size(sb_jp(fs->fs_ondisk_sb));
+	if (j_size > get_buffer_cache_size() / 2 / fs->fs_blocksize)
+		return;
+
+	image = getmem(j_size * sizeof(struct buffer_head *));
+	fs_private(fs)->journal_image = image;
+	ra = readahead_init(fs->fs_journal_dev, fs->fs_blocksize,
+			    next_journal_block, fs, 0);
+	/* buffers are held until reiserfs_unload_journal, blocks which could
+	   not be read are left to bread to complain about */
+	for (i = 0; i < j_size; i++)
+		image[i] = readahead_bread(ra, j_start + i);
+	readahead_done(ra);
+}
+
+void reiserfs_unload_journal(reiserfs_filsys_t fs)
+{
+	struct buffer_head **image = fs_private(fs)->journal_image;
+	unsigned long j_size, i;
+
+	if (!image)
+		return;
+
+	j_size = get_jp_journal_size(sb_jp(fs->fs_ondisk_sb));
+	for (i = 0; i < j_size; i++)
+		brelse(image[i]);
+	freemem(image);
+	fs_private(fs)->journal_image = NULL;
+}
+
 void reiserfs_flush_journal(reiserfs_filsys_t fs)
 {
 	if (!reiserfs_journal_opened(fs))
@@ -789,8 +827,12 @@ void reiserfs_free_journal(reiserfs_filsys_t fs)
 {
 	if (!reiserfs_journal_opened(fs))
 		return;
+	reiserfs_unload_journal(fs);
 	brelse(fs->fs_jh_bh);
 	fs->fs_jh_bh = NULL;
+	/* the reader of the device itself goes away in reiserfs_free */
+	if (fs->fs_journal_dev != fs->fs_dev)
+		reiserfs_close_packed(fs->fs_journal_dev);
 	free(fs->fs_j_file_name);
 	fs->fs_j_file_name = NULL;
 }
@@ -820,15 +862,162 @@ static void update_journal_header(reiserfs_filsys_t fs,
 	fsync(fs->fs_journal_dev);
 }
 
+/* replay does not write blocks transaction by transaction: blocks of all
+   transactions to be replayed are logged, only the newest copy of every
+   block is written, once */
+struct replay_block {
+	unsigned long in_place;
+	unsigned long in_journal;
+	unsigned long nr;	/* order of logging */
+};
+
+static struct replay_block *replay_blocks;
+static unsigned long replay_nr_blocks, replay_max_blocks;
+
+/* read-ahead predictor over logged blocks sorted by position in the
+   journal */
+static unsigned long replay_pos;
+
+static void log_replay_block(reiserfs_filsys_t fs, reiserfs_trans_t *trans,
+			     unsigned int index, unsigned long in_journal,
+			     unsigned long in_place)
+{
+	struct replay_block *block;
+	unsigned long grow;
+
+	if (not_journalable(fs, in_place)) {
+		fprintf(stderr,
+			"replay_one_transaction: transaction %lu: block %ld should not be journalled (%lu)\n",
+			trans->trans_id, in_journal, in_place);
+		return;
+	}
+
+	if (replay_nr_blocks == replay_max_blocks) {
+		grow = replay_max_blocks ? replay_max_blocks : 1024;
+		replay_blocks = expandmem(replay_blocks, replay_max_blocks *
+					  sizeof(struct replay_block),
+					  grow * sizeof(struct replay_block));
+		replay_max_blocks += grow;
+	}
+
+	block = replay_blocks + replay_nr_blocks;
+	block->in_place = in_place;
+	block->in_journal = in_journal;
+	block->nr = replay_nr_blocks++;
+}
+
+static int replay_block_compare(const void *p1, const void *p2)
+{
+	const struct replay_block *b1 = p1, *b2 = p2;
+
+	if (b1->in_place != b2->in_place)
+		return b1->in_place < b2->in_place ? -1 : 1;
+	return b1->nr < b2->nr ? -1 : b1->nr > b2->nr;
+}
+
+static int replay_journal_compare(const void *p1, const void *p2)
+{
+	const struct replay_block *b1 = p1, *b2 = p2;
+
+	return b1->in_journal < b2->in_journal ? -1 :
+	    b1->in_journal > b2->in_journal;
+}
+
+static unsigned long next_replay_block(void *data, unsigned long from)
+{
+	while (replay_pos < replay_nr_blocks &&
+	       replay_blocks[replay_pos].in_journal < from)
+		replay_pos++;
+	if (replay_pos == replay_nr_blocks)
+		return READAHEAD_END;
+	return replay_blocks[replay_pos].in_journal;
+}
+
+/* copy the newest journal copy of every logged block to its place. They
+   are written sorted, then one fsync makes them stable before the journal
+   header is updated */
+static void replay_logged_blocks(reiserfs_filsys_t fs)
+{
+	struct buffer_head *j_bh, *bh, **bhs;
+	struct readahead *ra;
+	unsigned long i, nr;
+
+	if (!replay_nr_blocks)
+		return;
+
+	qsort(replay_blocks, replay_nr_blocks, sizeof(struct replay_block),
+	      replay_block_compare);
+	for (i = 0, nr = 0; i < replay_nr_blocks; i++) {
+		if (i + 1 < replay_nr_blocks &&
+		    replay_blocks[i + 1].in_place == replay_blocks[i].in_place)
+			/* there is newer copy */
+			continue;
+		replay_blocks[nr++] = replay_blocks[i];
+	}
+	replay_nr_blocks = nr;
+
+	/* read the journal sequentially */
+	qsort(replay_blocks, replay_nr_blocks, sizeof(struct replay_block),
+	      replay_journal_compare);
+	replay_pos = 0;
+	ra = readahead_init(fs->fs_journal_dev, fs->fs_blocksize,
+			    next_replay_block, NULL, 0);
+
+	for (i = 0; i < replay_nr_blocks; i++) {
+		j_bh = readahead_bread(ra, replay_blocks[i].in_journal);
+		if (!j_bh) {
+			fprintf(stderr,
+				"replay_logged_blocks: reading %lu block failed\n",
+				replay_blocks[i].in_journal);
+			continue;
+		}
+
+		bh = getblk(fs->fs_dev, replay_blocks[i].in_place,
+			    fs->fs_blocksize);
+		memcpy(bh->b_data, j_bh->b_data, bh->b_size);
+		mark_buffer_dirty(bh);
+		mark_buffer_uptodate(bh, 1);
+		brelse(bh);
+		brelse(j_bh);
+	}
+	readahead_done(ra);
+
+	/* other dirty buffers of the device are not written here */
+	bhs = getmem(replay_nr_blocks * sizeof(struct buffer_head *));
+	for (i = 0, nr = 0; i < replay_nr_blocks; i++) {
+		bh = find_buffer(fs->fs_dev, replay_blocks[i].in_place,
+				 fs->fs_blocksize);
+		if (bh && buffer_dirty(bh))
+			bhs[nr++] = bh;
+	}
+	bwrite_buffers(bhs, nr);
+	freemem(bhs);
+	if (fsync(fs->fs_dev))
+		die("replay_logged_blocks: fsync failed: %s", strerror(errno));
+
+	freemem(replay_blocks);
+	replay_blocks = NULL;
+	replay_nr_blocks = replay_max_blocks = 0;
+}
+
+/* transaction is supposed to be valid */
+int replay_one_transaction(reiserfs_filsys_t fs, reiserfs_trans_t *trans)
+{
+	for_each_block(fs, trans, log_replay_block);
+	replay_logged_blocks(fs);
+	return 0;
+}
+
 /* fixme: what should be done when not all transactions can be replayed in proper order? */
 int reiserfs_replay_journal(reiserfs_filsys_t fs)
 {
 	struct buffer_head *bh;
 	struct reiserfs_journal_header *j_head;
 	reiserfs_trans_t cur, newest, control;
-	int replayed, ret;
+	reiserfs_trans_t *trans = NULL;	/* replayed ones */
+	int replayed, ret, broken = 0;
 	struct progbar progbar;
-	int trans_count;
+	int trans_count, i;
 
 	if (!reiserfs_journal_opened(fs))
 		reiserfs_panic("replay_journal: journal is not opened");
@@ -845,8 +1034,10 @@ int reiserfs_replay_journal(reiserfs_filsys_t fs)
 	control.trans_id = get_jh_last_flushed(j_head);
 	control.desc_blocknr = get_jh_replay_start_offset(j_head);
 
+	reiserfs_load_journal(fs);
 	trans_count = get_boundary_transactions(fs, &cur, &newest);
 	if (!trans_count) {
+		reiserfs_unload_journal(fs);
 		reiserfs_warning(stderr, "No transactions found\n");
 		return 0;
 	}
@@ -875,25 +1066,14 @@ int reiserfs_replay_journal(reiserfs_filsys_t fs)
 			break;
 
 		if (!transaction_check_content(fs, &cur)) {
-			progbar_clear(&progbar);
-			reiserfs_warning(stderr,
-					 "Trans broken: mountid %lu, transid %lu, desc %lu, "
-					 "len %lu, commit %lu, next trans offset %lu\n",
-					 cur.mount_id, cur.trans_id,
-					 cur.desc_blocknr, cur.trans_len,
-					 cur.commit_blocknr,
-					 cur.next_trans_offset);
+			broken = 1;
 			break;
 		}
 
-		reiserfs_warning(stderr,
-				 "Trans replayed: mountid %lu, transid %lu, desc %lu, "
-				 "len %lu, commit %lu, next trans offset %lu\n",
-				 cur.mount_id, cur.trans_id, cur.desc_blocknr,
-				 cur.trans_len, cur.commit_blocknr,
-				 cur.next_trans_offset);
-		replay_one_transaction(fs, &cur);
-		update_journal_header(fs, bh, &cur);
+		for_each_block(fs, &cur, log_replay_block);
+		trans = expandmem(trans, replayed * sizeof(reiserfs_trans_t),
+				  sizeof(reiserfs_trans_t));
+		trans[replayed] = cur;
 		control = cur;
 		replayed++;
 
@@ -904,6 +1084,29 @@ int reiserfs_replay_journal(reiserfs_filsys_t fs)
 	}
 	progbar_clear(&progbar);
 
+	replay_logged_blocks(fs);
+	reiserfs_unload_journal(fs);
+
+	/* blocks of them are on disk now */
+	for (i = 0; i < replayed; i++)
+		reiserfs_warning(stderr,
+				 "Trans replayed: mountid %lu, transid %lu, desc %lu, "
+				 "len %lu, commit %lu, next trans offset %lu\n",
+				 trans[i].mount_id, trans[i].trans_id,
+				 trans[i].desc_blocknr, trans[i].trans_len,
+				 trans[i].commit_blocknr,
+				 trans[i].next_trans_offset);
+	if (trans)
+		freemem(trans);
+
+	if (broken)
+		reiserfs_warning(stderr,
+				 "Trans broken: mountid %lu, transid %lu, desc %lu, "
+				 "len %lu, commit %lu, next trans offset %lu\n",
+				 cur.mount_id, cur.trans_id, cur.desc_blocknr,
+				 cur.trans_len, cur.commit_blocknr,
+				 cur.next_trans_offset);
+
 	reiserfs_warning(stderr,
 			 "\rReplaying journal: Done.\nReiserfs journal '%s' in blocks [%u..%u]: %d "
 			 "transactions replayed\n", fs->fs_j_file_name,
@@ -0,0 +1,578 @@
+/*
+ * Copyright 2000-2004 by Hans Reiser, licensing governed by
+ * reiserfsprogs/README
+ */
+
+/*
+ * Reading of metadata packed by debugreiserfs -p: leaves are unpacked here
+ * for debugreiserfs -u, and a pack with an index (see pack.h) can be opened
+ * as a read-only device.
+ */
+
+#include "includes.h"
+#include "pack.h"
+
+void pack_read(struct pack_input *in, void *buf, size_t size)
+{
+	char *p = buf;
+	size_t len;
+
+	while (size) {
+		if (in->pos == in->end && in->fill(in))
+			die("pack_read: packed stream ends unexpectedly "
+			    "(position %llu)", pack_input_offset(in));
+		len = in->end - in->pos;
+		if (len > size)
+			len = size;
+		memcpy(p, in->pos, len);
+		in->pos += len;
+		p += len;
+		size -= len;
+	}
+}
+
+static void unpack_offset(struct pack_input *in, struct packed_item *pi,
+			  struct item_head *ih, int blocksize)
+{
+
+	if (get_pi_mask(pi) & OFFSET_BITS_64) {
+		__u64 v64;
+
+		if (get_ih_key_format(ih) != KEY_FORMAT_2)
+			die("unpack_offset: key format is not set or wrong");
+		pack_read_le64(in, &v64);
+		set_offset(KEY_FORMAT_2, &ih->ih_key, v64);
+		return;
+	}
+
+	if (get_pi_mask(pi) & OFFSET_BITS_32) {
+		__u32 v32;
+
+		pack_read_le32(in, &v32);
+		set_offset(get_ih_key_format(ih), &ih->ih_key, v32);
+		return;
+	}
+
+	if ((get_pi_mask(pi) & DIR_ID) == 0
+	    && (get_pi_mask(pi) & OBJECT_ID) == 0) {
+		/* offset was not sent, as it can be calculated looking at the
+		   previous item */
+		if (is_stat_data_ih(ih - 1))
+			set_offset(get_ih_key_format(ih), &ih->ih_key, 1);
+		if (is_indirect_ih(ih - 1))
+			set_offset(get_ih_key_format(ih), &ih->ih_key,
+				   get_offset(&(ih - 1)->ih_key) +
+				   get_bytes_number(ih - 1, blocksize));
+	}
+	// offset is 0
+	return;
+}
+
+static void unpack_type(struct packed_item *pi, struct item_head *ih)
+{
+	set_type(get_ih_key_format(ih), &ih->ih_key, get_pi_type(pi));
+	if (type_unknown(&ih->ih_key))
+		reiserfs_panic("unpack_type: unknown type %d unpacked for %H\n",
+			       get_pi_type(pi), ih);
+}
+
+/* direntry item comes in the following format:
+   for each entry
+      mask - 8 bits
+      entry length - 16 bits
+      entry itself
+      deh_objectid - 32 bits
+      	maybe deh_dir_id (32 bits)
+	maybe gencounter (16)
+	maybe deh_state (16)
+*/
+static void unpack_direntry(struct pack_input *in, struct packed_item *pi,
+			    struct buffer_head *bh, struct item_head *ih,
+			    hashf_t hash_func)
+{
+	__u16 entry_count, namelen, gen_counter, entry_len;
+	__u8 mask;
+	int i;
+	struct reiserfs_de_head *deh;
+	int location;
+	char *item;
+
+/*    if (!hash_func)
+	die ("unpack_direntry: hash function is not set");*/
+
+	if (!(get_pi_mask(pi) & IH_FREE_SPACE))
+		die("ih_entry_count must be packed for directory items");
+
+	entry_count = get_ih_entry_count(ih);
+/*    if (!entry_count)
+	reiserfs_panic ("unpack_direntry: entry count should be set already");*/
+
+	item = bh->b_data + get_ih_location(ih);
+	deh = (struct reiserfs_de_head *)item;
+	location = get_pi_item_len(pi);
+	for (i = 0; i < entry_count; i++, deh++) {
+		pack_read8(in, &mask);
+		pack_read_le16(in, &entry_len);
+		location -= entry_len;
+		set_deh_location(deh, location);
+		pack_read(in, item + location, entry_len);
+
+		/* find name length */
+		if (*(item + location + entry_len - 1))
+			namelen = entry_len;
+		else
+			namelen = strlen(item + location);
+
+		pack_read32(in, &deh->deh2_objectid);
+		if (mask & HAS_DIR_ID)
+			pack_read32(in, &deh->deh2_dir_id);
+		else
+			set_deh_dirid(deh, get_key_objectid(&ih->ih_key));
+
+		if (*(item + location) == '.' && namelen == 1)
+			/* old or new "." */
+			set_deh_offset(deh, DOT_OFFSET);
+		else if (*(item + location) == '.'
+			 && *(item + location + 1) == '.' && namelen == 2)
+			/* old or new ".." */
+			set_deh_offset(deh, DOT_DOT_OFFSET);
+		else if (hash_func)
+			set_deh_offset(deh,
+				       hash_value(hash_func, item + location,
+						  namelen));
+		if (mask & HAS_GEN_COUNTER) {
+			pack_read_le16(in, &gen_counter);
+			set_deh_offset(deh, get_deh_offset(deh) | gen_counter);
+		}
+
+		if (mask & HAS_STATE)
+			pack_read16(in, &deh->deh2_state);
+		else
+			set_deh_state(deh, (1 << DEH_Visible2));
+	}
+
+	return;
+}
+
+/* struct packed_item is already unpacked */
+static void unpack_stat_data(struct pack_input *in, struct packed_item *pi,
+			     struct buffer_head *bh, struct item_head *ih)
+{
+	if (!(get_pi_mask(pi) & IH_FREE_SPACE)) {
+		/* ih_free_space was not packed - set default */
+		set_ih_entry_count(ih, 0xffff);
+	}
+
+	if (get_ih_key_format(ih) == KEY_FORMAT_1) {
+		/* stat data comes in the following format:
+		   if this is old stat data:
+		   mode - 16 bits
+		   nlink - 16 bits
+		   size - 32 bits
+		   blocks/rdev - 32 bits
+		   maybe first_direct byte 32 bits
+		 */
+		struct stat_data_v1 *sd;
+
+		sd = (struct stat_data_v1 *)ih_item_body(bh, ih);
+		memset(sd, 0, sizeof(*sd));
+
+		pack_read16(in, &sd->sd_mode);
+		pack_read16(in, &sd->sd_nlink);
+		pack_read32(in, &sd->sd_size);
+		pack_read32(in, &sd->u.sd_blocks);
+
+		if (get_pi_mask(pi) & WITH_SD_FIRST_DIRECT_BYTE) {
+			pack_read32(in, &sd->sd_first_direct_byte);
+		} else {
+			sd->sd_first_direct_byte = 0xffffffff;
+		}
+	} else {
+		/* for new stat data
+		   mode - 16 bits
+		   nlink in either 16 or 32 bits
+		   size in either 32 or 64 bits
+		   blocks - 32 bits
+		 */
+		struct stat_data *sd;
+
+		sd = (struct stat_data *)ih_item_body(bh, ih);
+		memset(sd, 0, sizeof(*sd));
+
+		pack_read16(in, &sd->sd_mode);
+
+		if (get_pi_mask(pi) & NLINK_BITS_32) {
+			pack_read32(in, &sd->sd_nlink);
+		} else {
+			__u16 nlink16;
+
+			pack_read16(in, &nlink16);
+			set_sd_v2_nlink(sd, le16_to_cpu(nlink16));
+		}
+
+		if (get_pi_mask(pi) & SIZE_BITS_64) {
+			pack_read64(in, &sd->sd_size);
+		} else {
+			__u32 size32;
+
+			/* We need the endian conversions since sd->sd_size is 64 bit */
+			pack_read_le32(in, &size32);
+			set_sd_v2_size(sd, size32);
+		}
+
+		pack_read32(in, &sd->sd_blocks);
+	}
+
+	return;
+}
+
+/* indirect item comes either in packed form or as is. ih_free_space
+   can go first */
+static void unpack_indirect(struct pack_input *in, struct packed_item *pi,
+			    struct buffer_head *bh, struct item_head *ih)
+{
+	__le32 *ind_item, *end;
+	int i;
+	__u16 v16;
+
+	if (!(get_pi_mask(pi) & IH_FREE_SPACE)) {
+		/* ih_free_space was not packed - set default */
+		set_ih_entry_count(ih, 0);
+	}
+
+	ind_item = (__le32 *) ih_item_body(bh, ih);
+
+	if (get_pi_mask(pi) & SAFE_LINK) {
+		d32_put(ind_item, 0, get_key_dirid(&ih->ih_key));
+		set_key_dirid(&ih->ih_key, (__u32) - 1);
+		return;
+	}
+
+	if (get_pi_mask(pi) & WHOLE_INDIRECT) {
+		pack_read(in, ind_item, get_pi_item_len(pi));
+		return;
+	}
+
+	end = ind_item + I_UNFM_NUM(ih);
+	while (ind_item < end) {
+		__u32 base;
+		pack_read32(in, ind_item);
+		pack_read_le16(in, &v16);
+		base = d32_get(ind_item, 0);
+		for (i = 1; i < v16; i++) {
+			if (base != 0)
+				d32_put(ind_item, i, base + i);
+			else
+				d32_put(ind_item, i, 0);
+		}
+		ind_item += i;
+	}
+	return;
+}
+
+// FIXME: we have no way to preserve symlinks
+static void unpack_direct(struct packed_item *pi, struct buffer_head *bh,
+			  struct item_head *ih)
+{
+	__le32 *d_item = (__le32 *) ih_item_body(bh, ih);
+
+	if (!(get_pi_mask(pi) & IH_FREE_SPACE))
+		/* ih_free_space was not packed - set default */
+		set_ih_entry_count(ih, 0xffff);
+
+	if (get_pi_mask(pi) & SAFE_LINK) {
+		d32_put(d_item, 0, get_key_dirid(&ih->ih_key));
+		set_key_dirid(&ih->ih_key, (__u32) - 1);
+	} else {
+		memset(d_item, 'a', get_pi_item_len(pi));
+	}
+	return;
+}
+
+/* make leaf in @block of @size bytes from the packed items which follow
+   the leaf start magic and block number in the stream */
+void unpack_leaf_items(struct pack_input *in, char *block, unsigned int size,
+		       hashf_t hash_func)
+{
+	struct buffer_head bh;
+	struct packed_item pi;
+	struct item_head *ih;
+	int i;
+	__le16 v16;
+	__le32 v32;
+
+	memset(&bh, 0, sizeof(bh));
+	bh.b_data = block;
+	bh.b_size = size;
+	memset(block, 0, size);
+
+	/* item number */
+	pack_read_le16(in, &v16);
+
+	set_blkh_nr_items(B_BLK_HEAD(&bh), v16);
+	set_blkh_level(B_BLK_HEAD(&bh), DISK_LEAF_NODE_LEVEL);
+	set_blkh_free_space(B_BLK_HEAD(&bh), MAX_FREE_SPACE(size));
+
+	ih = item_head(&bh, 0);
+	for (i = 0; i < get_blkh_nr_items(B_BLK_HEAD(&bh)); i++, ih++) {
+		pack_read(in, &pi, sizeof(struct packed_item));
+
+		/* dir_id - if it is there */
+		if (get_pi_mask(&pi) & DIR_ID) {
+			pack_read32(in, &v32);
+			set_key_dirid(&ih->ih_key, le32_to_cpu(v32));
+		} else {
+			if (!i)
+				die("unpack_leaf: dir_id is not set");
+			set_key_dirid(&ih->ih_key,
+				      get_key_dirid(&(ih - 1)->ih_key));
+		}
+
+		/* object_id - if it is there */
+		if (get_pi_mask(&pi) & OBJECT_ID) {
+			pack_read32(in, &v32);
+			set_key_objectid(&ih->ih_key, le32_to_cpu(v32));
+		} else {
+			if (!i)
+				die("unpack_leaf: object_id is not set");
+			set_key_objectid(&ih->ih_key,
+					 get_key_objectid(&(ih - 1)->ih_key));
+		}
+
+		// we need to set item format before offset unpacking
+		set_ih_key_format(ih,
+				  (get_pi_mask(&pi) & NEW_FORMAT) ? KEY_FORMAT_2
+				  : KEY_FORMAT_1);
+
+		// offset
+		unpack_offset(in, &pi, ih, size);
+
+		/* type */
+		unpack_type(&pi, ih);
+
+		/* ih_free_space and ih_format */
+		if (get_pi_mask(&pi) & IH_FREE_SPACE) {
+			pack_read16(in, &v16);
+			set_ih_entry_count(ih, le16_to_cpu(v16));
+		}
+
+		if (get_pi_mask(&pi) & IH_FORMAT)
+			pack_read16(in, &ih->ih_format);
+
+		/* item length and item location */
+		set_ih_item_len(ih, get_pi_item_len(&pi));
+		set_ih_location(ih,
+				(i ? get_ih_location(ih - 1) : size) -
+				get_pi_item_len(&pi));
+
+		// item itself
+		if (is_direct_ih(ih)) {
+			unpack_direct(&pi, &bh, ih);
+		} else if (is_indirect_ih(ih)) {
+			unpack_indirect(in, &pi, &bh, ih);
+		} else if (is_direntry_ih(ih)) {
+			unpack_direntry(in, &pi, &bh, ih, hash_func);
+		} else if (is_stat_data_ih(ih)) {
+			unpack_stat_data(in, &pi, &bh, ih);
+		}
+		set_blkh_free_space(B_BLK_HEAD(&bh),
+				    get_blkh_free_space(B_BLK_HEAD(&bh)) -
+				    (IH_SIZE + get_ih_item_len(ih)));
+	}
+
+	pack_read_le16(in, &v16);
+	if (v16 != LEAF_END_MAGIC)
+		die("unpack_leaf: wrong end signature found - %x", v16);
+}
+
+/* pack opened as a device */
+struct packed_device {
+	int fd;
+	unsigned int blocksize;
+	unsigned long block_count;
+	struct packed_index_entry *index;
+	unsigned long index_nr;
+
+	char *record;		/* packed block being unpacked */
+	unsigned long record_size;
+	char *block;		/* the block unpacked last */
+	unsigned long blocknr;
+};
+
+static int packed_record_end(struct pack_input *in)
+{
+	/* records are read whole */
+	return 1;
+}
+
+static int comp_packed_block(const void *p1, const void *p2)
+{
+	__u32 block = *(const __u32 *)p1;
+	__u32 entry = le32_to_cpu(((const struct packed_index_entry *)p2)->
+				  pie_block);
+
+	if (block != entry)
+		return block < entry ? -1 : 1;
+	return 0;
+}
+
+/* blocks which are not in the pack are read as zeros */
+static int packed_read_block(struct packed_device *dev, unsigned long blocknr)
+{
+	struct packed_index_entry *pie;
+	struct pack_input in;
+	__u32 block = blocknr;
+	unsigned long len;
+	__u16 magic16;
+	__u32 v32;
+
+	if (dev->blocknr == blocknr)
+		return 0;
+	dev->blocknr = ~0UL;
+
+	pie = bsearch(&block, dev->index, dev->index_nr, sizeof(*pie),
+		      comp_packed_block);
+	if (!pie) {
+		memset(dev->block, 0, dev->blocksize);
+		dev->blocknr = blocknr;
+		return 0;
+	}
+
+	len = le32_to_cpu(pie->pie_len);
+	if (len > dev->record_size) {
+		freemem(dev->record);
+		dev->record = getmem(len);
+		dev->record_size = len;
+	}
+
+	if (pread(dev->fd, dev->record, len, le64_to_cpu(pie->pie_offset)) !=
+	    (ssize_t) len)
+		return -1;
+
+	memset(&in, 0, sizeof(in));
+	in.buf = in.pos = dev->record;
+	in.end = dev->record + len;
+	in.base = le64_to_cpu(pie->pie_offset);
+	in.fill = packed_record_end;
+
+	pack_read_le16(&in, &magic16);
+	pack_read_le32(&in, &v32);
+	if (v32 != blocknr)
+		return -1;
+
+	switch (magic16 & 0xff) {
+	case LEAF_START_MAGIC:
+		unpack_leaf_items(&in, dev->block, dev->blocksize,
+				  code2func(magic16 >> 8));
+		break;
+	case FULL_BLOCK_START_MAGIC:
+		pack_read(&in, dev->block, dev->blocksize);
+		break;
+	default:
+		return -1;
+	}
+
+	dev->blocknr = blocknr;
+	return 0;
+}
+
+static int packed_device_read(void *data, unsigned long long offset,
+			      char *buf, size_t size)
+{
+	struct packed_device *dev = data;
+	unsigned long blocknr;
+	size_t skip, len;
+
+	while (size) {
+		blocknr = offset / dev->blocksize;
+		if (blocknr >= dev->block_count)
+			return -1;
+		skip = offset % dev->blocksize;
+		len = dev->blocksize - skip;
+		if (len > size)
+			len = size;
+
+		if (packed_read_block(dev, blocknr))
+			return -1;
+		memcpy(buf, dev->block + skip, len);
+
+		buf += len;
+		offset += len;
+		size -= len;
+	}
+	return 0;
+}
+
+/* If @fd is a pack made by debugreiserfs -p with the index, its blocks get
+   read as blocks of the packed device. Returns the number of blocks of the
+   packed device then, 0 otherwise */
+unsigned long reiserfs_open_packed(int fd)
+{
+	struct packed_trailer trailer;
+	struct packed_device *dev;
+	unsigned long size;
+	struct stat st;
+	off_t end;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+	    st.st_size < (off_t) sizeof(trailer))
+		return 0;
+
+	end = st.st_size - sizeof(trailer);
+	if (pread(fd, &trailer, sizeof(trailer), end) != sizeof(trailer) ||
+	    memcmp(trailer.pt_magic, PACKED_TRAILER_MAGIC,
+		   sizeof(trailer.pt_magic)) ||
+	    le16_to_cpu(trailer.pt_version) != PACKED_VERSION)
+		return 0;
+
+	size = le32_to_cpu(trailer.pt_index_nr) *
+	    sizeof(struct packed_index_entry);
+	if (le64_to_cpu(trailer.pt_index_offset) + size != (__u64) end ||
+	    !is_blocksize_correct(le16_to_cpu(trailer.pt_blocksize))) {
+		reiserfs_warning(stderr, "reiserfs_open_packed: the index of "
+				 "the pack is broken\n");
+		return 0;
+	}
+
+	dev = getmem(sizeof(*dev));
+	dev->fd = fd;
+	dev->blocksize = le16_to_cpu(trailer.pt_blocksize);
+	dev->block_count = le32_to_cpu(trailer.pt_block_count);
+	dev->index_nr = le32_to_cpu(trailer.pt_index_nr);
+	dev->index = getmem(size ? size : 1);
+	dev->block = getmem(dev->blocksize);
+	dev->blocknr = ~0UL;
+
+	if (pread(fd, dev->index, size, end - size) != (ssize_t) size) {
+		reiserfs_warning(stderr, "reiserfs_open_packed: could not read "
+				 "the index of the pack: %m\n");
+		freemem(dev->index);
+		freemem(dev->block);
+		freemem(dev);
+		return 0;
+	}
+
+	set_device_reader(fd, packed_device_read, dev);
+	return dev->block_count;
+}
+
+/* packed devices are read-only */
+int reiserfs_is_packed(int fd)
+{
+	return get_device_reader_data(fd) != NULL;
+}
+
+void reiserfs_close_packed(int fd)
+{
+	struct packed_device *dev = get_device_reader_data(fd);
+
+	if (!dev)
+		return;
+
+	set_device_reader(fd, NULL, NULL);
+	if (dev->record)
+		freemem(dev->record);
+	freemem(dev->index);
+	freemem(dev->block);
+	freemem(dev);
+}
@@ -1046,5 +1046,7 @@ void print_journal(reiserfs_filsys_t fs)
 	}
 	print_journal_header(fs);
 
+	reiserfs_load_journal(fs);
 	for_each_transaction(fs, print_one_transaction);
+	reiserfs_unload_journal(fs);
 }
@@ -79,7 +79,15 @@ reiserfs_filsys_t reiserfs_open(const char *filename, int flags,
 		return NULL;
 	}
 
-	fs = getmem(sizeof(*fs));
+	/* metadata packed by debugreiserfs -p can be read as the device */
+	if (reiserfs_open_packed(fd) && (flags & O_ACCMODE) != O_RDONLY) {
+		*error = EROFS;
+		reiserfs_close_packed(fd);
+		close(fd);
+		return NULL;
+	}
+
+	fs = getmem(sizeof(struct reiserfs_filsys_private));
 	fs->fs_dev = fd;
 	fs->fs_vp = vp;
 	asprintf(&fs->fs_file_name, "%s", filename);
@@ -104,6 +112,7 @@ reiserfs_filsys_t reiserfs_open(const char *filename, int flags,
 	*error = REISERFS_ET_BAD_MAGIC;
 
 	freemem(fs);
+	reiserfs_close_packed(fd);
 	close(fd);
 	fs = NULL;
 	return fs;
@@ -113,8 +122,9 @@ found:
 	if (!is_blocksize_correct(get_sb_block_size(sb))) {
 		*error = REISERFS_ET_BAD_SUPER;
 		freemem(fs);
-		close(fd);
 		brelse(bh);
+		reiserfs_close_packed(fd);
+		close(fd);
 		return NULL;
 	}
 
@@ -129,8 +139,9 @@ found:
 		if (!tmp_bh) {
 			*error = REISERFS_ET_SMALL_PARTITION;
 			freemem(fs);
-			close(fd);
 			brelse(bh);
+			reiserfs_close_packed(fd);
+			close(fd);
 			return NULL;
 		}
 
@@ -197,7 +208,7 @@ reiserfs_filsys_t reiserfs_create(const char *filename,
 		return NULL;
 	}
 
-	fs = getmem(sizeof(*fs));
+	fs = getmem(sizeof(struct reiserfs_filsys_private));
 	if (!fs) {
 		*error = errno;
 		return NULL;
@@ -325,12 +336,17 @@ static void reiserfs_only_reopen(reiserfs_filsys_t fs, int flag)
 {
 	unsigned long super_block;
 
+	if (reiserfs_is_packed(fs->fs_dev) && (flag & O_ACCMODE) != O_RDONLY)
+		die("reiserfs_reopen: %s is a packed metadata image, it can "
+		    "not be opened for writing", fs->fs_file_name);
+
 	/*  reiserfs_flush_to_ondisk_bitmap (fs->fs_bitmap2, fs); */
 	super_block = fs->fs_super_bh->b_blocknr;
 	brelse(fs->fs_super_bh);
 	flush_buffers(fs->fs_dev);
 
 	invalidate_buffers(fs->fs_dev);
+	reiserfs_close_packed(fs->fs_dev);
 	if (close(fs->fs_dev))
 		die("reiserfs_reopen: closed failed: %s", strerror(errno));
 
@@ -342,6 +358,7 @@ static void reiserfs_only_reopen(reiserfs_filsys_t fs, int flag)
 	if (fs->fs_dev == -1)
 		die("reiserfs_reopen: could not reopen device: %s",
 		    strerror(errno));
+	reiserfs_open_packed(fs->fs_dev);
 
 	fs->fs_super_bh = bread(fs->fs_dev, super_block, fs->fs_blocksize);
 	if (!fs->fs_super_bh)
@@ -390,6 +407,7 @@ void reiserfs_free(reiserfs_filsys_t fs)
 	fs->fs_super_bh = NULL;
 
 	free_buffers();
+	reiserfs_close_packed(fs->fs_dev);
 
 	free(fs->fs_file_name);
 	fs->fs_file_name = NULL;
@@ -426,20 +444,96 @@ int reiserfs_free_block(reiserfs_filsys_t fs, unsigned long block)
 	return 0;
 }
 
+/* reiserfs_search_by_key_x remembers the path it went down (the finger)
+   together with delimiting keys of every node of that path. Searches come
+   in key order mostly, so the next search usually starts from a node close
+   to the leaf level instead of the root. Any change of internal nodes makes
+   the finger useless: do_balance and whoever else changes internal nodes
+   must call this */
+void reiserfs_forget_search_finger(reiserfs_filsys_t fs)
+{
+	fs_private(fs)->finger.height = 0;
+}
+
+static int key_in_finger(struct reiserfs_search_finger *finger, int h,
+			 const struct reiserfs_key *key, int key_length)
+{
+	if (key_length == 4)
+		return comp_keys(&finger->lkeys[h], key) <= 0 &&
+		    comp_keys(key, &finger->rkeys[h]) < 0;
+
+	/* items of one object may be on both sides of a delimiting key when
+	   only 3 components are compared */
+	return comp_keys_3(&finger->lkeys[h], key) < 0 &&
+	    comp_keys_3(key, &finger->rkeys[h]) < 0;
+}
+
+/* put nodes of the finger above level @h into the path. Returns 0 if the
+   tree does not look like when the finger was set */
+static int follow_finger(reiserfs_filsys_t fs, struct reiserfs_path *path,
+			 int h)
+{
+	struct reiserfs_search_finger *finger = &fs_private(fs)->finger;
+	struct reiserfs_path_element *curr;
+	struct buffer_head *bh;
+	int i;
+
+	for (i = 0; i < h; i++) {
+		curr = PATH_OFFSET_PELEMENT(path, ++path->path_length);
+		bh = curr->pe_buffer =
+		    bread(fs->fs_dev, finger->blocks[i], fs->fs_blocksize);
+		if (bh == NULL) {
+			path->path_length--;
+			pathrelse(path);
+			return 0;
+		}
+		curr->pe_position = finger->positions[i];
+		if (!is_internal_node(bh) ||
+		    curr->pe_position > B_NR_ITEMS(bh) ||
+		    get_dc_child_blocknr(B_N_CHILD(bh, curr->pe_position)) !=
+		    finger->blocks[i + 1]) {
+			pathrelse(path);
+			return 0;
+		}
+	}
+	return 1;
+}
+
 static int reiserfs_search_by_key_x(reiserfs_filsys_t fs,
 				    const struct reiserfs_key *key,
 				    struct reiserfs_path *path, int key_length)
 {
+	struct reiserfs_search_finger *finger = &fs_private(fs)->finger;
 	struct buffer_head *bh;
 	unsigned long block;
 	struct reiserfs_path_element *curr;
 	int retval;
+	int h;
 
 	block = get_sb_root_block(fs->fs_ondisk_sb);
 	if (not_data_block(fs, block))
 		return IO_ERROR;
 
 	path->path_length = ILLEGAL_PATH_ELEMENT_OFFSET;
+
+	/* find the lowest node of the last path which covers the key */
+	h = 0;
+	if (finger->height && finger->root == block) {
+		for (h = finger->height - 1; h > 0; h--)
+			if (key_in_finger(finger, h, key, key_length))
+				break;
+		if (h && !follow_finger(fs, path, h))
+			h = 0;
+	}
+	if (h)
+		block = finger->blocks[h];
+	else {
+		finger->root = block;
+		finger->lkeys[0] = MIN_KEY;
+		finger->rkeys[0] = MAX_KEY;
+	}
+	finger->height = 0;
+
 	while (1) {
 		curr = PATH_OFFSET_PELEMENT(path, ++path->path_length);
 		bh = curr->pe_buffer =
@@ -455,18 +549,39 @@ static int reiserfs_search_by_key_x(reiserfs_filsys_t fs,
 					&curr->pe_position,
 					key_length ==
 					4 ? comp_keys : comp_keys_3);
+		if (h < MAX_HEIGHT)
+			finger->blocks[h] = block;
 		if (retval == POSITION_FOUND) {
 			/* key found, return if this is leaf level */
 			if (is_leaf_node(bh)) {
+				if (h < MAX_HEIGHT)
+					finger->height = h + 1;
 				path->pos_in_item = 0;
 				return ITEM_FOUND;
 			}
 			curr->pe_position++;
 		} else {
 			/* key not found in the node */
-			if (is_leaf_node(bh))
+			if (is_leaf_node(bh)) {
+				if (h < MAX_HEIGHT)
+					finger->height = h + 1;
 				return ITEM_NOT_FOUND;
+			}
+		}
+		/* internal nodes are used by every search */
+		mark_buffer_hot(bh);
+		if (h + 1 < MAX_HEIGHT) {
+			/* delimiting keys of the child */
+			finger->positions[h] = curr->pe_position;
+			finger->lkeys[h + 1] = curr->pe_position ?
+			    *internal_key(bh, curr->pe_position - 1) :
+			    finger->lkeys[h];
+			finger->rkeys[h + 1] =
+			    curr->pe_position < B_NR_ITEMS(bh) ?
+			    *internal_key(bh, curr->pe_position) :
+			    finger->rkeys[h];
 		}
+		h++;
 		block = get_dc_child_blocknr(B_N_CHILD(bh, curr->pe_position));
 		if (not_data_block(fs, block))
 			return IO_ERROR;
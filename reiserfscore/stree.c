@@ -403,6 +403,7 @@ int search_by_key(reiserfs_filsys_t fs, const struct reiserfs_key *p_s_key,	/* K
 		/* So we have chosen a position in the current node which is
 		   an internal node.  Now we calculate child block number by
 		   position in the node. */
+		mark_buffer_hot(p_s_bh);
 		n_block_number =
 		    get_dc_child_blocknr(B_N_CHILD
 					 (p_s_bh,
@@ -165,6 +165,7 @@ static unsigned long move_formatted_block(reiserfs_filsys_t fs,
 				set_dc_child_blocknr(B_N_CHILD(bh, i),
 						     moved_block);
 				mark_buffer_dirty(bh);
+				reiserfs_forget_search_finger(fs);
 			}
 		}
 	} else {
@@ -227,6 +228,7 @@ int shrink_fs(reiserfs_filsys_t fs, long long int blocks)
 	if (reiserfs_open_ondisk_bitmap(fs))
 		reiserfs_exit(1, "cannot open ondisk bitmap");
 	bmp = fs->fs_bitmap2;
+	reiserfs_bitmap_summarize(bmp);
 	ondisk_sb = fs->fs_ondisk_sb;
 
 	set_sb_fs_state(fs->fs_ondisk_sb, FS_ERROR);
@@ -276,11 +278,12 @@ int shrink_fs(reiserfs_filsys_t fs, long long int blocks)
 
 		/* make sure that none of truncated block are in use */
 		printf("check for used blocks in truncated region\n");
-		for (l = blocks; l < fs->fs_bitmap2->bm_bit_size; l++) {
+		for (l = reiserfs_bitmap_find_next_set(fs->fs_bitmap2, blocks);
+		     l < fs->fs_bitmap2->bm_bit_size;
+		     l = reiserfs_bitmap_find_next_set(fs->fs_bitmap2, l + 1)) {
 			if ((l % (fs->fs_blocksize * 8)) == 0)
 				continue;
-			if (reiserfs_bitmap_test_bit(fs->fs_bitmap2, l))
-				printf("<%lu>", l);
+			printf("<%lu>", l);
 		}
 		printf("\n");
 	}
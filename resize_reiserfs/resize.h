@@ -25,7 +25,7 @@
 #include <mntent.h>
 
 #define print_usage_and_exit() {\
- fprintf (stderr, "Usage: %s  [-s[+|-]#[G|M|K]] [-fqvV] device\n\n", argv[0]);\
+ fprintf (stderr, "Usage: %s  [-s[+|-]#[G|M|K]] [-fqvV] [--cache-size #[G|M|K]] device\n\n", argv[0]);\
  exit(16);\
 }
 
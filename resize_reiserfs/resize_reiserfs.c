@@ -14,6 +14,7 @@
 
 #include "resize.h"
 #include <limits.h>
+#include <getopt.h>
 
 static int opt_banner = 0;
 static int opt_skipj = 0;
@@ -190,6 +191,11 @@ int main(int argc, char *argv[])
 	reiserfs_filsys_t fs;
 	struct reiserfs_super_block *sb;
 
+	static struct option options[] = {
+		{"cache-size", required_argument, NULL, CACHE_SIZE_OPTION},
+		{}
+	};
+	long long int cache_size;
 	int c;
 	long error;
 
@@ -202,7 +208,8 @@ int main(int argc, char *argv[])
 	if (argc < 2)
 		print_usage_and_exit();
 
-	while ((c = getopt(argc, argv, "fvcqks:j:V")) != EOF) {
+	while ((c = getopt_long(argc, argv, "fvcqks:j:V", options, NULL))
+	       != EOF) {
 		switch (c) {
 		case 's':
 			if (!optarg)
@@ -237,6 +244,14 @@ int main(int argc, char *argv[])
 		case 'V':
 			opt_banner++;
 			break;
+		case CACHE_SIZE_OPTION:
+			cache_size = misc_str_to_bytes(optarg);
+			if (cache_size <= 0)
+				reiserfs_exit(1,
+					      "Wrong cache size is specified: %s",
+					      optarg);
+			set_buffer_cache_size(cache_size);
+			break;
 		default:
 			print_usage_and_exit();
 		}
@@ -193,28 +193,26 @@ static int set_standard_journal_params(reiserfs_filsys_t fs)
 	return 1;
 }
 
+/* number of journal blocks zeroed at once, between progress updates */
+#define ZERO_JOURNAL_BATCH 1024
+
 static void zero_journal(reiserfs_filsys_t fs)
 {
-	unsigned int i;
-	struct buffer_head *bh;
-	unsigned long done;
-	unsigned long start, len;
+	unsigned long start, len, done, i, count;
 
 	fprintf(stderr, "Initializing journal - ");
 
 	start = get_jp_journal_1st_block(sb_jp(fs->fs_ondisk_sb));
 	len = get_jp_journal_size(sb_jp(fs->fs_ondisk_sb));
 	done = 0;
-	for (i = 0; i < len; i++) {
-		print_how_far(stderr, &done, len, 1, 1 /*be quiet */ );
-		bh = getblk(fs->fs_journal_dev, start + i, fs->fs_blocksize);
-		if (!bh)
-			die("zero_journal: getblk failed");
-		memset(bh->b_data, 0, bh->b_size);
-		mark_buffer_dirty(bh);
-		mark_buffer_uptodate(bh, 1);
-		bwrite(bh);
-		brelse(bh);
+	for (i = 0; i < len; i += count) {
+		count = len - i < ZERO_JOURNAL_BATCH ? len - i :
+		    ZERO_JOURNAL_BATCH;
+		print_how_far(stderr, &done, len, count, 1 /*be quiet */ );
+		if (zero_blocks(fs->fs_journal_dev, start + i, count,
+				fs->fs_blocksize))
+			die("zero_journal: zeroing blocks failed: %s",
+			    strerror(errno));
 	}
 
 	fprintf(stderr, "\n");